@@ -0,0 +1,564 @@
+#include <ruby.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/** Number of threads used when scan isn't given a count. */
+#define DS_DEFAULT_THREADS 4
+
+/** Most threads scan will ever start. */
+#define DS_MAX_THREADS 64
+
+#define ERR_NOT_A_DIRECTORY "The directory to scan does not exist or is not a directory."
+#define ERR_NO_THREADS "Could not start any scanner threads."
+#define ERR_NO_INOTIFY "Watching directories needs Linux inotify, which isn't available."
+
+static VALUE cDSError;
+
+
+/**
+ * One file or directory found during the scan.  Everything is collected into
+ * plain C structures while the threads run, and only turned into Ruby objects
+ * after they're all done since the interpreter isn't thread safe.
+ */
+typedef struct ScanEntry {
+    char *path;
+    int is_dir;
+    off_t size;
+    time_t mtime;
+    ino_t inode;
+} ScanEntry;
+
+
+/**
+ * The shared state for a scan.  The queue holds the relative paths of the
+ * directories that still need to be read, and busy counts the threads that are
+ * in the middle of reading one (and so might add more to the queue).  When the
+ * queue is empty and nobody is busy the scan is over.
+ */
+typedef struct Scanner {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    const char *root;
+    char **queue;
+    size_t queue_len;
+    size_t queue_cap;
+    int busy;
+    ScanEntry *entries;
+    size_t count;
+    size_t cap;
+} Scanner;
+
+
+/**
+ * The same exclusion rule that ChangeSetBuilder.scan always used:  hidden
+ * "." files and CVS directories are skipped.
+ */
+static inline int excluded(const char *name)
+{
+    return name[0] == '.' || strcmp(name, "CVS") == 0;
+}
+
+
+static char *join_path(const char *dir, const char *name)
+{
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    char *path = malloc(dir_len + name_len + 2);
+
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, name, name_len + 1);
+
+    return path;
+}
+
+
+/** Adds one entry to the results, the lock must be held. */
+static void add_entry(Scanner *scan, ScanEntry *entry)
+{
+    if(scan->count == scan->cap) {
+        scan->cap = scan->cap ? scan->cap * 2 : 1024;
+        scan->entries = realloc(scan->entries, sizeof(ScanEntry) * scan->cap);
+    }
+
+    scan->entries[scan->count++] = *entry;
+}
+
+
+/** Queues a directory to be read, the lock must be held. */
+static void push_dir(Scanner *scan, char *path)
+{
+    if(scan->queue_len == scan->queue_cap) {
+        scan->queue_cap = scan->queue_cap ? scan->queue_cap * 2 : 256;
+        scan->queue = realloc(scan->queue, sizeof(char *) * scan->queue_cap);
+    }
+
+    scan->queue[scan->queue_len++] = path;
+}
+
+
+/**
+ * Reads one directory with readdir and fstatat against the open directory so
+ * every entry costs just one stat (two for symlinks).  Symlinks are reported
+ * as whatever they point at, but only real directories are descended into,
+ * which is what Find.find did.  The results are added in one go at the end to
+ * keep the lock out of the loop.
+ */
+static void scan_dir(Scanner *scan, const char *rel_path)
+{
+    char *full_path = join_path(scan->root, rel_path);
+    DIR *dir = opendir(full_path);
+    free(full_path);
+
+    // unreadable directories are skipped just like Find.find does
+    if(dir == NULL) return;
+
+    int fd = dirfd(dir);
+    struct dirent *ent = NULL;
+    struct stat st;
+    size_t found_len = 0, found_cap = 64;
+    ScanEntry *found = malloc(sizeof(ScanEntry) * found_cap);
+    int descend = 0;
+
+    while((ent = readdir(dir)) != NULL) {
+        if(excluded(ent->d_name)) continue;
+
+        if(fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) continue;
+
+        descend = S_ISDIR(st.st_mode);
+        if(S_ISLNK(st.st_mode) && fstatat(fd, ent->d_name, &st, 0) == -1) {
+            // dangling symlink, it's neither a file nor a directory
+            continue;
+        }
+
+        if(!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) continue;
+
+        if(found_len == found_cap) {
+            found_cap *= 2;
+            found = realloc(found, sizeof(ScanEntry) * found_cap);
+        }
+
+        found[found_len].path = join_path(rel_path, ent->d_name);
+        found[found_len].is_dir = S_ISDIR(st.st_mode) ? 1 + descend : 0;
+        found[found_len].size = st.st_size;
+        found[found_len].mtime = st.st_mtime;
+        found[found_len].inode = st.st_ino;
+        found_len++;
+    }
+
+    closedir(dir);
+
+    pthread_mutex_lock(&scan->lock);
+    size_t i = 0;
+    for(i = 0; i < found_len; i++) {
+        if(found[i].is_dir == 2) {
+            // a real directory, so it also has to be read
+            found[i].is_dir = 1;
+            push_dir(scan, strdup(found[i].path));
+        }
+
+        add_entry(scan, found + i);
+    }
+    pthread_mutex_unlock(&scan->lock);
+
+    free(found);
+}
+
+
+/**
+ * The thread body.  It keeps taking directories off the queue until the queue
+ * is empty and no other thread is still reading a directory.
+ */
+static void *scan_worker(void *data)
+{
+    Scanner *scan = (Scanner *)data;
+    char *rel_path = NULL;
+
+    pthread_mutex_lock(&scan->lock);
+
+    while(1) {
+        while(scan->queue_len == 0 && scan->busy > 0) {
+            pthread_cond_wait(&scan->ready, &scan->lock);
+        }
+
+        if(scan->queue_len == 0) {
+            // nothing left and nobody can add more, wake everyone up to leave
+            pthread_cond_broadcast(&scan->ready);
+            break;
+        }
+
+        rel_path = scan->queue[--scan->queue_len];
+        scan->busy++;
+        pthread_mutex_unlock(&scan->lock);
+
+        scan_dir(scan, rel_path);
+        free(rel_path);
+
+        pthread_mutex_lock(&scan->lock);
+        scan->busy--;
+        pthread_cond_broadcast(&scan->ready);
+    }
+
+    pthread_mutex_unlock(&scan->lock);
+    return NULL;
+}
+
+
+/*
+ * call-seq:
+ *   DirScan.scan(dir, [threads]) -> [files, dirs]
+ *
+ * Scans the whole tree under dir and returns a Hash of the files and an Array of the
+ * directories, with paths given as "./sub/file" just like Find.find(".") gives them
+ * when run inside dir.  Each value in the files Hash is [size, mtime, inode], so that
+ * nobody needs to stat the files again after the scan.
+ *
+ * It uses the same rules ChangeSetBuilder.scan always used:  files and directories
+ * starting with "." and CVS directories are skipped, symlinks are reported as the
+ * thing they point at, and symlinked directories aren't followed.
+ *
+ * The directories are read by threads (4 by default) with readdir and fstatat, so
+ * large trees on a cold cache or a network filesystem go a lot faster.  The Ruby
+ * interpreter is blocked until the scan is done.
+ */
+static VALUE DirScan_scan(int argc, VALUE *argv, VALUE self)
+{
+    VALUE dir, threads;
+    struct stat st;
+    Scanner scan;
+    pthread_t workers[DS_MAX_THREADS];
+    int thread_count = DS_DEFAULT_THREADS;
+    int started = 0;
+    int i = 0;
+
+    rb_scan_args(argc, argv, "11", &dir, &threads);
+
+    if(!NIL_P(threads)) {
+        thread_count = NUM2INT(threads);
+        if(thread_count < 1) thread_count = 1;
+        if(thread_count > DS_MAX_THREADS) thread_count = DS_MAX_THREADS;
+    }
+
+    VALUE dir_str = StringValue(dir);
+    char *root = malloc(RSTRING(dir_str)->len + 1);
+    memcpy(root, RSTRING(dir_str)->ptr, RSTRING(dir_str)->len);
+    root[RSTRING(dir_str)->len] = '\0';
+
+    if(stat(root, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        free(root);
+        rb_raise(cDSError, ERR_NOT_A_DIRECTORY);
+    }
+
+    memset(&scan, 0, sizeof(Scanner));
+    pthread_mutex_init(&scan.lock, NULL);
+    pthread_cond_init(&scan.ready, NULL);
+    scan.root = root;
+
+    // the top is always in the directory list, Find.find gives it first
+    ScanEntry top = { strdup("."), 1, st.st_size, st.st_mtime, st.st_ino };
+    add_entry(&scan, &top);
+    push_dir(&scan, strdup("."));
+
+    for(i = 0; i < thread_count; i++) {
+        if(pthread_create(&workers[started], NULL, scan_worker, &scan) == 0) {
+            started++;
+        }
+    }
+
+    for(i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    pthread_mutex_destroy(&scan.lock);
+    pthread_cond_destroy(&scan.ready);
+
+    // now that the threads are gone it's safe to make the Ruby objects
+    VALUE files = rb_hash_new();
+    VALUE dirs = rb_ary_new();
+    size_t n = 0;
+
+    for(n = 0; n < scan.count; n++) {
+        ScanEntry *entry = scan.entries + n;
+
+        if(started > 0) {
+            if(entry->is_dir) {
+                rb_ary_push(dirs, rb_str_new2(entry->path));
+            } else {
+                VALUE info = rb_ary_new();
+                rb_ary_push(info, OFFT2NUM(entry->size));
+                rb_ary_push(info, rb_time_new(entry->mtime, 0));
+                rb_ary_push(info, ULONG2NUM(entry->inode));
+                rb_hash_aset(files, rb_str_new2(entry->path), info);
+            }
+        }
+
+        free(entry->path);
+    }
+
+    for(n = 0; n < scan.queue_len; n++) free(scan.queue[n]);
+    free(scan.queue);
+    free(scan.entries);
+    free(root);
+
+    if(started == 0) {
+        rb_raise(cDSError, ERR_NO_THREADS);
+    }
+
+    VALUE result = rb_ary_new();
+    rb_ary_push(result, files);
+    rb_ary_push(result, dirs);
+
+    return result;
+}
+
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <signal.h>
+
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO)
+#define WATCH_BUFFER_SIZE (64 * 1024)
+#define WATCH_OVERFLOW "!OVERFLOW\n"
+
+/**
+ * Everything the watcher needs.  The inotify watch descriptors are small ints
+ * so the relative path for each one is just kept in an array indexed by it.
+ */
+typedef struct Watcher {
+    int fd;
+    const char *root;
+    const char *journal;
+    char **paths;
+    int paths_cap;
+    int overflowed;
+} Watcher;
+
+
+/**
+ * Writes all len bytes, going around again after a short write or a signal.
+ * Returns -1 if the write fails.
+ */
+static int write_all(int fd, const char *text, size_t len)
+{
+    while(len > 0) {
+        ssize_t done = write(fd, text, len);
+
+        if(done == -1) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+
+        text += done;
+        len -= done;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Appends the text to the journal.  The journal is opened and closed each time
+ * with O_APPEND so that one write is one whole batch of lines and the commands
+ * are free to replace the journal file at any time.
+ *
+ * Lost paths would make the commands miss changes, so if the batch can't be
+ * written an overflow line is written after it (on a line of its own), and if
+ * even that fails the journal is removed.  Either way the next reader does a
+ * full scan.
+ */
+static void journal_write(Watcher *w, const char *text, size_t len)
+{
+    int fd = open(w->journal, O_WRONLY | O_APPEND | O_CREAT, 0644);
+
+    if(fd == -1) {
+        unlink(w->journal);
+        return;
+    }
+
+    if(write_all(fd, text, len) == -1) {
+        if(write_all(fd, "\n" WATCH_OVERFLOW, strlen(WATCH_OVERFLOW) + 1) == -1) {
+            unlink(w->journal);
+        }
+    }
+
+    close(fd);
+}
+
+
+/**
+ * Adds a watch on the rel_path directory and everything under it.  If the
+ * kernel runs out of watches then the journal gets an overflow line so the
+ * commands know to do a full scan.
+ */
+static void watch_tree(Watcher *w, const char *rel_path)
+{
+    char *full_path = join_path(w->root, rel_path);
+    int wd = inotify_add_watch(w->fd, full_path, WATCH_EVENTS | IN_ONLYDIR);
+
+    if(wd == -1) {
+        if(errno == ENOSPC || errno == ENOMEM) {
+            journal_write(w, WATCH_OVERFLOW, strlen(WATCH_OVERFLOW));
+        }
+        free(full_path);
+        return;
+    }
+
+    if(wd >= w->paths_cap) {
+        int old_cap = w->paths_cap;
+        w->paths_cap = wd * 2 + 16;
+        w->paths = realloc(w->paths, sizeof(char *) * w->paths_cap);
+        memset(w->paths + old_cap, 0, sizeof(char *) * (w->paths_cap - old_cap));
+    }
+
+    if(w->paths[wd]) free(w->paths[wd]);
+    w->paths[wd] = strdup(rel_path);
+
+    DIR *dir = opendir(full_path);
+    free(full_path);
+    if(dir == NULL) return;
+
+    struct dirent *ent = NULL;
+    struct stat st;
+
+    while((ent = readdir(dir)) != NULL) {
+        if(excluded(ent->d_name)) continue;
+
+        if(fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode)) {
+            char *sub_path = join_path(rel_path, ent->d_name);
+            watch_tree(w, sub_path);
+            free(sub_path);
+        }
+    }
+
+    closedir(dir);
+}
+
+
+/*
+ * call-seq:
+ *   DirScan.watch(dir, journal) -> never returns
+ *
+ * Watches every directory under dir with inotify and appends the path (in the
+ * same "./sub/file" form as DirScan.scan) of anything created, changed, deleted,
+ * or moved to the journal file, one per line.  New directories are watched as
+ * soon as they show up.  If the kernel's event queue overflows or it runs out of
+ * watches a "!OVERFLOW" line is written so readers know they have to do a full
+ * scan.  Hidden files and CVS directories are skipped like in DirScan.scan.
+ *
+ * This never returns, it's meant to be run in its own process (see fcst watch)
+ * and it's stopped by killing that process with SIGTERM.
+ * It raises a DSError if inotify isn't available.
+ */
+static VALUE DirScan_watch(VALUE self, VALUE dir, VALUE journal)
+{
+    Watcher w;
+    char *buffer = NULL;
+    char *lines = NULL;
+    size_t lines_len = 0, lines_cap = WATCH_BUFFER_SIZE;
+    ssize_t len = 0;
+    ssize_t i = 0;
+
+    memset(&w, 0, sizeof(Watcher));
+    w.root = StringValueCStr(dir);
+    w.journal = StringValueCStr(journal);
+    w.fd = inotify_init();
+
+    if(w.fd == -1) {
+        rb_raise(cDSError, ERR_NO_INOTIFY);
+    }
+
+    // Ruby's handlers never get a chance to run from in here, so put the defaults back
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+
+    watch_tree(&w, ".");
+
+    buffer = malloc(WATCH_BUFFER_SIZE);
+    lines = malloc(lines_cap);
+
+    while((len = read(w.fd, buffer, WATCH_BUFFER_SIZE)) > 0 || errno == EINTR) {
+        lines_len = 0;
+
+        for(i = 0; i < len; i += sizeof(struct inotify_event) + ((struct inotify_event *)(buffer + i))->len) {
+            struct inotify_event *event = (struct inotify_event *)(buffer + i);
+
+            if(event->mask & IN_Q_OVERFLOW) {
+                journal_write(&w, WATCH_OVERFLOW, strlen(WATCH_OVERFLOW));
+                continue;
+            } else if(event->mask & IN_IGNORED) {
+                // the directory is gone, its parent's event already recorded it
+                if(event->wd < w.paths_cap && w.paths[event->wd]) {
+                    free(w.paths[event->wd]);
+                    w.paths[event->wd] = NULL;
+                }
+                continue;
+            }
+
+            if(event->len == 0 || excluded(event->name)) continue;
+            if(event->wd >= w.paths_cap || w.paths[event->wd] == NULL) continue;
+
+            char *path = join_path(w.paths[event->wd], event->name);
+            size_t path_len = strlen(path);
+
+            if((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                watch_tree(&w, path);
+            }
+
+            if(lines_len + path_len + 1 > lines_cap) {
+                lines_cap = (lines_len + path_len + 1) * 2;
+                lines = realloc(lines, lines_cap);
+            }
+
+            memcpy(lines + lines_len, path, path_len);
+            lines[lines_len + path_len] = '\n';
+            lines_len += path_len + 1;
+            free(path);
+        }
+
+        if(lines_len > 0) journal_write(&w, lines, lines_len);
+    }
+
+    // only gets here if the inotify descriptor breaks
+    free(buffer);
+    free(lines);
+    close(w.fd);
+    rb_sys_fail("inotify read");
+
+    return Qnil;
+}
+
+#else
+
+static VALUE DirScan_watch(VALUE self, VALUE dir, VALUE journal)
+{
+    rb_raise(cDSError, ERR_NO_INOTIFY);
+    return Qnil;
+}
+
+#endif
+
+
+static VALUE mDirScan;
+
+/**
+ * A small native directory scanner used by ChangeSetBuilder.scan so that finding
+ * the files in a big tree (and their sizes and mtimes) doesn't take four stat calls
+ * per file from Ruby.  It also has the inotify watcher run by fcst watch.
+ */
+void Init_dir_scan()
+{
+    mDirScan = rb_define_module("DirScan");
+    cDSError = rb_define_class("DSError", rb_eStandardError);
+
+    rb_define_module_function(mDirScan, "scan", DirScan_scan, -1);
+    rb_define_module_function(mDirScan, "watch", DirScan_watch, 2);
+}
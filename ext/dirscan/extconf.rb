@@ -0,0 +1,6 @@
+require 'mkmf'
+
+have_library("pthread", "pthread_create")
+have_header("sys/inotify.h")
+
+create_makefile("dir_scan")
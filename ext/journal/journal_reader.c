@@ -0,0 +1,284 @@
+#include <ruby.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The binary journal format written by ChangeSet::JournalWriter (see
+ * lib/fastcst/journal.rb for the full description).  Everything is little
+ * endian and every record is length prefixed:
+ *
+ *   "FCSTJRN1"
+ *   V(body_length) C(type) C(field_count) field_count * [ C(key) value ]
+ *
+ * Values are tagged with one character.  Paths are split at the last / and
+ * the directory part is interned:  the first time a directory is used it is
+ * written out in full and given the next number, after that only the number
+ * is written.
+ */
+
+#define JR_MAGIC "FCSTJRN1"
+#define JR_MAGIC_LEN 8
+#define JR_NEW_DIR 0xffffffffUL
+#define JR_CUSTOM_KEY 0xff
+#define JR_MAX_DEPTH 8
+
+#define ERR_BAD_MAGIC "This is not a binary journal (wrong header)."
+#define ERR_TRUNCATED "The journal is truncated or damaged."
+#define ERR_BAD_TAG "The journal has a value type this version can't read."
+#define ERR_BAD_TYPE "The journal has an operation type this version can't read."
+#define ERR_BAD_KEY "The journal has a field this version can't read."
+#define ERR_BAD_DIR "The journal refers to a directory it never defined."
+#define ERR_BAD_TIME "The journal has a time this system can't hold."
+
+static VALUE cJRError;
+
+/** The operation types, indexed by their code. */
+static const char *op_types[] = { NULL, "delete", "create", "move", "delta", "directory" };
+#define JR_OP_TYPE_COUNT 6
+
+/** The info keys, indexed by their code.  Their IDs are looked up in Init. */
+static const char *key_names[] = { NULL, "path", "to_path", "digest", "mtime", "length",
+    "symlink_target", "symlink", "delta_mode", "deleted_dirs", "created_dirs", "target_digest" };
+#define JR_KEY_COUNT 12
+static ID key_ids[JR_KEY_COUNT];
+
+
+/**
+ * Where the parser is in the journal, plus the interned directories.  The
+ * directories are kept in a Ruby array so they're safe from the GC.  The depth
+ * is how many arrays deep read_value is, so a damaged journal can't make it
+ * recurse until the stack runs out.
+ */
+typedef struct Parser {
+    const unsigned char *data;
+    size_t len;
+    size_t pos;
+    int depth;
+    VALUE dirs;
+} Parser;
+
+
+static void need(Parser *p, size_t count)
+{
+    if(p->len - p->pos < count) {
+        rb_raise(cJRError, ERR_TRUNCATED);
+    }
+}
+
+static unsigned char read_byte(Parser *p)
+{
+    need(p, 1);
+    return p->data[p->pos++];
+}
+
+static unsigned long read_long(Parser *p)
+{
+    const unsigned char *b = NULL;
+
+    need(p, 4);
+    b = p->data + p->pos;
+    p->pos += 4;
+
+    return (unsigned long)b[0] | ((unsigned long)b[1] << 8) | ((unsigned long)b[2] << 16) | ((unsigned long)b[3] << 24);
+}
+
+static VALUE read_string(Parser *p)
+{
+    unsigned long len = read_long(p);
+    VALUE str = Qnil;
+
+    need(p, len);
+    str = rb_str_new((const char *)p->data + p->pos, len);
+    p->pos += len;
+
+    return str;
+}
+
+static VALUE read_path(Parser *p)
+{
+    unsigned long dir_id = read_long(p);
+    VALUE dir = Qnil;
+    VALUE path = Qnil;
+    VALUE base = Qnil;
+
+    if(dir_id == JR_NEW_DIR) {
+        dir = read_string(p);
+        rb_ary_push(p->dirs, dir);
+    } else {
+        dir = rb_ary_entry(p->dirs, (long)dir_id);
+        if(NIL_P(dir)) {
+            rb_raise(cJRError, ERR_BAD_DIR);
+        }
+    }
+
+    base = read_string(p);
+    path = rb_str_dup(dir);
+    rb_str_cat(path, "/", 1);
+    rb_str_append(path, base);
+
+    return path;
+}
+
+static VALUE read_value(Parser *p)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char tag = read_byte(p);
+    unsigned long lo = 0, hi = 0, count = 0, i = 0;
+    LONG_LONG seconds = 0;
+    char digest[32];
+    VALUE ary = Qnil;
+
+    switch(tag) {
+        case 's':
+            return read_string(p);
+        case 'p':
+            return read_path(p);
+        case 'h':
+            need(p, 16);
+            for(i = 0; i < 16; i++) {
+                digest[i * 2] = hex[p->data[p->pos + i] >> 4];
+                digest[i * 2 + 1] = hex[p->data[p->pos + i] & 0x0f];
+            }
+            p->pos += 16;
+            return rb_str_new(digest, 32);
+        case 'i':
+            lo = read_long(p);
+            hi = read_long(p);
+            return hi ? rb_ull2inum(((unsigned LONG_LONG)hi << 32) | lo) : ULONG2NUM(lo);
+        case 't':
+            lo = read_long(p);
+            hi = read_long(p);
+            seconds = (LONG_LONG)(((unsigned LONG_LONG)hi << 32) | lo);
+            if((LONG_LONG)(time_t)seconds != seconds) {
+                rb_raise(cJRError, ERR_BAD_TIME);
+            }
+            return rb_time_new((time_t)seconds, (long)read_long(p));
+        case 'T':
+            return Qtrue;
+        case 'F':
+            return Qfalse;
+        case 'N':
+            return Qnil;
+        case 'a':
+            count = read_long(p);
+            /* every value is at least its tag byte */
+            need(p, count);
+            if(p->depth >= JR_MAX_DEPTH) {
+                rb_raise(cJRError, ERR_BAD_TAG);
+            }
+
+            p->depth++;
+            ary = rb_ary_new2(count);
+            for(i = 0; i < count; i++) {
+                rb_ary_push(ary, read_value(p));
+            }
+            p->depth--;
+            return ary;
+        default:
+            rb_raise(cJRError, ERR_BAD_TAG);
+    }
+
+    return Qnil;
+}
+
+static VALUE read_record(Parser *p)
+{
+    unsigned long body_len = read_long(p);
+    size_t end = 0;
+    unsigned char type = 0, fields = 0, key = 0, i = 0;
+    VALUE info = Qnil;
+    VALUE key_sym = Qnil;
+    VALUE record = Qnil;
+
+    need(p, body_len);
+    end = p->pos + body_len;
+
+    type = read_byte(p);
+    if(type == 0 || type >= JR_OP_TYPE_COUNT) {
+        rb_raise(cJRError, ERR_BAD_TYPE);
+    }
+
+    fields = read_byte(p);
+    info = rb_hash_new();
+
+    for(i = 0; i < fields; i++) {
+        key = read_byte(p);
+
+        if(key == JR_CUSTOM_KEY) {
+            key_sym = rb_str_intern(read_string(p));
+        } else if(key > 0 && key < JR_KEY_COUNT) {
+            key_sym = ID2SYM(key_ids[key]);
+        } else {
+            rb_raise(cJRError, ERR_BAD_KEY);
+        }
+
+        rb_hash_aset(info, key_sym, read_value(p));
+    }
+
+    if(p->pos != end) {
+        rb_raise(cJRError, ERR_TRUNCATED);
+    }
+
+    record = rb_ary_new();
+    rb_ary_push(record, rb_str_new2(op_types[type]));
+    rb_ary_push(record, info);
+
+    return record;
+}
+
+
+/*
+ * call-seq:
+ *   JournalReader.parse(data) -> [[type, info], ...]
+ *
+ * Parses a whole binary journal (already uncompressed) and returns the operations
+ * in the same [type, info] form that the YAML journals have.  Raises JRError if the
+ * journal is damaged or was written by a newer version.
+ */
+static VALUE JournalReader_parse(VALUE self, VALUE data)
+{
+    Parser p;
+    VALUE str = StringValue(data);
+    VALUE records = rb_ary_new();
+
+    p.data = (const unsigned char *)RSTRING(str)->ptr;
+    p.len = RSTRING(str)->len;
+    p.pos = 0;
+    p.depth = 0;
+    p.dirs = rb_ary_new();
+
+    if(p.len < JR_MAGIC_LEN || memcmp(p.data, JR_MAGIC, JR_MAGIC_LEN) != 0) {
+        rb_raise(cJRError, ERR_BAD_MAGIC);
+    }
+    p.pos = JR_MAGIC_LEN;
+
+    while(p.pos < p.len) {
+        rb_ary_push(records, read_record(&p));
+    }
+
+    return records;
+}
+
+
+static VALUE mJournalReader;
+
+/**
+ * Reads the binary changeset journals.  Parsing the YAML journals was the slowest
+ * part of applying a big changeset, so the records are read here and handed back
+ * as plain arrays and hashes.  Writing is done in Ruby by ChangeSet::JournalWriter.
+ */
+void Init_journal_reader()
+{
+    int i = 0;
+
+    mJournalReader = rb_define_module("JournalReader");
+    cJRError = rb_define_class("JRError", rb_eStandardError);
+
+    for(i = 1; i < JR_KEY_COUNT; i++) {
+        key_ids[i] = rb_intern(key_names[i]);
+    }
+
+    rb_define_const(mJournalReader, "MAGIC", rb_str_new2(JR_MAGIC));
+    rb_define_const(mJournalReader, "MAX_DEPTH", INT2FIX(JR_MAX_DEPTH));
+    rb_define_module_function(mJournalReader, "parse", JournalReader_parse, 1);
+}
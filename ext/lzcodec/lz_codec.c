@@ -0,0 +1,229 @@
+#include <ruby.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A small and fast LZ77 compressor used as the "lz" codec for changeset
+ * journals and data (see lib/fastcst/codec.rb).  It writes the same block
+ * layout as LZ4 so it's easy to check against other tools, but it's only a
+ * greedy single hash compressor and doesn't try for the best ratio.  The
+ * point is to be several times faster than zlib for local operations.
+ *
+ * The compressed block is a series of sequences:
+ *
+ *   token  -- high 4 bits literal count, low 4 bits match length - 4
+ *   [255...]  extra literal count bytes when the count is 15 or more
+ *   literals
+ *   offset -- 2 bytes little endian, how far back the match starts
+ *   [255...]  extra match length bytes when the length is 19 or more
+ *
+ * The last sequence is just literals.  The block doesn't record its own
+ * length, so decompress has to be told how long the result is.
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+#define LZ_HASH_BITS 14
+#define LZ_MAX_OFFSET 65535
+/* a block byte makes at most 255 bytes of output (one 255 in a match length), plus a little for the token */
+#define LZ_MAX_EXPANSION 255
+#define LZ_EXPANSION_SLACK 32
+
+#define ERR_DAMAGED "The compressed data is damaged or the length is wrong."
+
+static VALUE cLZError;
+
+typedef unsigned char byte;
+
+
+static unsigned int read32(const byte *p)
+{
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static unsigned int lz_hash(unsigned int v)
+{
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/** Writes a count that didn't fit in the token as a run of 255s and the rest. */
+static byte *write_length(byte *out, size_t len)
+{
+    while(len >= 255) {
+        *out++ = 255;
+        len -= 255;
+    }
+    *out++ = (byte)len;
+    return out;
+}
+
+static byte *write_sequence(byte *out, const byte *literals, size_t lit_len, size_t offset, size_t match_len)
+{
+    byte *token = out++;
+    size_t extra = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+    *token = (byte)((lit_len < 15 ? lit_len : 15) << 4);
+    if(lit_len >= 15) out = write_length(out, lit_len - 15);
+    memcpy(out, literals, lit_len);
+    out += lit_len;
+
+    if(match_len) {
+        *out++ = (byte)(offset & 0xff);
+        *out++ = (byte)(offset >> 8);
+        *token |= (byte)(extra < 15 ? extra : 15);
+        if(extra >= 15) out = write_length(out, extra - 15);
+    }
+
+    return out;
+}
+
+
+/**
+ * call-seq:
+ *   LZCodec.compress(data) -> compressed
+ *
+ * Compresses the String and returns the block.  Use LZCodec.decompress with
+ * data.length to get it back.
+ */
+static VALUE LZCodec_compress(VALUE self, VALUE data)
+{
+    const byte *in, *ip, *anchor, *limit, *end;
+    byte *out, *op;
+    size_t len;
+    long *table;
+    VALUE result;
+
+    StringValue(data);
+    in = (const byte *)RSTRING(data)->ptr;
+    len = RSTRING(data)->len;
+    end = in + len;
+    limit = len > LZ_MATCH_LIMIT ? end - LZ_MATCH_LIMIT : in;
+
+    /* worst case is every byte a literal plus the length bytes */
+    out = ALLOC_N(byte, len + len / 255 + 16);
+    table = ALLOC_N(long, 1 << LZ_HASH_BITS);
+    memset(table, 0xff, sizeof(long) * (1 << LZ_HASH_BITS));
+
+    op = out;
+    ip = anchor = in;
+
+    while(ip < limit) {
+        unsigned int h = lz_hash(read32(ip));
+        long candidate = table[h];
+        table[h] = ip - in;
+
+        if(candidate >= 0 && (ip - in) - candidate <= LZ_MAX_OFFSET && read32(in + candidate) == read32(ip)) {
+            const byte *match = in + candidate;
+            const byte *match_end = end - LZ_LAST_LITERALS;
+            size_t match_len = LZ_MIN_MATCH;
+
+            while(ip + match_len < match_end && match[match_len] == ip[match_len]) match_len++;
+
+            op = write_sequence(op, anchor, ip - anchor, ip - match, match_len);
+            ip += match_len;
+            anchor = ip;
+        } else {
+            ip++;
+        }
+    }
+
+    op = write_sequence(op, anchor, end - anchor, 0, 0);
+
+    result = rb_str_new((const char *)out, op - out);
+    free(table);
+    free(out);
+    return result;
+}
+
+
+/**
+ * call-seq:
+ *   LZCodec.decompress(block, length) -> data
+ *
+ * Decompresses a block made by LZCodec.compress back into the length bytes
+ * it came from.  Raises LZError if the block is damaged or doesn't come out
+ * to exactly length bytes.  A length the block couldn't possibly expand to
+ * is refused before anything is allocated for it.
+ */
+static VALUE LZCodec_decompress(VALUE self, VALUE block, VALUE length)
+{
+    const byte *ip, *end;
+    byte *out, *op, *out_end;
+    size_t len = NUM2ULONG(length);
+    VALUE result;
+
+    StringValue(block);
+    ip = (const byte *)RSTRING(block)->ptr;
+    end = ip + RSTRING(block)->len;
+
+    if(len > LZ_EXPANSION_SLACK && (len - LZ_EXPANSION_SLACK) / LZ_MAX_EXPANSION > (size_t)RSTRING(block)->len) {
+        rb_raise(cLZError, ERR_DAMAGED);
+    }
+
+    result = rb_str_new(NULL, len);
+    out = op = (byte *)RSTRING(result)->ptr;
+    out_end = out + len;
+
+    while(ip < end) {
+        byte token = *ip++;
+        size_t lit_len = token >> 4;
+        size_t match_len, offset;
+
+        if(lit_len == 15) {
+            byte b;
+            do {
+                if(ip >= end) rb_raise(cLZError, ERR_DAMAGED);
+                b = *ip++;
+                lit_len += b;
+            } while(b == 255);
+        }
+
+        if((size_t)(end - ip) < lit_len || (size_t)(out_end - op) < lit_len) rb_raise(cLZError, ERR_DAMAGED);
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        /* the last sequence has no match */
+        if(ip == end) break;
+
+        if(end - ip < 2) rb_raise(cLZError, ERR_DAMAGED);
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        match_len = token & 0x0f;
+        if(match_len == 15) {
+            byte b;
+            do {
+                if(ip >= end) rb_raise(cLZError, ERR_DAMAGED);
+                b = *ip++;
+                match_len += b;
+            } while(b == 255);
+        }
+        match_len += LZ_MIN_MATCH;
+
+        if(offset == 0 || offset > (size_t)(op - out) || (size_t)(out_end - op) < match_len) rb_raise(cLZError, ERR_DAMAGED);
+
+        /* byte at a time since the match can overlap what it's writing */
+        while(match_len--) {
+            *op = *(op - offset);
+            op++;
+        }
+    }
+
+    if(op != out_end) rb_raise(cLZError, ERR_DAMAGED);
+
+    return result;
+}
+
+
+void Init_lz_codec()
+{
+    VALUE mLZCodec;
+
+    mLZCodec = rb_define_module("LZCodec");
+    cLZError = rb_define_class("LZError", rb_eStandardError);
+
+    rb_define_module_function(mLZCodec, "compress", LZCodec_compress, 1);
+    rb_define_module_function(mLZCodec, "decompress", LZCodec_decompress, 2);
+}
@@ -2,19 +2,76 @@
 #include <assert.h>
 #include <sarray.h>
 
+/** How many bytes of each suffix are copied next to its suffix array entry. */
+#define SA_HEAD_BYTES 8
+
+/** The default number of leading bytes used to index the bucket table. */
+#define SA_DEFAULT_BUCKET_BYTES 2
+
+/**
+ * One entry in the suffix array.  The first few bytes of the suffix are kept
+ * right next to the index so that most of the comparisons during a search
+ * are resolved inside one cache line without touching the source at all.
+ */
+typedef struct SuffixEntry {
+    int index;
+    unsigned char head[SA_HEAD_BYTES];
+} SuffixEntry;
+
+/**
+ * A slot in the open addressing hash table of the source's fixed size blocks
+ * used by next_block_match.  The offset is -1 for an empty slot.
+ */
+typedef struct BlockSlot {
+    unsigned int hash;
+    int offset;
+} BlockSlot;
+
+/**
+ * The hash table of a source's blocks.  It's all a BlockIndex is, and a
+ * SuffixArray has one too so it can do next_block_match itself.
+ */
+typedef struct BlockTable {
+    BlockSlot *blocks;
+    size_t block_slots;
+    size_t block_size;
+} BlockTable;
+
+/**
+ * The entries are the actual suffix array.  The buckets table is indexed by
+ * the first bucket_bytes bytes of a suffix (padded with 0 for short suffixes)
+ * and gives the first entry with that prefix, so buckets[key] to buckets[key+1]
+ * is the range to search.  The starts/ends are the same thing for just the
+ * first byte and are kept for the quick character checks.  The table is the
+ * source's blocks for next_block_match.
+ */
 typedef struct SuffixArray {
-    int *suffix_index;
+    SuffixEntry *entries;
+    unsigned int *buckets;
+    int bucket_bytes;
     unsigned int ends[256];
     unsigned int starts[256];
+    BlockTable table;
 } SuffixArray;
 
+/** Multiplier for the rolling block hash. */
+#define BLOCK_HASH_BASE 257
+
+#define SA_INDEX(sa, i) ((sa)->entries[(i)].index)
+
 
 #define ERR_NO_ZERO_LENGTH_INPUT "Cannot create a suffix array from a 0 length input source."
 #define ERR_NOT_INITIALIZED "Initialization failed, you cannot use this object."
 #define ERR_START_IF_ARRAY "You must provide a start argument if you give an array argument."
 #define ERR_MISMATCH_LENGTH "The raw array length is different from the source length"
+#define ERR_BUCKET_BYTES "The bucket bytes must be 2 or 3"
+
+/** Number of matching characters that must follow a mismatch before extend_match accepts it. */
+#define MIN_MISMATCH_RUN 8
 static VALUE cSAError;
 
+void Init_token_array(VALUE error_class);
+
 
 inline int scan_string(unsigned char *source, size_t src_len, 
                           unsigned char *target, size_t *tgt_len)
@@ -42,48 +99,132 @@ inline int scan_string(unsigned char *source, size_t src_len,
     
 }
 
+/**
+ * Compares the target against the suffix at the given entry, using the head
+ * bytes stored in the entry first and only going to the source if they all
+ * match.  It works just like scan_string, with tgt_len as an in/out parameter.
+ */
+static inline int scan_entry(SuffixEntry *entry, unsigned char *source, size_t src_len,
+                             unsigned char *target, size_t *tgt_len)
+{
+    size_t suffix_len = src_len - entry->index;
+    size_t head_len = suffix_len < SA_HEAD_BYTES ? suffix_len : SA_HEAD_BYTES;
+    size_t i = 0;
+    
+    if(head_len > *tgt_len) head_len = *tgt_len;
+    
+    for(i = 0; i < head_len; i++) {
+        if(target[i] != entry->head[i]) {
+            *tgt_len = i;
+            return target[i] - entry->head[i];
+        }
+    }
+    
+    if(i == *tgt_len) {
+        // the whole target matched inside the head
+        return 0;
+    } else if(i == suffix_len) {
+        // the suffix ran out first, so it's shorter and sorts lower than the target
+        *tgt_len = i;
+        return 1;
+    } else {
+        // the head matched completely, so finish the job in the source
+        size_t rest = *tgt_len - i;
+        int result = scan_string(source + entry->index + i, suffix_len - i, target + i, &rest);
+        *tgt_len = i + rest;
+        return result;
+    }
+}
+
+
+/**
+ * Builds the bucket key for the first bucket_bytes of the given string, padding with
+ * the pad byte if the string is shorter than that.
+ */
+static inline size_t bucket_key(unsigned char *str, size_t len, int bucket_bytes, unsigned char pad)
+{
+    size_t key = 0;
+    int i = 0;
+    
+    for(i = 0; i < bucket_bytes; i++) {
+        key = (key << 8) | ((size_t)i < len ? str[i] : pad);
+    }
+    
+    return key;
+}
+
+
+/**
+ * Finds the inclusive range in the suffix array that shares the longest possible
+ * prefix (up to bucket_bytes long) with the target.  It returns 0 if not even the
+ * first character of the target is in the source.
+ */
+static int find_bucket(SuffixArray *sa, unsigned char *target, size_t tgt_len, size_t *low, size_t *high)
+{
+    size_t len = tgt_len < (size_t)sa->bucket_bytes ? tgt_len : (size_t)sa->bucket_bytes;
+    
+    for(; len > 0; len--) {
+        size_t first = sa->buckets[bucket_key(target, len, sa->bucket_bytes, 0x00)];
+        size_t last = sa->buckets[bucket_key(target, len, sa->bucket_bytes, 0xff) + 1];
+        
+        if(first < last) {
+            *low = first;
+            *high = last - 1;
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+
 /**
  * Returns the index in the suffix array where where the longest match is found.
  * REMEMBER! It's the suffix array index.  If you want the source string  index
- * then you must do sa[start].
+ * then you must do SA_INDEX(sa, start).
+ *
+ * The bucket table narrows the search down to the suffixes sharing the first few
+ * bytes with the target, and then a binary search is done inside that range.
  */
-size_t find_longest_match(unsigned char *source, size_t src_len, 
-                          unsigned char *target, size_t *tgt_len, 
-                          unsigned int starts[], unsigned int ends[], unsigned int sa[]) 
+size_t find_longest_match(SuffixArray *sa, unsigned char *source, size_t src_len, 
+                          unsigned char *target, size_t *tgt_len)
 {
-    size_t high = ends[*target] + 1;
-    size_t low = starts[*target];
-    size_t middle = (low + high) / 2;  // middle is pre-calculated so the while loop can exit
+    size_t high = 0;
+    size_t low = 0;
+    size_t middle = 0;
     size_t length = 0;
     size_t scan_len = 0;
-    size_t src_i = 0;
     int result = 0;
     size_t last_match = 0;
     
-    while(low <= high && high <= src_len && middle <= src_len && length != *tgt_len) {
-        src_i = sa[middle];
+    if(*tgt_len == 0 || !find_bucket(sa, target, *tgt_len, &low, &high)) {
+        // nothing in the source starts like the target
+        *tgt_len = 0;
+        return 0;
+    }
+    
+    while(low <= high && length != *tgt_len) {
+        middle = low + (high - low) / 2;
         scan_len = *tgt_len;
         
-        result = scan_string(source + src_i, src_len - src_i, target, &scan_len);
+        result = scan_entry(sa->entries + middle, source, src_len, target, &scan_len);
         
-        if(scan_len > length)  {
+        if(scan_len > length || length == 0)  {
             length = scan_len;
             last_match = middle;
         }
         
-        if(result == 0)
+        if(result == 0) {
             // found it so we're done
             break;
-        else if(result < 0) {
+        } else if(result < 0) {
             // it's less than our current mid-point so drop down
+            if(middle == 0) break;
             high = middle - 1;
         } else {
             // it's greater than our current mid-point so push up
             low = middle + 1;
         }
-
-        // recalculate the middle
-        middle = (low + high) / 2;
     }
     
     *tgt_len = length;
@@ -91,6 +232,55 @@ size_t find_longest_match(unsigned char *source, size_t src_len,
 }
 
 
+/**
+ * Fills in the entries (with their head bytes), the 1 byte starts/ends, and the bucket table
+ * from the raw integer suffix array that was either built or given to us.
+ */
+static void SuffixArray_setup(SuffixArray *sa, unsigned char *source, size_t source_len, int *index)
+{
+    size_t i = 0;
+    size_t key = 0;
+    size_t next_key = 0;
+    size_t bucket_count = (size_t)1 << (8 * sa->bucket_bytes);
+    
+    // the interleaved entries with the first bytes of each suffix copied in
+    for(i = 0; i <= source_len; i++) {
+        size_t suffix_len = source_len - index[i];
+        sa->entries[i].index = index[i];
+        memset(sa->entries[i].head, 0, SA_HEAD_BYTES);
+        memcpy(sa->entries[i].head, source + index[i], suffix_len < SA_HEAD_BYTES ? suffix_len : SA_HEAD_BYTES);
+    }
+    
+    unsigned char c = source[SA_INDEX(sa, 0)];  // start off with the first char in the sarray list
+    sa->starts[c] = 0;
+    for(i = 0; i < source_len; i++) {
+        // skip characters until we see a new one
+        if(source[SA_INDEX(sa, i)] != c) {
+            sa->ends[c] = i-1; // it's -1 since this is a new character, so the end was actually behind this point
+            c = source[SA_INDEX(sa, i)];
+            sa->starts[c] = i;
+        }
+    }
+    // set the last valid character to get the tail of the sa, the loop will miss it
+    c = source[SA_INDEX(sa, source_len-1)];
+    sa->ends[c] = source_len-1;
+    
+    // the keys are in sorted order through the suffix array, so each bucket starts
+    // where the first key at least as big as it is found
+    for(i = 0; i <= source_len; i++) {
+        key = bucket_key(sa->entries[i].head, source_len - SA_INDEX(sa, i), sa->bucket_bytes, 0x00);
+        while(next_key <= key) {
+            sa->buckets[next_key++] = i;
+        }
+    }
+    
+    // everything after the last key is empty
+    while(next_key <= bucket_count) {
+        sa->buckets[next_key++] = source_len + 1;
+    }
+}
+
+
 /*
  * call-seq:
  *    sarray.source -> String
@@ -106,7 +296,9 @@ static VALUE SuffixArray_source(VALUE self)
 
 static void SuffixArray_free(void *p) {
     SuffixArray *sa = (SuffixArray *)p;
-    if(sa->suffix_index) free(sa->suffix_index);
+    if(sa->entries) free(sa->entries);
+    if(sa->buckets) free(sa->buckets);
+    if(sa->table.blocks) free(sa->table.blocks);
     if(sa) free(sa);
 }
 
@@ -121,7 +313,7 @@ static VALUE SuffixArray_alloc(VALUE klass)
 
 /*
  * call-seq:
- *   SuffixArray.new(source, [raw_array], [start]) -> SuffixArray
+ *   SuffixArray.new(source, [raw_array], [start], [bucket_bytes]) -> SuffixArray
  * 
  * Given a string (anything like a string really) this will generate a
  * suffix array for the string so that you can work with it.  The
@@ -132,6 +324,12 @@ static VALUE SuffixArray_alloc(VALUE klass)
  * String from SuffixArray.raw_array and the start from SuffixArray.suffix_start
  * and it will skip most calculations.  <b>This feature is really experimental
  * and is CPU dependent since the integers in the raw_array are native.</b>
+ * Pass nil for both if you just want to set the bucket_bytes.
+ *
+ * The bucket_bytes (2 or 3, default 2) is how many leading bytes of each suffix
+ * are used to build the bucket table that searches start from.  A 2 byte table
+ * takes 256k of memory, a 3 byte table takes 64M but is better for very large
+ * sources.
  *
  * As usual, the suffix array is one element larger than the length of the
  * source string.  This is to include the terminal element for the suffix.
@@ -139,15 +337,15 @@ static VALUE SuffixArray_alloc(VALUE klass)
 static VALUE SuffixArray_initialize(int argc, VALUE *argv, VALUE self)
 {
     SuffixArray *sa = NULL;
-    size_t i = 0;
     Data_Get_Struct(self, SuffixArray, sa);
     assert(sa != NULL);
     VALUE source;
     VALUE array;
     VALUE start;
+    VALUE bucket_bytes;
     
     // sort out the arguments and such
-    rb_scan_args(argc, argv, "12", &source, &array, &start);
+    rb_scan_args(argc, argv, "13", &source, &array, &start, &bucket_bytes);
 
     // get the string value of the source given to us, keep it around for later
     VALUE sa_source_str = StringValue(source);
@@ -171,37 +369,36 @@ static VALUE SuffixArray_initialize(int argc, VALUE *argv, VALUE self)
             rb_raise(cSAError, ERR_MISMATCH_LENGTH);
         }
     }
+    
+    sa->bucket_bytes = NIL_P(bucket_bytes) ? SA_DEFAULT_BUCKET_BYTES : NUM2INT(bucket_bytes);
+    if(sa->bucket_bytes != 2 && sa->bucket_bytes != 3) {
+        rb_raise(cSAError, ERR_BUCKET_BYTES);
+    }
         
-    // allocate memory for the index integers
-    sa->suffix_index = malloc(sizeof(int) * (sa_source_len+1));
+    // allocate memory for the index integers, which are only needed until the entries are built
+    int *suffix_index = malloc(sizeof(int) * (sa_source_len+1));
     
     if(NIL_P(array)) {
         // create the suffix array from the source
-        int st = bsarray(sa_source, sa->suffix_index, sa_source_len);
+        int st = bsarray(sa_source, suffix_index, sa_source_len);
 
-        if(st == -1) rb_raise(cSAError, "Error building suffix array");
+        if(st == -1) {
+            free(suffix_index);
+            rb_raise(cSAError, "Error building suffix array");
+        }
         
         // set the suffix_start in our object
         rb_iv_set(self, "@suffix_start", INT2NUM(st));
     } else {
         // convert the given array and start to the internal structures needed
-        memcpy(sa->suffix_index, RSTRING(array)->ptr, (sa_source_len+1) * sizeof(int));
+        memcpy(suffix_index, RSTRING(array)->ptr, (sa_source_len+1) * sizeof(int));
         rb_iv_set(self, "@suffix_start", start);
     }
     
-    unsigned char c = sa_source[sa->suffix_index[0]];  // start off with the first char in the sarray list
-    sa->starts[c] = 0;
-    for(i = 0; i < sa_source_len; i++) {
-        // skip characters until we see a new one
-        if(sa_source[sa->suffix_index[i]] != c) {
-            sa->ends[c] = i-1; // it's -1 since this is a new character, so the end was actually behind this point
-            c = sa_source[sa->suffix_index[i]];
-            sa->starts[c] = i;
-        }
-    }
-    // set the last valid character to get the tail of the sa, the loop will miss it
-    c = sa_source[sa->suffix_index[sa_source_len-1]];
-    sa->ends[c] = sa_source_len-1;
+    sa->entries = malloc(sizeof(SuffixEntry) * (sa_source_len+1));
+    sa->buckets = malloc(sizeof(unsigned int) * (((size_t)1 << (8 * sa->bucket_bytes)) + 1));
+    SuffixArray_setup(sa, sa_source, sa_source_len, suffix_index);
+    free(suffix_index);
     
     return INT2FIX(sa_source_len);
 }
@@ -227,7 +424,7 @@ static VALUE SuffixArray_longest_match(VALUE self, VALUE target, VALUE from_inde
 
     VALUE sa_source = SuffixArray_source(self);
     
-    if(sa == NULL || sa->suffix_index == NULL || RSTRING(sa_source)->len == 0) {
+    if(sa == NULL || sa->entries == NULL || RSTRING(sa_source)->len == 0) {
         rb_raise(cSAError, ERR_NOT_INITIALIZED);
     }
     
@@ -255,13 +452,12 @@ static VALUE SuffixArray_longest_match(VALUE self, VALUE target, VALUE from_inde
     target_ptr += from;
     target_len -= from;
     
-    size_t start = find_longest_match(source_ptr, source_len, target_ptr, &target_len, 
-                                      sa->starts, sa->ends, sa->suffix_index);
+    size_t start = find_longest_match(sa, source_ptr, source_len, target_ptr, &target_len);
     
     // create the 2 value return array
     VALUE result = rb_ary_new();
     
-    rb_ary_push(result, INT2FIX(sa->suffix_index[start]));
+    rb_ary_push(result, INT2FIX(SA_INDEX(sa, start)));
     rb_ary_push(result, INT2FIX(target_len));
     
     return result;
@@ -283,7 +479,7 @@ static VALUE SuffixArray_match(VALUE self, VALUE target)
 
     VALUE sa_source = SuffixArray_source(self);
     
-    if(sa == NULL || sa->suffix_index == NULL || RSTRING(sa_source)->len == 0) {
+    if(sa == NULL || sa->entries == NULL || RSTRING(sa_source)->len == 0) {
         rb_raise(cSAError, ERR_NOT_INITIALIZED);
     }
     
@@ -298,8 +494,7 @@ static VALUE SuffixArray_match(VALUE self, VALUE target)
     unsigned char *target_ptr = RSTRING(target_str)->ptr;
     size_t target_len = RSTRING(target_str)->len;
 
-    size_t start = find_longest_match(source_ptr, source_len, target_ptr, &target_len, 
-                                      sa->starts, sa->ends, sa->suffix_index);
+    size_t start = find_longest_match(sa, source_ptr, source_len, target_ptr, &target_len);
 
     // create the beginning array, and fill it with all matching elements
     VALUE result = rb_ary_new();
@@ -309,28 +504,28 @@ static VALUE SuffixArray_match(VALUE self, VALUE target)
         // all previous suffix entries are shorter than the middle one, so no size check
         size_t middle = start;  // save the middle for the next step
         while(start-- >= 0) {
-            size_t src_i = sa->suffix_index[start];
+            size_t src_i = SA_INDEX(sa, start);
             if(source_ptr[src_i + target_len - 1] != target_ptr[target_len - 1]) {
                 break;
             } else {
                 // the last characters match and it's within length, so this is one of them
-                rb_ary_unshift(result, INT2FIX(sa->suffix_index[start]));
+                rb_ary_unshift(result, INT2FIX(SA_INDEX(sa, start)));
             }
         }
 
         // push the middle one on
-        rb_ary_push(result, INT2FIX(sa->suffix_index[middle]));
+        rb_ary_push(result, INT2FIX(SA_INDEX(sa, middle)));
         
         // and then the end of the list as well
         while(middle++ <= source_len) {
-            size_t src_i = sa->suffix_index[middle];
+            size_t src_i = SA_INDEX(sa, middle);
             // since the suffix array is sorted, we only need to check that the last possible char
             // is the same, or that the remaining length could fit this string
             if(src_i + target_len > source_len || source_ptr[src_i + target_len - 1] != target_ptr[target_len - 1]) {
                 break;
             } else {
                 // the last characters match and it's within length, so this is one of them
-                rb_ary_push(result, INT2FIX(sa->suffix_index[middle]));
+                rb_ary_push(result, INT2FIX(SA_INDEX(sa, middle)));
             }
         }
         
@@ -366,7 +561,7 @@ static VALUE SuffixArray_longest_nonmatch(VALUE self, VALUE target, VALUE from_i
 
     VALUE sa_source = SuffixArray_source(self);
     
-    if(sa == NULL || sa->suffix_index == NULL || RSTRING(sa_source)->len == 0) {
+    if(sa == NULL || sa->entries == NULL || RSTRING(sa_source)->len == 0) {
         rb_raise(cSAError, ERR_NOT_INITIALIZED);
     }
     
@@ -397,17 +592,18 @@ static VALUE SuffixArray_longest_nonmatch(VALUE self, VALUE target, VALUE from_i
     size_t match_len = 0;
     size_t match_start = 0;
     while(scan < end) {
-        if(*scan != source_ptr[sa->suffix_index[sa->starts[*scan]]]) {
+        if(*scan != source_ptr[SA_INDEX(sa, sa->starts[*scan])]) {
             scan ++;
         } else {
             // search remaining stuff for a possible match, which return as a result as well
             match_len = end - scan;
-            match_start = find_longest_match(source_ptr, source_len, scan, &match_len, 
-                                              sa->starts, sa->ends, sa->suffix_index);
+            match_start = find_longest_match(sa, source_ptr, source_len, scan, &match_len);
             
             if(match_len == 0) {
-                // match not found, which really shouldn't happen
-                break;
+                // the quick check above is fooled by a \0 that isn't in the source (the
+                // terminator looks like one), so just treat it as a non-matching character
+                scan++;
+                match_start = 0;
             } else if(match_len > min) {
                 // the match is possibly long enough, drop out
                 break;
@@ -424,13 +620,297 @@ static VALUE SuffixArray_longest_nonmatch(VALUE self, VALUE target, VALUE from_i
     
     size_t nonmatch_len = (scan - (target_ptr + from));
     rb_ary_push(result, INT2FIX(nonmatch_len));
-    rb_ary_push(result, INT2FIX(sa->suffix_index[match_start]));
+    rb_ary_push(result, INT2FIX(SA_INDEX(sa, match_start)));
     rb_ary_push(result, INT2FIX(match_len));
 
     return result;
 }
 
 
+/**
+ * Hashes block_size bytes the same way the rolling hash in next_block_match does.
+ */
+static inline unsigned int block_hash(unsigned char *data, size_t block_size)
+{
+    unsigned int hash = 0;
+    size_t i = 0;
+    
+    for(i = 0; i < block_size; i++) {
+        hash = hash * BLOCK_HASH_BASE + data[i];
+    }
+    
+    return hash;
+}
+
+
+/**
+ * Builds the hash table of the source's non-overlapping blocks, keeping only the
+ * first offset for any duplicated block.  It only gets rebuilt if the block size
+ * changes from the last time.
+ */
+static void build_block_table(BlockTable *bt, unsigned char *source, size_t source_len, size_t block_size)
+{
+    size_t count = source_len / block_size;
+    size_t i = 0;
+    size_t slot = 0;
+    unsigned int hash = 0;
+    
+    if(bt->blocks) free(bt->blocks);
+    
+    // keep the table at most half full so probes stay short
+    for(bt->block_slots = 16; bt->block_slots < count * 2; bt->block_slots *= 2);
+    bt->blocks = malloc(sizeof(BlockSlot) * bt->block_slots);
+    bt->block_size = block_size;
+    memset(bt->blocks, -1, sizeof(BlockSlot) * bt->block_slots);
+    
+    for(i = 0; i < count; i++) {
+        unsigned char *block = source + i * block_size;
+        hash = block_hash(block, block_size);
+        
+        for(slot = hash & (bt->block_slots - 1); bt->blocks[slot].offset != -1; slot = (slot + 1) & (bt->block_slots - 1)) {
+            if(bt->blocks[slot].hash == hash && memcmp(source + bt->blocks[slot].offset, block, block_size) == 0) {
+                break;  // already have this block
+            }
+        }
+        
+        if(bt->blocks[slot].offset == -1) {
+            bt->blocks[slot].hash = hash;
+            bt->blocks[slot].offset = i * block_size;
+        }
+    }
+}
+
+
+/**
+ * Looks for a source block with the given hash that really matches the target.
+ * Returns the source offset or -1 if there isn't one.
+ */
+static inline int find_block(BlockTable *bt, unsigned char *source, unsigned char *target, unsigned int hash)
+{
+    size_t slot = 0;
+    
+    for(slot = hash & (bt->block_slots - 1); bt->blocks[slot].offset != -1; slot = (slot + 1) & (bt->block_slots - 1)) {
+        if(bt->blocks[slot].hash == hash && memcmp(source + bt->blocks[slot].offset, target, bt->block_size) == 0) {
+            return bt->blocks[slot].offset;
+        }
+    }
+    
+    return -1;
+}
+
+
+/**
+ * Does the work of next_block_match for both a SuffixArray and a BlockIndex, with
+ * the table built from sa_source the first time and kept around.
+ */
+static VALUE block_match(BlockTable *bt, VALUE sa_source, VALUE target, VALUE from_index, VALUE block_size)
+{
+    size_t from = NUM2UINT(from_index);
+    size_t size = NUM2UINT(block_size);
+
+    unsigned char *source_ptr = RSTRING(sa_source)->ptr;
+    size_t source_len = RSTRING(sa_source)->len;
+
+    VALUE target_str = StringValue(target);
+    unsigned char *target_ptr = RSTRING(target_str)->ptr;
+    size_t target_len = RSTRING(target_str)->len;
+
+    // nothing to do if either side is too small to have a block
+    if(size == 0 || from > target_len || target_len - from < size || source_len < size) {
+        return Qnil;
+    }
+    
+    if(bt->blocks == NULL || bt->block_size != size) {
+        build_block_table(bt, source_ptr, source_len, size);
+    }
+    
+    // BLOCK_HASH_BASE^(size-1) is needed to roll the outgoing byte off the hash
+    unsigned int out_factor = 1;
+    size_t i = 0;
+    for(i = 1; i < size; i++) out_factor *= BLOCK_HASH_BASE;
+    
+    size_t tgt_i = from;
+    int src_i = -1;
+    unsigned int hash = block_hash(target_ptr + tgt_i, size);
+    
+    while(1) {
+        src_i = find_block(bt, source_ptr, target_ptr + tgt_i, hash);
+        if(src_i != -1 || tgt_i + size >= target_len) break;
+        
+        // roll the hash forward one byte
+        hash = (hash - target_ptr[tgt_i] * out_factor) * BLOCK_HASH_BASE + target_ptr[tgt_i + size];
+        tgt_i++;
+    }
+    
+    if(src_i == -1) return Qnil;
+    
+    // extend it backward, but not past where we started
+    size_t src_start = src_i;
+    size_t tgt_start = tgt_i;
+    while(tgt_start > from && src_start > 0 && target_ptr[tgt_start - 1] == source_ptr[src_start - 1]) {
+        tgt_start--;
+        src_start--;
+    }
+    
+    // and then forward as far as it will go
+    size_t length = (tgt_i - tgt_start) + size;
+    while(tgt_start + length < target_len && src_start + length < source_len && 
+            target_ptr[tgt_start + length] == source_ptr[src_start + length]) {
+        length++;
+    }
+    
+    VALUE result = rb_ary_new();
+    rb_ary_push(result, INT2FIX(tgt_start));
+    rb_ary_push(result, INT2FIX(src_start));
+    rb_ary_push(result, INT2FIX(length));
+    
+    return result;
+}
+
+
+/*
+ * call-seq:
+ *   sarray.next_block_match(target, from_index, block_size) -> [target_start, source_start, length]
+ *
+ * A quick rsync style search that rolls a hash over the target starting at from_index
+ * looking for any block_size chunk that is one of the source's non-overlapping blocks.
+ * When it finds one the match is extended forward as far as it goes and backward
+ * (but never before from_index), and the result is returned.  It returns nil if
+ * no block of the target matches anything in the source.
+ *
+ * This is a lot faster than the suffix array searches when the target is mostly
+ * the same as the source, since the unchanged parts are skipped with nothing more
+ * than a byte compare.  The DeltaGenerator uses it to find the unchanged regions
+ * and only does the real suffix array searches on the parts in between.
+ *
+ * The block table is built the first time this is called and kept around, unless
+ * the block_size changes.
+ */
+static VALUE SuffixArray_next_block_match(VALUE self, VALUE target, VALUE from_index, VALUE block_size)
+{
+    SuffixArray *sa = NULL;
+    Data_Get_Struct(self, SuffixArray, sa);
+
+    VALUE sa_source = SuffixArray_source(self);
+    
+    if(sa == NULL || sa->entries == NULL || RSTRING(sa_source)->len == 0) {
+        rb_raise(cSAError, ERR_NOT_INITIALIZED);
+    }
+
+    return block_match(&sa->table, sa_source, target, from_index, block_size);
+}
+
+
+/**
+ * Does the work of extend_match for both a SuffixArray and a BlockIndex, since
+ * it only needs the source.
+ */
+static VALUE match_extension(VALUE sa_source, VALUE target, VALUE from_index, 
+                             VALUE match_start, VALUE match_length, VALUE max_mismatch)
+{
+    size_t from = NUM2UINT(from_index);
+    size_t src_i = NUM2UINT(match_start);
+    size_t length = NUM2UINT(match_length);
+    size_t max = NUM2UINT(max_mismatch);
+
+    // get better pointers for the source (should already be in String form)
+    unsigned char *source_ptr = RSTRING(sa_source)->ptr;
+    size_t source_len = RSTRING(sa_source)->len;
+
+    // get the target as a string
+    VALUE target_str = StringValue(target);
+    unsigned char *target_ptr = RSTRING(target_str)->ptr;
+    size_t target_len = RSTRING(target_str)->len;
+
+    // check the input for validity, returning nil like in array operations
+    if(from > target_len || src_i > source_len || from + length > target_len || src_i + length > source_len) {
+        return Qnil;
+    }
+    
+    size_t tgt_i = from + length;
+    src_i += length;
+    size_t mismatches = 0;
+    size_t run = 0;
+    size_t good_len = length;  // length as of the last point where the extension was confirmed
+    size_t good_mismatches = 0;
+    VALUE patches = rb_ary_new();
+    
+    while(tgt_i < target_len && src_i < source_len) {
+        if(target_ptr[tgt_i] != source_ptr[src_i]) {
+            // out of mismatches, so stop here and let the last confirmed point stand
+            if(mismatches == max) break;
+            
+            VALUE patch = rb_ary_new();
+            rb_ary_push(patch, INT2FIX(tgt_i - from));
+            rb_ary_push(patch, INT2FIX(target_ptr[tgt_i]));
+            rb_ary_push(patches, patch);
+            
+            mismatches++;
+            run = 0;
+        } else {
+            run++;
+        }
+        
+        tgt_i++;
+        src_i++;
+        
+        // a long enough run (or running off the end of the target) confirms the mismatches so far
+        if(run >= MIN_MISMATCH_RUN || (run > 0 && tgt_i == target_len)) {
+            good_len = tgt_i - from;
+            good_mismatches = mismatches;
+        }
+    }
+    
+    // roll back any mismatches that were never confirmed by a following run
+    while(mismatches > good_mismatches) {
+        rb_ary_pop(patches);
+        mismatches--;
+    }
+
+    VALUE result = rb_ary_new();
+    rb_ary_push(result, INT2FIX(good_len));
+    rb_ary_push(result, patches);
+    
+    return result;
+}
+
+
+/*
+ * call-seq:
+ *   sarray.extend_match(target, from_index, match_start, match_length, max_mismatch) -> [length, [[offset, byte], ...]]
+ *
+ * Takes a match found with longest_match or longest_nonmatch (the target from_index
+ * matching match_length characters of the source at match_start) and tries to
+ * keep going past the end of it, allowing up to max_mismatch characters to be
+ * different.  This is a simple k-mismatch extension that catches the common case
+ * of a binary file where only a timestamp or offset buried in a long run changed.
+ *
+ * A mismatched character is only accepted if it is followed by at least
+ * MIN_MISMATCH_RUN matching characters (or the end of the target), otherwise the
+ * extension is rolled back to the last good point.  This keeps it from eating
+ * into a real non-matching region one character at a time.
+ *
+ * It returns the new total length of the match (never shorter than match_length)
+ * and an Array of [offset, byte] pairs for each mismatched character, where the
+ * offset is relative to from_index and the byte is the target's character.  If
+ * the array is empty then the match couldn't be extended.
+ */
+static VALUE SuffixArray_extend_match(VALUE self, VALUE target, VALUE from_index, 
+                                      VALUE match_start, VALUE match_length, VALUE max_mismatch)
+{
+    SuffixArray *sa = NULL;
+    Data_Get_Struct(self, SuffixArray, sa);
+
+    VALUE sa_source = SuffixArray_source(self);
+    
+    if(sa == NULL || sa->entries == NULL || RSTRING(sa_source)->len == 0) {
+        rb_raise(cSAError, ERR_NOT_INITIALIZED);
+    }
+
+    return match_extension(sa_source, target, from_index, match_start, match_length, max_mismatch);
+}
+
+
 /*
  * call-seq:
  *   sarray.array -> Array  
@@ -448,7 +928,7 @@ static VALUE SuffixArray_array(VALUE self)
 
     VALUE sa_source = SuffixArray_source(self);
     
-    if(sa == NULL || sa->suffix_index == NULL || RSTRING(sa_source)->len == 0) {
+    if(sa == NULL || sa->entries == NULL || RSTRING(sa_source)->len == 0) {
         rb_raise(cSAError, ERR_NOT_INITIALIZED);
     }
     
@@ -459,7 +939,7 @@ static VALUE SuffixArray_array(VALUE self)
     VALUE result = rb_ary_new();
     
     for(i = 0; i < source_len; i++) {
-        rb_ary_push(result, INT2FIX(sa->suffix_index[i]));
+        rb_ary_push(result, INT2FIX(SA_INDEX(sa, i)));
     }
     
     return result;
@@ -476,7 +956,7 @@ static VALUE SuffixArray_array(VALUE self)
  * to rebuild the suffix array.
  *
  * The returned String should be treated as an opaque structure.  It is just a 
- * copy of the int[] used internally.  This means that it is dependent on your
+ * copy of the int[] suffix indexes used internally.  This means that it is dependent on your
  * CPU.  If you want something you can use that is cross platform then use the
  * SuffixArray.array function instead.
  */
@@ -487,12 +967,18 @@ static VALUE SuffixArray_raw_array(VALUE self)
 
     VALUE sa_source = SuffixArray_source(self);
     size_t sa_source_len = RSTRING(sa_source)->len + 1;
-    if(sa == NULL || sa->suffix_index == NULL || RSTRING(sa_source)->len == 0) {
+    if(sa == NULL || sa->entries == NULL || RSTRING(sa_source)->len == 0) {
         rb_raise(cSAError, ERR_NOT_INITIALIZED);
     }
     
-    // build a string that copies this stuff
-    VALUE result = rb_str_new((const char *)sa->suffix_index, sa_source_len * sizeof(int));
+    // build a string that copies just the indexes out of the entries
+    VALUE result = rb_str_new(NULL, sa_source_len * sizeof(int));
+    int *raw = (int *)RSTRING(result)->ptr;
+    size_t i = 0;
+    
+    for(i = 0; i < sa_source_len; i++) {
+        raw[i] = SA_INDEX(sa, i);
+    }
 
     return result;
 }
@@ -520,6 +1006,21 @@ static VALUE SuffixArray_suffix_start(VALUE self)
 
 
 
+/*
+ * call-seq:
+ *   sarray.bucket_bytes -> Fixnum
+ *
+ * How many leading bytes of each suffix the bucket table is built from (2 or 3).
+ */
+static VALUE SuffixArray_bucket_bytes(VALUE self)
+{
+    SuffixArray *sa = NULL;
+    Data_Get_Struct(self, SuffixArray, sa);
+    
+    return INT2FIX(sa->bucket_bytes);
+}
+
+
 /*
  * call-seq:
  *   sarray.all_starts(character) -> Array
@@ -546,7 +1047,7 @@ static VALUE SuffixArray_all_starts(VALUE self, VALUE character)
         size_t start = 0;
     
         for(start = sa->starts[ch]; start <= sa->ends[ch]; start++) {
-            rb_ary_push(result, INT2FIX(sa->suffix_index[start]));
+            rb_ary_push(result, INT2FIX(SA_INDEX(sa, start)));
         }
     }
     
@@ -554,7 +1055,68 @@ static VALUE SuffixArray_all_starts(VALUE self, VALUE character)
 }
 
 
+static void BlockIndex_free(void *p) {
+    BlockTable *bt = (BlockTable *)p;
+    if(bt->blocks) free(bt->blocks);
+    if(bt) free(bt);
+}
+
+static VALUE BlockIndex_alloc(VALUE klass)
+{
+    BlockTable *bt = NULL;
+    
+    return Data_Make_Struct(klass, BlockTable, 0, BlockIndex_free, bt);
+}
+
+
+/*
+ * call-seq:
+ *   BlockIndex.new(source) -> BlockIndex
+ *
+ * A BlockIndex is just the block hash table part of a SuffixArray.  It has the same
+ * next_block_match and extend_match, but nothing is built until next_block_match
+ * is first called and then only the block table is made, which is much cheaper
+ * than sorting the suffixes.  The DeltaGenerator uses one so that a source that's
+ * only had a few bytes changed never needs a SuffixArray at all.  Unlike a SuffixArray
+ * the source can be empty, it just never matches.
+ */
+static VALUE BlockIndex_initialize(VALUE self, VALUE source)
+{
+    rb_iv_set(self, "@source", StringValue(source));
+    return self;
+}
+
+
+/*
+ * call-seq:
+ *   bindex.next_block_match(target, from_index, block_size) -> [target_start, source_start, length]
+ *
+ * Works the same as SuffixArray#next_block_match.
+ */
+static VALUE BlockIndex_next_block_match(VALUE self, VALUE target, VALUE from_index, VALUE block_size)
+{
+    BlockTable *bt = NULL;
+    Data_Get_Struct(self, BlockTable, bt);
+
+    return block_match(bt, rb_iv_get(self, "@source"), target, from_index, block_size);
+}
+
+
+/*
+ * call-seq:
+ *   bindex.extend_match(target, from_index, match_start, match_length, max_mismatch) -> [length, [[offset, byte], ...]]
+ *
+ * Works the same as SuffixArray#extend_match.
+ */
+static VALUE BlockIndex_extend_match(VALUE self, VALUE target, VALUE from_index, 
+                                     VALUE match_start, VALUE match_length, VALUE max_mismatch)
+{
+    return match_extension(rb_iv_get(self, "@source"), target, from_index, match_start, match_length, max_mismatch);
+}
+
+
 static VALUE cSuffixArray;
+static VALUE cBlockIndex;
 
 /**
  * Implements a SuffixArray structure with functions to do useful operations
@@ -563,6 +1125,10 @@ static VALUE cSuffixArray;
  * used was written by Sean Quinlan and Sean Doward and is licensed under the 
  * Plan9 license.  Please refer to the sarray.c file for more information.
  *
+ * Searches start from a bucket table indexed by the first 2 (or 3) bytes of
+ * each suffix, and each suffix array entry carries a copy of the first 8 bytes
+ * of its suffix so most binary search probes never have to touch the source.
+ *
  * The suffix array construction algorithm used is not the fastest available,
  * but it was the most correctly implemented.  There is also a lcp.c file 
  * which implements an O(n) Longest Common Prefix algorithm, but it had
@@ -581,10 +1147,21 @@ void Init_suffix_array()
     rb_define_method(cSuffixArray, "longest_match", SuffixArray_longest_match, 2);
     rb_define_method(cSuffixArray, "match", SuffixArray_match, 1);
     rb_define_method(cSuffixArray, "longest_nonmatch", SuffixArray_longest_nonmatch, 3);
+    rb_define_method(cSuffixArray, "extend_match", SuffixArray_extend_match, 5);
+    rb_define_method(cSuffixArray, "next_block_match", SuffixArray_next_block_match, 3);
     rb_define_method(cSuffixArray, "array", SuffixArray_array, 0);
     rb_define_method(cSuffixArray, "raw_array", SuffixArray_raw_array, 0);
     rb_define_method(cSuffixArray, "suffix_start", SuffixArray_suffix_start, 0);
     rb_define_method(cSuffixArray, "source", SuffixArray_source, 0);
     rb_define_method(cSuffixArray, "all_starts", SuffixArray_all_starts, 1);
+    rb_define_method(cSuffixArray, "bucket_bytes", SuffixArray_bucket_bytes, 0);
+    
+    cBlockIndex = rb_define_class("BlockIndex", rb_cObject);
+    rb_define_alloc_func(cBlockIndex, BlockIndex_alloc);
+    rb_define_method(cBlockIndex, "initialize", BlockIndex_initialize, 1);
+    rb_define_method(cBlockIndex, "next_block_match", BlockIndex_next_block_match, 3);
+    rb_define_method(cBlockIndex, "extend_match", BlockIndex_extend_match, 5);
+    rb_define_method(cBlockIndex, "source", SuffixArray_source, 0);
     
+    Init_token_array(cSAError);
 }
@@ -0,0 +1,274 @@
+#include <ruby.h>
+#include <assert.h>
+#include <sarray.h>
+
+/**
+ * A suffix array built over a stream of integer tokens instead of bytes.
+ * The tokens are usually lines or words that were mapped to integer IDs,
+ * so the matching is done in token units.  The tokens array has the 0
+ * endmark that sarray requires tacked on the end.
+ */
+typedef struct TokenSuffixArray {
+    int *tokens;
+    int *suffix_index;
+    size_t length;
+} TokenSuffixArray;
+
+
+#define ERR_NO_ZERO_LENGTH_TOKENS "Cannot create a token suffix array from 0 tokens."
+#define ERR_BAD_TOKENS "Token IDs must run from 1 to the number of distinct tokens with no gaps."
+#define ERR_TOKENS_NOT_INITIALIZED "Initialization failed, you cannot use this object."
+static VALUE cTSAError;
+
+
+/**
+ * Same as scan_string in suffix_array.c, but for tokens.  The 0 endmark at the
+ * end of the source always stops the scan since target tokens are never 0.
+ */
+static inline int scan_tokens(int *source, int *target, size_t *tgt_len)
+{
+    size_t i = 0;
+
+    while(i < *tgt_len && target[i] == source[i]) {
+        i++;
+    }
+
+    if(i == *tgt_len) {
+        return 0;
+    } else {
+        *tgt_len = i;
+        return target[i] < source[i] ? -1 : 1;
+    }
+}
+
+
+/**
+ * Returns the index in the suffix array where the longest match for the target
+ * tokens is found, with the length as an out parameter in tgt_len.  It is just
+ * the binary search from find_longest_match without the bucket table.
+ */
+static size_t find_longest_token_match(TokenSuffixArray *tsa, int *target, size_t *tgt_len)
+{
+    size_t low = 0;
+    size_t high = tsa->length;  // there's length+1 entries because of the endmark
+    size_t middle = 0;
+    size_t length = 0;
+    size_t scan_len = 0;
+    size_t last_match = 0;
+    int result = 0;
+
+    while(low <= high && length != *tgt_len) {
+        middle = low + (high - low) / 2;
+        scan_len = *tgt_len;
+
+        result = scan_tokens(tsa->tokens + tsa->suffix_index[middle], target, &scan_len);
+
+        if(scan_len > length) {
+            length = scan_len;
+            last_match = middle;
+        }
+
+        if(result == 0) {
+            break;
+        } else if(result < 0) {
+            if(middle == 0) break;
+            high = middle - 1;
+        } else {
+            low = middle + 1;
+        }
+    }
+
+    *tgt_len = length;
+    return last_match;
+}
+
+
+static void TokenSuffixArray_free(void *p) {
+    TokenSuffixArray *tsa = (TokenSuffixArray *)p;
+    if(tsa->tokens) free(tsa->tokens);
+    if(tsa->suffix_index) free(tsa->suffix_index);
+    if(tsa) free(tsa);
+}
+
+static VALUE TokenSuffixArray_alloc(VALUE klass)
+{
+    TokenSuffixArray *tsa = NULL;
+
+    return Data_Make_Struct(klass, TokenSuffixArray, 0, TokenSuffixArray_free, tsa);
+}
+
+
+/*
+ * call-seq:
+ *   TokenSuffixArray.new(tokens) -> TokenSuffixArray
+ *
+ * Builds a suffix array over the given tokens, which is a String of native
+ * ints as made by Array#pack("i*").  The token IDs must be 1 through the number
+ * of distinct tokens without any gaps, since that's what the sarray construction
+ * algorithm needs (0 is the endmark and is added for you).
+ *
+ * The tokens are given packed so that the caller can keep the same packed String
+ * around for the target and not pay for converting an Array on every search.
+ */
+static VALUE TokenSuffixArray_initialize(VALUE self, VALUE tokens)
+{
+    TokenSuffixArray *tsa = NULL;
+    Data_Get_Struct(self, TokenSuffixArray, tsa);
+    assert(tsa != NULL);
+
+    VALUE tokens_str = StringValue(tokens);
+    size_t length = RSTRING(tokens_str)->len / sizeof(int);
+
+    if(length == 0) {
+        rb_raise(cTSAError, ERR_NO_ZERO_LENGTH_TOKENS);
+    }
+
+    tsa->length = length;
+    tsa->tokens = malloc(sizeof(int) * (length+1));
+    tsa->suffix_index = malloc(sizeof(int) * (length+1));
+
+    memcpy(tsa->tokens, RSTRING(tokens_str)->ptr, sizeof(int) * length);
+    tsa->tokens[length] = 0;
+
+    // sarray sorts in place, so it gets its own copy of the tokens
+    memcpy(tsa->suffix_index, tsa->tokens, sizeof(int) * (length+1));
+
+    if(sarray(tsa->suffix_index, length+1) == -1) {
+        rb_raise(cTSAError, ERR_BAD_TOKENS);
+    }
+
+    return INT2FIX(length);
+}
+
+
+/*
+ * call-seq:
+ *   tsa.longest_match(target, from_index) -> [start, length]
+ *
+ * Works just like SuffixArray.longest_match, but the target is a packed String
+ * of tokens and the start and length are counted in tokens.
+ */
+static VALUE TokenSuffixArray_longest_match(VALUE self, VALUE target, VALUE from_index)
+{
+    TokenSuffixArray *tsa = NULL;
+    Data_Get_Struct(self, TokenSuffixArray, tsa);
+
+    if(tsa == NULL || tsa->suffix_index == NULL) {
+        rb_raise(cTSAError, ERR_TOKENS_NOT_INITIALIZED);
+    }
+
+    size_t from = NUM2UINT(from_index);
+    VALUE target_str = StringValue(target);
+    int *target_ptr = (int *)RSTRING(target_str)->ptr;
+    size_t target_len = RSTRING(target_str)->len / sizeof(int);
+
+    if(from > target_len) {
+        return Qnil;
+    }
+
+    target_len -= from;
+    size_t start = find_longest_token_match(tsa, target_ptr + from, &target_len);
+
+    VALUE result = rb_ary_new();
+    rb_ary_push(result, INT2FIX(tsa->suffix_index[start]));
+    rb_ary_push(result, INT2FIX(target_len));
+
+    return result;
+}
+
+
+/*
+ * call-seq:
+ *   tsa.longest_nonmatch(target, from_index, min_match) -> [non_match_length, match_start, match_length]
+ *
+ * Works just like SuffixArray.longest_nonmatch, but the target is a packed String
+ * of tokens and everything returned is counted in tokens.  Any match that is
+ * min_match tokens or shorter is counted as part of the non-matching region.
+ */
+static VALUE TokenSuffixArray_longest_nonmatch(VALUE self, VALUE target, VALUE from_index, VALUE min_match)
+{
+    TokenSuffixArray *tsa = NULL;
+    Data_Get_Struct(self, TokenSuffixArray, tsa);
+
+    if(tsa == NULL || tsa->suffix_index == NULL) {
+        rb_raise(cTSAError, ERR_TOKENS_NOT_INITIALIZED);
+    }
+
+    size_t from = NUM2UINT(from_index);
+    size_t min = NUM2INT(min_match);
+    VALUE target_str = StringValue(target);
+    int *target_ptr = (int *)RSTRING(target_str)->ptr;
+    size_t target_len = RSTRING(target_str)->len / sizeof(int);
+
+    if(from > target_len) {
+        return Qnil;
+    }
+
+    int *scan = target_ptr + from;
+    int *end = target_ptr + target_len;
+    size_t match_len = 0;
+    size_t match_start = 0;
+
+    while(scan < end) {
+        match_len = end - scan;
+        match_start = find_longest_token_match(tsa, scan, &match_len);
+
+        if(match_len == 0) {
+            // this token isn't in the source at all
+            scan++;
+        } else if(match_len > min) {
+            // long enough, drop out
+            break;
+        } else {
+            // too short to bother with, so it's part of the non-matching region
+            scan += match_len;
+            match_len = match_start = 0;
+        }
+    }
+
+    if(scan == end) {
+        match_len = match_start = 0;
+    }
+
+    VALUE result = rb_ary_new();
+    rb_ary_push(result, INT2FIX(scan - (target_ptr + from)));
+    rb_ary_push(result, INT2FIX(tsa->suffix_index[match_start]));
+    rb_ary_push(result, INT2FIX(match_len));
+
+    return result;
+}
+
+
+/*
+ * call-seq:
+ *   tsa.length -> Fixnum
+ *
+ * The number of tokens (not counting the endmark) in the suffix array.
+ */
+static VALUE TokenSuffixArray_length(VALUE self)
+{
+    TokenSuffixArray *tsa = NULL;
+    Data_Get_Struct(self, TokenSuffixArray, tsa);
+
+    return INT2FIX(tsa->length);
+}
+
+
+static VALUE cTokenSuffixArray;
+
+/**
+ * Sets up the TokenSuffixArray class, which uses the general integer alphabet
+ * sarray function instead of the byte oriented bsarray.  It's called from
+ * Init_suffix_array and shares its SAError exception class.
+ */
+void Init_token_array(VALUE error_class)
+{
+    cTSAError = error_class;
+    cTokenSuffixArray = rb_define_class("TokenSuffixArray", rb_cObject);
+    rb_define_alloc_func(cTokenSuffixArray, TokenSuffixArray_alloc);
+
+    rb_define_method(cTokenSuffixArray, "initialize", TokenSuffixArray_initialize, 1);
+    rb_define_method(cTokenSuffixArray, "longest_match", TokenSuffixArray_longest_match, 2);
+    rb_define_method(cTokenSuffixArray, "longest_nonmatch", TokenSuffixArray_longest_nonmatch, 3);
+    rb_define_method(cTokenSuffixArray, "length", TokenSuffixArray_length, 0);
+}
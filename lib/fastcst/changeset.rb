@@ -1,5 +1,4 @@
 require 'set'
-require 'find'
 require 'digest/md5'
 require 'yaml'
 require 'sadelta'
@@ -8,13 +7,15 @@ require 'fileutils'
 require 'fastcst/ui'
 require 'zlib'
 require 'fastcst/operation'
+require 'dir_scan'
+require 'fastcst/parallel_apply'
 
 include SuffixArrayDelta
 
 
 module ChangeSet
 
-    JOURNAL_FILE_SUFFIX = ".yaml.gz"
+    JOURNAL_FILE_SUFFIX = ".journal.gz"
     DATA_FILE_SUFFIX = ".fcs"
     
     # = Introduction
@@ -31,7 +32,7 @@ module ChangeSet
     # = Design
     #
     # A ChangeSet object performs an analysis of the source and target directory.  It then
-    # writes a YAML dump of a series of Operation objects (MoveOperation, DeltaOperation,
+    # writes a journal (see JournalWriter) of a series of Operation objects (MoveOperation, DeltaOperation,
     # DeleteOperation, and CreateOperation) and write necessary data to a raw data output.
     # This makes creating a changeset file incredibly easy and makes it easy to create new
     # operations.  Once all the operations are written to disk then the changeset is finished.
@@ -43,7 +44,7 @@ module ChangeSet
     # to allow it to be skipped.
     #
     # Applying a changeset becomes incredibly easy then:  just load each operation from the
-    # YAML file and call its run method.  The run method knows what it needs to do, and only
+    # journal with ChangeSet.each_operation and call its run method.  The run method knows what it needs to do, and only
     # needs the directory to do it in and the data stream to read stuff from (if necessary).
     #
     # One key thing is that, if skip is called, and the operation expects to read a certain 
@@ -67,8 +68,82 @@ module ChangeSet
     # depending on user preference or build options.
     #
 
+    # Remembers the MD5 digest of every file hashed during one changeset build so that
+    # no file is read and hashed twice (once to see if it was touched, again to detect
+    # a move, again to write the journal).  Files are hashed in Operation::CHUNK_SIZE pieces
+    # instead of being read into one String, and the bytes read are counted so the
+    # commands can report them.
+    #
+    # A file that's hashed to see if it really changed is read whole instead and its
+    # contents kept (up to KEEP_LIMIT bytes in all), since if it did change the
+    # DeltaOperation needs them and can take them instead of reading the file again.
+    class DigestCache
+        attr_reader :bytes_read
+        
+        KEEP_LIMIT = 32 * 1024 * 1024
+        
+        def initialize
+            @digests = {}
+            @kept = {}
+            @kept_bytes = 0
+            @bytes_read = 0
+        end
+        
+        
+        # Returns the hex digest of the file, hashing it only the first time.  With keep
+        # the contents are held on to for take.
+        def hexdigest(file, keep=false)
+            return @digests[file] if @digests[file]
+            
+            if keep and @kept_bytes + File.size(file) <= KEEP_LIMIT
+                data = File.open(file, "rb") { |f| f.read }
+                @bytes_read += data.length
+                @kept[file] = data
+                @kept_bytes += data.length
+                return @digests[file] = Digest::MD5.hexdigest(data)
+            end
+            
+            md5 = Digest::MD5.new
+            File.open(file, "rb") do |f|
+                while chunk = f.read(Operation::CHUNK_SIZE)
+                    md5 << chunk
+                    @bytes_read += chunk.length
+                end
+            end
+            @digests[file] = md5.hexdigest
+        end
+        
+        
+        # The raw 16 byte digest, which is what the Repository::StatIndex keeps.
+        def digest(file, keep=false)
+            [hexdigest(file, keep)].pack("H*")
+        end
+        
+        
+        # Hands over the contents kept for the file and forgets them, or returns nil
+        # if they weren't kept.
+        def take(file)
+            data = @kept.delete file
+            @kept_bytes -= data.length if data
+            return data
+        end
+        
+        
+        # Returns the digest if the file was already hashed, otherwise nil.
+        def cached(file)
+            @digests[file]
+        end
+        
+        
+        # Adds bytes read by someone else (like the operations) to the total.
+        def count(bytes)
+            @bytes_read += bytes
+        end
+    end
+    
+    
     class ChangeSetBuilder
-        attr_reader :deleted, :created, :common, :moved, :changed
+        attr_reader :deleted, :created, :common, :moved, :changed, :deleted_dirs, :created_dirs, :digests, :refreshed
     
         # Does the majority of the change detection using the Set class.  It basically
         # scans both source and target, and then determines the deleted, created, and common
@@ -77,14 +152,41 @@ module ChangeSet
         # are changed.  Even if the files didn't really change, they did have an attribute
         # (mtime) change so they need to be recorded.  The DeltaOperation class will
         # figure out what really changed and record appropriately.
+        #
+        # The sizes and mtimes come from the scan itself so no file is stat'd twice.
+        #
+        # If a Repository::StatIndex of the source is given then the source isn't scanned
+        # at all.  Files with a different mtime are then hashed and compared to the digest
+        # in the index, so a file that was only touched isn't reported as changed.
+        # A different inode (when the index knows it) gets the same check.  The touched
+        # files get their new stats put in the index and are listed in refreshed, so
+        # the caller can save the index and they won't be hashed again.
+        #
+        # When the index is given along with the dirty paths from the Repository::DirtyJournal
+        # then the target isn't scanned either (see ChangeSetBuilder.scan_dirty).
         # 
         # Moved file detection is done with detect_moved_files since this is optional.
-        def initialize(source, target)
+        #
+        # Every digest taken is kept in a DigestCache (see digests) for the whole build.
+        def initialize(source, target, index=nil, dirty=nil)
             @source = source
             @target = target
+            @index = index
+            @digests = DigestCache.new
 
-            src_files, src_dirs = ChangeSetBuilder.scan(@source)
-            tgt_files, tgt_dirs = ChangeSetBuilder.scan(@target)
+            if @index
+                @src_stats, src_dirs = @index.file_stats, @index.dirs
+            else
+                @src_stats, src_dirs = ChangeSetBuilder.scan(@source)
+            end
+            
+            if @index and dirty
+                @tgt_stats, tgt_dirs = ChangeSetBuilder.scan_dirty(@target, @index, dirty)
+            else
+                @tgt_stats, tgt_dirs = ChangeSetBuilder.scan(@target)
+            end
+            src_files = Set.new(@src_stats.keys)
+            tgt_files = Set.new(@tgt_stats.keys)
 
             # use Set to figure out what has possibly changed
             @deleted = src_files - tgt_files
@@ -92,18 +194,24 @@ module ChangeSet
             @common = src_files & tgt_files
             @moved = {}  # initially empty until dected_moved_files is requested
             @changed = {}
+            @refreshed = []
             
             # directories are handled after everything else
             @deleted_dirs = src_dirs - tgt_dirs
             @created_dirs = tgt_dirs - src_dirs
             
             @common.each do |file|
-                otime = File.mtime(File.join(source,file))
-                ntime = File.mtime(File.join(target,file))
-                if otime != ntime
+                osize, otime, oinode = @src_stats[file]
+                nsize, ntime, ninode = @tgt_stats[file]
+                if otime != ntime or (@index and oinode != 0 and oinode != ninode)
                     # file has changed, but we if the old file is 0 length then its actually a create
-                    if File.size(File.join(source,file)) == 0
+                    if osize == 0
                         @created << file
+                    elsif @index and nsize == osize and @index.digest(file) == @digests.digest(File.join(target,file), true)
+                        # just touched, the contents are the same
+                        @digests.take(File.join(target,file))
+                        @index.refresh(file, nsize, ntime, ninode)
+                        @refreshed << file
                     else
                         @changed[file] = [otime, ntime]
                     end
@@ -141,11 +249,11 @@ module ChangeSet
                     to_file = tgt_files[0]
                     
                     # next test is to simply compare files sizes, can't be same file if different size
-                    if File.size?(@source + '/' + from_file) == File.size?(@target + '/' + to_file)
+                    if @src_stats[from_file][0] == @tgt_stats[to_file][0]
                         
                         # now generate the hashes for both files as the final confirmation of same file
-                        Dir.chdir(@source) { del_digest = Digest::MD5.digest(File.read(from_file)) }
-                        Dir.chdir(@target) { tgt_digest = Digest::MD5.digest(File.read(to_file)) }
+                        del_digest = source_digest(from_file)
+                        tgt_digest = @digests.digest(File.join(@target, to_file))
                         
                         if del_digest == tgt_digest
                             # digests match so the basenames are the same and the digests are the same, it's a move
@@ -161,6 +269,38 @@ module ChangeSet
         end
     
     
+        # Returns every path that is different between the source and target, which is
+        # what the Repository::DirtyJournal should hold when the source is the originals.
+        def changed_paths
+            paths = @deleted.to_a + @created.to_a + @changed.keys + @deleted_dirs.to_a + @created_dirs.to_a
+            @moved.each { |from, to_info| paths << from << to_info[0] }
+            return paths
+        end
+        
+        
+        # Returns the number of bytes read from files so far in this build.
+        def bytes_read
+            @digests.bytes_read
+        end
+        
+        
+        # Returns the files whose source contents write_changeset will read.  When the
+        # source is a scratch directory of originals these are the ones to write out.
+        def source_paths
+            @deleted.to_a + @moved.keys + @changed.keys
+        end
+        
+        
+        # Returns a new ChangeSetBuilder that goes from the target back to the source,
+        # which is how undo changesets are made without scanning everything again.  A
+        # reversed move gets the mtime the file had in the source.
+        def reverse
+            rev = clone
+            rev.reverse!
+            return rev
+        end
+        
+        
         # Returns true if there are detected changes.
         def has_changes?
             @deleted.size > 0 || @created.size > 0 || @changed.size > 0 || @moved.size > 0
@@ -170,31 +310,48 @@ module ChangeSet
     
         # Write journal and data to the two output streams.  It basically
         # just creates the correct operation objects in order and writes
-        # them to the journal output stream as a series of YAML documents.
+        # them to the journal output stream, which is a JournalWriter for the
+        # binary journal or any IO for a series of YAML documents.
+        #
+        # Digests already in the DigestCache or the index are reused.  The create and
+        # delta operations read the files anyway so they take the digests themselves
+        # from what they read, unless the DigestCache already read the delta's target.
         def write_changeset(journal_out, data_out)
         
             @deleted.sort.each do |path|
-                digest = Digest::MD5.hexdigest(File.read(File.join(@source, path)))
+                digest = source_digest(path).unpack("H*")[0]
                 op = DeleteOperation.new({:path => path, :digest => digest}, @target)
                 op.store(journal_out, data_out)
             end
         
             @moved.sort.each do |from, to_info|
-                digest = Digest::MD5.hexdigest(File.read(File.join(@source, from)))
+                digest = source_digest(from).unpack("H*")[0]
                 op = MoveOperation.new({:path => from, :digest => digest, :to_path => to_info[0], :mtime => to_info[1]}, @target)
                 op.store(journal_out, data_out)
             end
         
             @created.sort.each do |path|
-                digest = Digest::MD5.hexdigest(File.read(File.join(@target, path)))
-                op = CreateOperation.new({:path => path, :digest => digest}, @target)
+                info = {:path => path}
+                digest = @digests.cached(File.join(@target, path))
+                info[:digest] = digest if digest
+                op = CreateOperation.new(info, @target)
                 op.store(journal_out, data_out)
+                @digests.count op.bytes_read
             end
         
-            @changed.sort.each do |file, info|
-                digest = Digest::MD5.hexdigest(File.read(File.join(@source, file)))
-                op = DeltaOperation.new({:source => @source, :digest => digest, :path => file}, @target)
+            @changed.sort.each do |file, times|
+                target_path = File.join(@target, file)
+                info = {:source => @source, :path => file}
+                digest = (@index and @index.hexdigest(file)) || @digests.cached(File.join(@source, file))
+                info[:digest] = digest if digest
+                
+                # a file hashed to see if it really changed was kept so it isn't read again
+                target_data = @digests.take(target_path)
+                info[:target_digest] = @digests.cached(target_path) if target_data
+                op = DeltaOperation.new(info, @target)
+                op.target_data = target_data
                 op.store(journal_out, data_out)
+                @digests.count op.bytes_read
             end
             
             # finally we write a DirectoryOperation that is responsible for intelligently
@@ -205,6 +362,31 @@ module ChangeSet
     
     
     
+        protected
+        
+        # The raw digest of a source file, from the index if there is one.
+        def source_digest(file)
+            (@index and @index.digest(file)) || @digests.digest(File.join(@source, file))
+        end
+        
+        # Does the work of reverse on a clone, so nothing here can change the sets in place.
+        def reverse!
+            moved = {}
+            @moved.each { |from, to_info| moved[to_info[0]] = [from, @src_stats[from][1]] }
+            changed = {}
+            @changed.each { |file, times| changed[file] = times.reverse }
+            
+            @source, @target = @target, @source
+            @src_stats, @tgt_stats = @tgt_stats, @src_stats
+            @deleted, @created = @created.dup, @deleted.dup
+            @deleted_dirs, @created_dirs = @created_dirs.dup, @deleted_dirs.dup
+            @moved = moved
+            @changed = changed
+            @index = nil
+        end
+        
+        public
+    
         # Private method that does an inverse indexing of the basenames in the given hash.
         def self.index_base_names(filenames)
             basenames = {}
@@ -224,27 +406,42 @@ module ChangeSet
         # files that usually aren't wanted.  There is a real need to create an excludes
         # list of some sort for this.
         # 
-        # It returns two Set objects, one for the files and one for the directories it finds.
+        # It returns a Hash of the files mapped to [size, mtime, inode] and a Set of the
+        # directories it finds.  The actual work is done by the native DirScan.scan which
+        # reads the directories in parallel and stats each entry only once.
         def self.scan(dir)
-            file_results = Set.new
-            dir_results = Set.new
+            file_results, dirs = DirScan.scan(dir)
+            return file_results, Set.new(dirs)
+        end
+        
+        
+        # Does the same job as scan, but for a directory that is known to be the same as
+        # what's in the index except for the dirty paths.  The index's stats are used for
+        # everything else, so only the dirty files are stat'd and only dirty directories
+        # are scanned.  A dirty path that is gone takes everything under it with it.
+        def self.scan_dirty(dir, index, dirty)
+            file_results = index.file_stats
+            dir_results = Set.new(index.dirs)
             
-            Dir.chdir(dir) do
-                Find.find(".") do |file|
-                    base = File.basename(file)
-
-                    # TODO: allow for configurable exclude lists
-                    if base != "." and base[0,1] == "." or base == "CVS"
-                        if File.directory?(file)
-                            # skip this directory
-                            Find.prune
-                            # otherwise we just ignore the hidden file
-                        end
-                    elsif File.file? file
-                        file_results << file
-                    elsif File.directory? file
-                        dir_results << file
-                    end
+            dirty.each do |path|
+                if dir_results.include? path
+                    # it was a directory, so everything that was under it has to go too
+                    prefix = path + "/"
+                    file_results.delete_if { |file, info| file.index(prefix) == 0 }
+                    dir_results.delete_if { |d| d == path or d.index(prefix) == 0 }
+                else
+                    file_results.delete path
+                end
+                
+                full_path = File.join(dir, path)
+                if File.directory? full_path
+                    files, dirs = DirScan.scan(full_path)
+                    # the scan gives paths starting with "." for full_path, so swap in the real path
+                    files.each { |file, info| file_results[path + file[1 .. -1]] = info }
+                    dirs.each { |d| dir_results << path + d[1 .. -1] }
+                elsif File.file? full_path
+                    stat = File.stat(full_path)
+                    file_results[path] = [stat.size, Time.at(stat.mtime.to_i), stat.ino]
                 end
             end
             
@@ -259,7 +456,7 @@ module ChangeSet
     def ChangeSet.statistics(journal_in)
         stats = {"moves" => 0, "creates" => 0, "deletes" => 0, "deltas" => 0}
         # no need to run skip since we're not doing anything other than counting them
-        YAML.each_document(journal_in) do |info|
+        ChangeSet.each_operation(journal_in) do |info|
             case info[0]
             when DeleteOperation::TYPE:
                 stats["deletes"] += 1
@@ -281,6 +478,27 @@ module ChangeSet
     end
 
 
+    # Reads the journal and returns every path its operations touch:  the files,
+    # where they were moved to, and the directories that were created or deleted.
+    # Given as the dirty paths to a ChangeSetBuilder this finds just the changes the
+    # changeset made without scanning anything else.
+    def ChangeSet.journal_paths(journal_in)
+        paths = []
+
+        ChangeSet.each_operation(journal_in) do |type, info|
+            if type == DirectoryOperation::TYPE
+                paths.concat info[:created_dirs]
+                paths.concat info[:deleted_dirs]
+            else
+                paths << info[:path]
+                paths << info[:to_path] if info[:to_path]
+            end
+        end
+
+        return paths.uniq
+    end
+
+
     # A function that reads a journal and data input stream,
     # and runs the operations against the target directory.
     # It closes the input streams for the caller to ensure that
@@ -289,12 +507,29 @@ module ChangeSet
     # Setting test_run==true will run all operations in test mode where they don't actually
     # do anything to the target directory, but will report on any errors and return
     # true/false if they work or not.
-    def ChangeSet.apply_changeset(journal_in, data_in, target_dir, test_run=false)
+    #
+    # Giving a PathSpec as only limits the apply to the operations on those paths.  The
+    # rest are skipped, which with a DataReader means their data is never decompressed.
+    #
+    # When the data is a DataReader (so payloads can be read in any order) and more
+    # than one worker is asked for, the apply is done by a ParallelApply.  The default
+    # is one, so only callers that ask for it (the apply command) fork.  Test runs
+    # and old gzip data files are always done in order.
+    def ChangeSet.apply_changeset(journal_in, data_in, target_dir, test_run=false, only=nil, workers=1)
         begin
             failure_count = 0
+            
+            if data_in.kind_of? DataReader and not test_run and workers > 1
+                return ParallelApply.new(workers).apply(journal_in, data_in, target_dir, only)
+            end
 
-            YAML.each_document(journal_in) do |info|
-                op = Operation.create(info, target_dir)
+            ChangeSet.each_operation(journal_in) do |info|
+                if only and not (selected = only.select(info))
+                    Operation.create(info, target_dir).skip(data_in)
+                    next
+                end
+                
+                op = Operation.create(selected || info, target_dir)
                 
                 # add one to the failure count unless the operation runs fine
                 if test_run
@@ -312,30 +547,87 @@ module ChangeSet
     end
 
 
+    # A list of paths to limit ChangeSet.apply_changeset to.  Each spec is either a
+    # file or directory (which matches everything under it) or a File.fnmatch pattern.
+    # The journals use "./path" so specs are given a "./" if they don't have one.
+    class PathSpec
+        attr_reader :specs
+        
+        def initialize(specs)
+            @specs = specs.collect do |spec|
+                spec = spec.sub(/\/+\z/, "")
+                (spec == "." or spec.index("./") == 0) ? spec : "./" + spec
+            end
+        end
+        
+        
+        # True if the path is one of the specs or under one of them.
+        def match?(path)
+            @specs.find do |spec|
+                path == spec or path.index(spec + "/") == 0 or File.fnmatch(spec, path, File::FNM_PATHNAME)
+            end != nil
+        end
+        
+        
+        # Returns the [type, info] journal record limited to the matching paths, or nil
+        # if none of it matches.  A move matches if either end does, and a directory
+        # record keeps only the matching directories.
+        def select(record)
+            type, info = record
+            
+            if type == DirectoryOperation::TYPE
+                deleted = info[:deleted_dirs].select { |d| match? d }
+                created = info[:created_dirs].select { |d| match? d }
+                return nil if deleted.empty? and created.empty?
+                return [type, info.merge(:deleted_dirs => deleted, :created_dirs => created)]
+            elsif match?(info[:path]) or (info[:to_path] and match?(info[:to_path]))
+                return record
+            else
+                return nil
+            end
+        end
+    end
+    
+    
     # A utility method to easily create a changeset given just the
     # changeset name (it adds the ChangeSet::JOURNAL_FILE_SUFFIX and ChangeSet::DATA_FILE_SUFFIX for the journal
     # and data files).  It returns the ChangeSetBuilder for you to
     # analyze, and it will not make the changeset if there are
     # no changes reported.
-    def ChangeSet.make_changeset(cs_name, source, target)
-        changes = ChangeSetBuilder.new(source, target)
+    #
+    # The index and dirty paths are just passed on to ChangeSetBuilder.new.  If a
+    # block is given it gets the ChangeSetBuilder before anything is written, which
+    # is when the caller can write out the source files it needs (see
+    # ChangeSetBuilder#source_paths).  The codec is passed on to save_changeset.
+    def ChangeSet.make_changeset(cs_name, source, target, index=nil, dirty=nil, codec=DEFAULT_CODEC)
+        changes = ChangeSetBuilder.new(source, target, index, dirty)
 
         if not changes.has_changes?
             UI.event :exit, "Nothing changed.  Exiting."
         else
-            begin
-                changes.detect_moved_files
-
-                md_out = Zlib::GzipWriter.new(File.open(cs_name + JOURNAL_FILE_SUFFIX, "w"))
-                data_out = Zlib::GzipWriter.new(File.open(cs_name + DATA_FILE_SUFFIX, "w"))
-
-                changes.write_changeset(md_out, data_out)
-            ensure
-                md_out.close
-                data_out.close
-            end
+            changes.detect_moved_files
+            yield changes if block_given?
+            ChangeSet.save_changeset(cs_name, changes, codec)
         end
 
         return changes
     end
+    
+    
+    # Writes the changes in the ChangeSetBuilder to cs_name plus the ChangeSet::JOURNAL_FILE_SUFFIX
+    # and ChangeSet::DATA_FILE_SUFFIX.  The data file is compressed with the codec (see
+    # Codec.get), the journal is always gzip (see ChangeSet.create_journal).
+    def ChangeSet.save_changeset(cs_name, changes, codec=DEFAULT_CODEC)
+        codec = Codec.get(codec) if codec.kind_of? String
+
+        begin
+            md_out = JournalWriter.new(ChangeSet.create_journal(cs_name + JOURNAL_FILE_SUFFIX, codec))
+            data_out = DataWriter.new(File.open(cs_name + DATA_FILE_SUFFIX, "wb"), codec)
+
+            changes.write_changeset(md_out, data_out)
+        ensure
+            md_out.close if md_out
+            data_out.close if data_out
+        end
+    end
 end
\ No newline at end of file
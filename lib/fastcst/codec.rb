@@ -0,0 +1,175 @@
+require 'zlib'
+require 'lz_codec'
+
+
+module ChangeSet
+
+    DEFAULT_CODEC = "zlib"
+
+    # = Introduction
+    #
+    # The compression used for changeset data files.  Each codec has
+    # a name that's written into the files it compresses (and into the meta-data
+    # as "Codec") so readers never have to be told which one was used.  The codecs
+    # are:
+    #
+    # * zlib -- deflate at the default level, what every changeset used to use
+    # * zlib:N -- deflate at level N (0-9), zlib:9 is the one for small published changesets
+    # * lz -- the native LZCodec, several times faster than zlib but bigger
+    # * store -- no compression at all
+    #
+    # Codec.get turns a name into a codec.  Every codec has compress and
+    # decompress for whole strings, and a compressor that takes the data in
+    # pieces so the DataWriter can stream files through it.  Every decompress
+    # raises the LZError that LZCodec does if the data doesn't come out the
+    # length it was supposed to.
+    class Codec
+        DAMAGED = "The compressed data is damaged or the length is wrong."
+
+        attr_reader :name
+
+        def initialize(name)
+            @name = name
+        end
+
+
+        # Returns the codec with the given name or raises an error if there
+        # isn't one.
+        def Codec.get(name)
+            case name
+            when "zlib"
+                ZlibCodec.new(name, Zlib::DEFAULT_COMPRESSION)
+            when /\Azlib:([0-9])\z/
+                ZlibCodec.new(name, $1.to_i)
+            when "lz"
+                FastCodec.new(name)
+            when "store"
+                Codec.new(name)
+            else
+                raise "Unknown compression codec #{name}, use zlib, zlib:0 to zlib:9, lz, or store."
+            end
+        end
+
+
+        def compress(data)
+            data
+        end
+
+
+        # Gives back the data from compress, which was length bytes long.
+        def decompress(data, length)
+            check_length(data, length)
+        end
+
+
+        # Returns the data, or raises LZError if it isn't length bytes long.
+        def check_length(data, length)
+            raise LZError, DAMAGED if data.length != length
+            return data
+        end
+
+
+        # Returns an object with << and finish that each give back compressed
+        # output.  This one just collects the data and compresses it at the end.
+        def compressor
+            BufferedCompressor.new(self)
+        end
+    end
+
+
+    class BufferedCompressor
+        def initialize(codec)
+            @codec = codec
+            @buffer = ""
+        end
+
+        def <<(data)
+            @buffer << data
+            return ""
+        end
+
+        def finish
+            @codec.compress(@buffer)
+        end
+    end
+
+
+    # Raw deflate streams (no gzip header) at the given level.
+    class ZlibCodec < Codec
+        def initialize(name, level)
+            super(name)
+            @level = level
+        end
+
+        def compress(data)
+            compressor = self.compressor
+            (compressor << data) + compressor.finish
+        end
+
+        def decompress(data, length)
+            inflate = Zlib::Inflate.new(-Zlib::MAX_WBITS)
+            begin
+                out = inflate.inflate(data)
+            rescue Zlib::Error
+                raise LZError, DAMAGED
+            ensure
+                inflate.close
+            end
+
+            return check_length(out, length)
+        end
+
+        def compressor
+            ZlibCompressor.new(@level)
+        end
+    end
+
+
+    class ZlibCompressor
+        def initialize(level)
+            @deflate = Zlib::Deflate.new(level, -Zlib::MAX_WBITS)
+        end
+
+        def <<(data)
+            @deflate.deflate(data)
+        end
+
+        def finish
+            out = @deflate.finish
+            @deflate.close
+            return out
+        end
+    end
+
+
+    # The native LZCodec.
+    class FastCodec < Codec
+        def compress(data)
+            LZCodec.compress(data)
+        end
+
+        def decompress(data, length)
+            LZCodec.decompress(data, length)
+        end
+    end
+
+
+    # Opens a journal file for writing.  Journals are always gzip files, whatever
+    # codec the data file uses, so they keep matching JOURNAL_FILE_SUFFIX and
+    # anything that reads .journal.gz files can still read them.  A zlib:N codec
+    # only sets the gzip level, the other codecs get the default level.  Journals
+    # are small next to the data so the codec wouldn't buy much here anyway.
+    def ChangeSet.create_journal(file, codec=DEFAULT_CODEC)
+        codec = Codec.get(codec) if codec.kind_of? String
+        level = Zlib::DEFAULT_COMPRESSION
+        level = codec.name[5 .. -1].to_i if codec.kind_of? ZlibCodec and codec.name != "zlib"
+
+        Zlib::GzipWriter.new(File.open(file, "wb"), level)
+    end
+
+
+    # Opens a journal file written by create_journal for reading.
+    def ChangeSet.open_journal(file)
+        Zlib::GzipReader.new(File.open(file, "rb"))
+    end
+end
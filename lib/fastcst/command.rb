@@ -182,7 +182,9 @@ class CommandRegistry
             if not command.validate
                 UI.failure :command, "#{cmd_name} reported an error. Use -h to get help."
                 return false
-            else
+            end
+            
+            begin
                 # try to load a trigger for this command
                 begin
                     trigger = Trigger.create(cmd_name)
@@ -193,6 +195,10 @@ class CommandRegistry
                     # no trigger found, so just run the command like usual
                     command.run
                 end
+            rescue Repository::StatIndexDamaged
+                # nothing that needs the originals can go on without them
+                UI.failure :index, $!.message
+                return false
             end
         end
         return true
@@ -230,6 +236,7 @@ require 'fastcst/command/abort'
 require 'fastcst/command/attach'
 require 'fastcst/command/begin'
 require 'fastcst/command/apply'
+require 'fastcst/command/checkout'
 require 'fastcst/command/undo'
 require 'fastcst/command/disp'
 require 'fastcst/command/finish'
@@ -245,4 +252,6 @@ require 'fastcst/command/serve'
 require 'fastcst/command/merge'
 require 'fastcst/command/index'
 require 'fastcst/command/find'
+require 'fastcst/command/watch'
+require 'fastcst/command/pack'
 
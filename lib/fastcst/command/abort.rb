@@ -38,10 +38,7 @@ module Repository
                     Dir.chdir repo.work_dir do
                         # relative to work directory
                         source = File.join("..","..")
-                        originals = File.join("..", "originals")
-                        
-                        # remember we are trying to do an inverted changeset, so source comes first
-                        changes = ChangeSet.make_changeset("undo", source, originals)
+                        changes = repo.make_undo_changeset("undo", source)
                     end
                     
                     # back in the source directory    
@@ -50,8 +47,8 @@ module Repository
                         UI.start_finish("Aborting changes to source directory") do
                             journal_file = File.join(repo.work_dir, Repository::UNDO_JOURNAL)
                             data_file = File.join(repo.work_dir, Repository::UNDO_DATA)
-                            journal = Zlib::GzipReader.new(File.open(journal_file))
-                            data = Zlib::GzipReader.new(File.open(data_file))
+                            journal = ChangeSet.open_journal(journal_file)
+                            data = ChangeSet.open_data(data_file)
                             
                             ChangeSet.apply_changeset(journal, data, ".")
                             
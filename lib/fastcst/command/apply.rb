@@ -12,7 +12,9 @@ module Repository
             super(argv, [
             ["-i", "--id ID", "Specify a changeset ID to send (defaults to current)", :@id],
             ["-r", "--rev ID", "Specify a changeset Revision name to send", :@rev],
-            ["-t", "--test", "Run the apply in test mode (does nothing, reports failures)", :@test_run]
+            ["-t", "--test", "Run the apply in test mode (does nothing, reports failures)", :@test_run],
+            ["-o", "--only PATHSPEC", "Only apply the changes to these paths (comma separated, globs allowed)", :@only],
+            ["-w", "--workers COUNT", "Number of worker processes to apply with (1 turns it off)", :@workers]
             ])
             
             @repo_dir = Repository.search
@@ -22,6 +24,7 @@ module Repository
             valid? @repo_dir, "Could not find repository directory"
             valid?((@id or @rev), "You must specify either an id or revision name")
             valid?((not (@id and @rev)), "You cannot specify an id (-i) AND a revision name (-r)")
+            valid?((@workers == nil or @workers.to_i > 0), "The worker count (-w) must be a number over 0")
             
             if @repo_dir
                 @repo = Repository.new @repo_dir
@@ -38,15 +41,15 @@ module Repository
         def run
             @id = @repo.resolve_id(@rev, @id)
             target = File.dirname(@repo.path)  # need to know the source root to apply at
-            originals = File.expand_path(@repo.originals_dir)  # need the full path
             
             if @id
                 # found an id, but need to verify that it's a child of the current revision
                 parent_id = @repo['Path'].pop
                 
                 # a special case is if we're bootstrapping an empty dir, in which case
-                # the path is empty so there will be no parent.  This is allowed.
-                if @repo['Path'].empty? or parent_id == @repo.find_parent_of(@id)
+                # the path is empty so there will be no parent.  This is allowed.  A partial
+                # apply only brings in some changes so it can come from anywhere.
+                if @only or @repo['Path'].empty? or parent_id == @repo.find_parent_of(@id)
                     # alright, looks like we're in business
                     cs_path, md = @repo.find_changeset(@id)
                     data_file = nil
@@ -58,35 +61,54 @@ module Repository
                         if not journal_file or not data_file
                             UI.failure :contents, "The meta-data did not contain proper journal and data file contents."
                             return 
-                        elsif MetaData.verify_digests(cs_path, md).length > 0
+                        elsif MetaData.verify_digests(cs_path, md, @repo.local_changeset?(@id)).length > 0
                             UI.failure :security, "The changeset has been tampered with.  Aborting."
                             return
                         end
                             
                         
                         # apply_changeset closes the streams for us
-                        UI.start_finish("Applying to main directory") do
-                            journal_in = Zlib::GzipReader.new(File.open(journal_file))
-                            data_in = Zlib::GzipReader.new(File.open(data_file))
-                            ChangeSet.apply_changeset(journal_in, data_in, target, @test_run)
+                        failures = UI.start_finish("Applying to main directory") do
+                            journal_in = ChangeSet.open_journal(journal_file)
+                            data_in = ChangeSet.open_data(data_file)
+                            only = @only ? ChangeSet::PathSpec.new(@only.split(",")) : nil
+                            workers = @workers ? @workers.to_i : ChangeSet::ParallelApply::DEFAULT_WORKERS
+                            ChangeSet.apply_changeset(journal_in, data_in, target, @test_run, only, workers)
+                        end
+                        
+                        if @only
+                            # the tree isn't at this revision, so it's just local changes now
+                            UI.event :info, "Only applied #@only.  The changes show up as your own until you finish a revision."
+                            return
                         end
 
                         if not File.exist? Repository::UNDO_JOURNAL and not @test_run
-                            # the undo changeset has to go in the reverse direction
+                            # the undo changeset has to go in the reverse direction, and only
+                            # has to look at what this changeset touched
                             UI.start_finish("Creating 'undo' revision") do
-                                changes = ChangeSet.make_changeset("undo", target, originals)
+                                journal_in = ChangeSet.open_journal(journal_file)
+                                touched = ChangeSet.journal_paths(journal_in)
+                                journal_in.close
+                                @repo.make_undo_changeset("undo", target, touched)
                             end
                         end
                         
-                        # and apply it to the originals directory to sync them up
-                        UI.start_finish("Applying to the repository originals directory") do
-                            journal_in = Zlib::GzipReader.new(File.open(journal_file))
-                            data_in = Zlib::GzipReader.new(File.open(data_file))
-                            ChangeSet.apply_changeset(journal_in, data_in, @repo.originals_dir, @test_run)
+                        # sync the originals up from what was just applied, or if anything went
+                        # wrong apply the changeset to them separately
+                        if @test_run or failures > 0 or not @repo.sync_originals(journal_file, target)
+                            UI.start_finish("Applying to the repository originals") do
+                                @repo.apply_to_originals(journal_file, data_file, @test_run)
+                            end
                         end
                         
                         # update our current path (but not if we're testing)
                         @repo['Path'] = @repo['Path'] << @id unless @test_run
+                        
+                        if not @test_run and @repo.snapshot_due? @id
+                            UI.start_finish("Storing a snapshot of the originals") do
+                                @repo.store_snapshot(@id)
+                            end
+                        end
                     end
                 else
                     UI.failure :constraint, "Sorry, can't apply a revision unless it is a child of the current one."
@@ -39,7 +39,7 @@ module Repository
             if not @revision
                 # need to make a revision based on the most recent one
                 rev_path = @repo['Path']
-                path, md = @repo.find_changeset(rev_path.last)
+                md = @repo.metadata(rev_path.last)
                 # ruby is cool, this works for just about anything even characters and other goodies in a revision name
                 # we have to break off the ending parts of the revision in order to avoid unexpected
                 # behavior where it will convert 0.5.9 to 0.6.0 instead of 0.5.9.10.
@@ -0,0 +1,55 @@
+require 'fastcst/ui'
+require 'fastcst/repo'
+
+
+module Repository
+
+    # Rebuilds any revision in the repository into a fresh directory without touching
+    # the working files.  It uses Repository#checkout so it starts from the nearest
+    # snapshot rather than replaying every changeset from the root.
+    class CheckoutCommand < Command
+        def initialize(argv)
+            super(argv, [
+            ["-i", "--id ID", "Specify a changeset ID to check out (defaults to current)", :@id],
+            ["-r", "--rev ID", "Specify a changeset Revision name to check out", :@rev],
+            ["-d", "--directory DIR", "Directory to create the revision in (must not exist)", :@directory],
+            ["-o", "--originals", "Rebuild the repository's record of the originals from the revision path", :@originals]
+            ])
+            
+            @repo_dir = Repository.search
+        end
+    
+        def validate
+            valid? @repo_dir, "Could not find repository directory"
+            valid?((@directory or @originals), "You must give a directory to check out into")
+            valid?((not (@id and @rev)), "You cannot specify an id (-i) AND a revision name (-r)")
+            valid?((not File.exist?(@directory.to_s)), "The directory #@directory already exists")
+            
+            @repo = Repository.new @repo_dir if @repo_dir
+            
+            return @valid
+        end
+    
+        def run
+            if @originals
+                UI.start_finish("Rebuilding the originals from the revision path") do
+                    UI.failure :apply, "Could not rebuild the originals" if not @repo.rebuild_stat_index
+                end
+                return
+            end
+            
+            @id = @repo.resolve_id(@rev, @id)
+            
+            if @id
+                count = nil
+                UI.start_finish("Checking out #{@repo.build_readable_name @id} to #@directory") do
+                    count = @repo.checkout(@id, @directory)
+                end
+                
+                UI.event :finished, "Applied #{count} changesets after the nearest snapshot" if count
+            else
+                UI.failure :search, "Could not find a matching revision"
+            end
+        end
+    end
+end
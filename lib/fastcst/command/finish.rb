@@ -4,13 +4,18 @@ require 'fastcst/repo'
 
 module Repository
 
-    UNDO_JOURNAL = "undo.yaml.gz"
+    UNDO_JOURNAL = "undo.journal.gz"
+    # what the undo journal was called when journals were YAML
+    OLD_UNDO_JOURNAL = "undo.yaml.gz"
     UNDO_DATA = "undo.fcs"
     
     
     class FinishCommand < Command
         def initialize(argv)
             super(argv, [
+            ["-v", "--verbose", "Report how much was read to make the revision", :@verbose],
+            ["-z", "--codec NAME", "Compression to use (zlib, zlib:0 to zlib:9, lz, store)", :@codec],
+            ["-c", "--checksum NAME", "Checksum for the changeset's files (md5, crc32 is only trusted in this repository)", :@checksum]
             ])
             
             @repo_dir = Repository.search
@@ -22,6 +27,15 @@ module Repository
             if @repo_dir
                 @repo = Repository.new @repo_dir
                 valid? @repo['Current Revision'], "You cannot finish until you start a new revision with 'begin'"
+                @codec ||= @repo.codec
+                @checksum ||= @repo.checksum
+                valid? MetaData::CHECKSUMS.include?(@checksum), "Unknown checksum #@checksum, use #{MetaData::CHECKSUMS.join(' or ')}"
+            end
+            
+            begin
+                ChangeSet::Codec.get(@codec) if @codec
+            rescue
+                valid? false, $!.message
             end
             
             return @valid
@@ -41,41 +55,60 @@ module Repository
             cs_name = @repo['Project'] + '-' + md['Revision']
             
             Dir.chdir @repo.work_dir do
-                originals = File.join("..","originals")
                 sources = File.join("..","..")
                 data_file = cs_name + ChangeSet::DATA_FILE_SUFFIX
                 journal_file = cs_name + ChangeSet::JOURNAL_FILE_SUFFIX
                     
 
-                UI.start_finish("Creating revision") do
-                    changes = ChangeSet.make_changeset(cs_name, originals, sources)
+                index = @repo.stat_index
+                
+                changes = @repo.with_originals([]) do |originals|
+                    changes = nil
+                    UI.start_finish("Creating revision") do
+                        # the watcher's journal saves scanning the whole tree
+                        changes = ChangeSet.make_changeset(cs_name, originals, sources, index, @repo.dirty_paths, @codec) do |c|
+                            index.materialize(c.source_paths, originals)
+                        end
+                    end
                     
-                    # abort if there were no changes
-                    if not changes.has_changes?
-                        return
+                    # create the undo in the reverse direction, the originals it needs are already out
+                    if changes.has_changes?
+                        UI.start_finish("Creating 'undo' revision") do
+                            ChangeSet.save_changeset("undo", changes.reverse, @repo.local_codec)
+                        end
+                        
+                        # the undo shares the forward build's digests, so this covers both
+                        UI.event :info, "Read #{changes.bytes_read} bytes" if @verbose
                     end
+                    
+                    changes
                 end
                 
-                # create the undo in the reverse direction
-                UI.start_finish("Creating 'undo' revision") do
-                    changes = ChangeSet.make_changeset("undo", sources, originals)
+                # keep the stats of files that were only touched, syncing the originals loads it again
+                index.save if not changes.refreshed.empty?
+                
+                # abort if there were no changes
+                if not changes.has_changes?
+                    return
                 end
                 
-                UI.start_finish("Syncing with the originals directory") do
-                    # sync the originals directory
-                    journal_in = Zlib::GzipReader.new(File.open(journal_file))
-                    data_in = Zlib::GzipReader.new(File.open(data_file))
+                UI.start_finish("Syncing with the originals") do
+                    # the changeset was just made from the working tree, so the originals can
+                    # be synced from it unless something changed since
+                    if not @repo.sync_originals(journal_file, sources)
+                        @repo.apply_to_originals(journal_file, data_file)
+                    end
                     
-                    # apply closes the files for us
-                    ChangeSet.apply_changeset(journal_in, data_in, originals)
+                    # the originals match the working tree now, so nothing is dirty
+                    @repo.reset_dirty_journal([]) if @repo.dirty_journal.watching?
                     
                     # create the meta-data
-                    MetaData.finish_metadata(md_file, parent_id, data_file, journal_file)
+                    MetaData.finish_metadata(md_file, parent_id, data_file, journal_file, @checksum)
                 end
             end
         
             # store the newly created changeset, doing a move instead of a copy
-            md = @repo.store_changeset @repo.work_dir, MetaData::META_DATA_FILE, move=true
+            md = @repo.store_changeset @repo.work_dir, MetaData::META_DATA_FILE, move=true, local=true
             
             # get the new location and move the undo there
             cs_path, md = @repo.find_changeset(md['ID'])
@@ -87,6 +120,13 @@ module Repository
             # and update the environment to reflect our new revision path
             @repo["Path"] = @repo["Path"] << md['ID']
             
+            # keep checkouts of this revision from having to replay the whole history
+            if @repo.snapshot_due? md['ID']
+                UI.start_finish("Storing a snapshot of the originals") do
+                    @repo.store_snapshot(md['ID'])
+                end
+            end
+            
             UI.event :finished, "New revision: #{@repo.build_readable_name md['ID']}"
             
             # and remove the current revision
@@ -92,23 +92,72 @@ class IndexCommand < Command
     end
     
     
+    # Puts the file into the index if it isn't there or has a different date.
+    # Returns true if it was indexed.
+    def index_file(odeum, file)
+        doc = odeum.get(file)
+        indexed = false
+        
+        if not doc or doc["Date"] != File.mtime(file).to_s
+            puts "#{file}"
+            doc = setup_new_doc(odeum, file, file)
+            odeum.put(doc, MAX_WORDS, true)
+            indexed = true
+        end
+        
+        doc.close if doc
+        return indexed
+    end
+    
+    
+    # Reads the paths that changed since the last run out of the watcher's DirtyJournal.
+    # It returns nil if the whole tree has to be walked.  The journal position is kept
+    # in the index directory and only written by save_dirty_position after a good run.
+    def read_dirty_paths
+        pos_file = File.join(@index_dir, "dirty.pos")
+        generation, offset = File.exist?(pos_file) ? File.read(pos_file).split : [nil, 0]
+        
+        paths, @dirty_generation, @dirty_offset = @repo.dirty_journal.read(generation, offset.to_i)
+        
+        # without a generation there's no previous run to start from
+        return generation ? paths : nil
+    end
+    
+    def save_dirty_position
+        if @dirty_generation
+            File.open(File.join(@index_dir, "dirty.pos"), "w") { |out| out.write "#@dirty_generation #@dirty_offset" }
+        end
+    end
+    
+    
     def build_index(dir, catalog)
         odeum = create_index(catalog)
+        dirty = @remove ? nil : read_dirty_paths
         
         i = 0
         Dir.chdir(dir) do
-            Find.find("./") do |file|
-                if File.directory? file and excluded(file)
-                    puts "Skipping directory #{file}"
-                    Find.prune
-                elsif File.file? file and not excluded(file)
-                    doc = odeum.get(file)
-                    if not doc or doc["Date"] != File.mtime(file).to_s
-                        puts "#{file}"
-                        doc = setup_new_doc(odeum, file, file)
-                        odeum.put(doc, MAX_WORDS, true)
-                        
-                        if (i += 1) % 1000 == 0 
+            if dirty
+                # the watcher told us exactly what changed
+                dirty.each do |file|
+                    if File.file? file and not excluded(file)
+                        index_file(odeum, file)
+                    elsif File.directory? file and not excluded(file)
+                        Find.find(file) do |sub|
+                            if File.directory? sub and excluded(sub)
+                                Find.prune
+                            elsif File.file? sub and not excluded(sub)
+                                index_file(odeum, sub)
+                            end
+                        end
+                    end
+                end
+            else
+                Find.find("./") do |file|
+                    if File.directory? file and excluded(file)
+                        puts "Skipping directory #{file}"
+                        Find.prune
+                    elsif File.file? file and not excluded(file)
+                        if index_file(odeum, file) and (i += 1) % 1000 == 0 
                             print "Crunching index...."
                             $stdout.flush
                             odeum.sync
@@ -116,12 +165,12 @@ class IndexCommand < Command
                             $stdout.flush
                         end
                     end
-                    
-                    doc.close if doc
                 end
             end
         end
         
+        save_dirty_position
+        
         if @cull
             print "Optimizing #{catalog} index..."
             $stdout.flush
@@ -138,13 +187,14 @@ class IndexCommand < Command
         odeum = create_index(catalog)
         
         cs_ids.each do |id|
-            path, md = @repo.find_changeset(id)
-            md_file = @repo.find_meta_data(id)
-            md_uri = File.join(id, File.basename(md_file))
+            md_uri = File.join(id, MetaData::META_DATA_FILE)
 
             doc = odeum.get(md_uri)
             
             if not doc
+                # only write out packed changesets that still need indexing
+                path, md = @repo.find_changeset(id)
+                md_file = @repo.find_meta_data(id)
                 puts "changeset: #{id}"
 
                 # index the meta-data file with a fake path as the uri
@@ -155,11 +205,11 @@ class IndexCommand < Command
                 # index the journal and fcs contents
                 Dir.chdir path do
                     journal_file, data_file = MetaData.extract_journal_data(md)
-                    journal_in = Zlib::GzipReader.new(File.open(journal_file))
-                    data_in = Zlib::GzipReader.new(File.open(data_file))
+                    journal_in = ChangeSet.open_journal(journal_file)
+                    data_in = ChangeSet.open_data(data_file)
                     
                     # each document 
-                    YAML.each_document(journal_in) do |record|
+                    ChangeSet.each_operation(journal_in) do |record|
                         type, info = record
 
                         rev_uri = nil
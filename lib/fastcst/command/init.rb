@@ -43,7 +43,6 @@ module Repository
             md_file = MetaData::META_DATA_FILE
 
             Dir.chdir repo.work_dir do
-                originals = File.join("..","originals")
                 sources = File.join("..","..")
                 data_file = cs_name + ChangeSet::DATA_FILE_SUFFIX
                 journal_file = cs_name + ChangeSet::JOURNAL_FILE_SUFFIX
@@ -51,7 +50,10 @@ module Repository
 
                 # first we try to make the changeset so we can see if this is pristine or not
                 UI.start_finish("Creating initial 'root' revision") do
-                    changes = ChangeSet.make_changeset(cs_name, originals, sources)
+                    # the originals are empty so this is every file in the tree
+                    changes = repo.with_originals([]) do |originals|
+                        ChangeSet.make_changeset(cs_name, originals, sources, nil, nil, repo.codec)
+                    end
 
                     # no changes against the empty originals directory means that this is an empty start
                     if not changes.has_changes?
@@ -65,19 +67,15 @@ module Repository
                     MetaData.create_metadata(md_file, @project, "root", purpose, @name, @email)
                 end
                 
-                UI.start_finish("Applying revision to originals backup") do
-                    journal_in = Zlib::GzipReader.new(File.open(journal_file))
-                    data_in = Zlib::GzipReader.new(File.open(data_file))
-                    
-                    # apply closes the files for us
-                    ChangeSet.apply_changeset(journal_in, data_in, originals)
+                UI.start_finish("Applying revision to the originals") do
+                    repo.apply_to_originals(journal_file, data_file)
                     
-                    MetaData.finish_metadata(md_file, "NONE", data_file, journal_file)
+                    MetaData.finish_metadata(md_file, "NONE", data_file, journal_file, repo.checksum)
                 end
             end
         
             # store the newly created changeset, doing a move instead of a copy
-            md = repo.store_changeset repo.work_dir, md_file, move=true
+            md = repo.store_changeset repo.work_dir, md_file, move=true, local=true
             # and update the environment to reflect our new revision path
             repo["Path"] = repo["Path"] << md['ID']
             
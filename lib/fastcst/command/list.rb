@@ -10,6 +10,8 @@ module Repository
         def initialize(argv)
             super(argv, [
                 ["-r", "--rev NAME", "A revision name to get the ID", :@rev],
+                ["-c", "--complete PREFIX", "Just print the revision names starting with PREFIX", :@complete],
+                ["-l", "--long", "Include the author and date of each changeset", :@long],
             ])
 
             @repo_dir = Repository.search
@@ -40,14 +42,18 @@ module Repository
             # and now go through each child and print it tabbed in with the id
             children = nil
             if repo['Path'].empty?
-                children = repo.list_changesets
+                children = repo.revision_index.ids
             else
                 children = repo.find_all_children(id)
             end
             
             # make a new hash that 
             children.each do |id|
-                puts "\t#{repo.build_readable_name(id)} -- #{id}"
+                if @long
+                    puts "\t#{repo.summary_line(id)}"
+                else
+                    puts "\t#{repo.build_readable_name(id)} -- #{id}"
+                end
             end
         end
         
@@ -55,6 +61,12 @@ module Repository
         def run
             repo = Repository.new @repo_dir
 
+            if @complete
+                # one name per line and nothing else so shell completion can use it
+                repo.complete_revision(@complete).each { |rev| puts rev }
+                return
+            end
+
             print_readable_path(repo)
 
             # either print the requested revision (or ones like it) or print the current path top
@@ -62,8 +74,7 @@ module Repository
                 # they just want a revision name to get the ID
                 possibles = repo.find_revision(@rev)
                 possibles.each do |rev, id|
-                    path, md = repo.find_changeset(id)
-                    puts "#{rev} -- #{id} -- #{md['Created By']['E-Mail']}"
+                    puts "#{rev} -- #{id} -- #{repo.revision_index[id].email}"
                     print_children(repo, id)
                 end
             else
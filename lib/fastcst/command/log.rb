@@ -8,7 +8,8 @@ module Repository
     class LogCommand < Command
         def initialize(argv)
             super(argv, [
-                ["-s", "--show", "Show the current log", :@show]
+                ["-s", "--show", "Show the current log", :@show],
+                ["-p", "--path", "Show the changesets in the current revision path", :@path]
             ])
             
             @repo_dir = Repository.search
@@ -20,7 +21,7 @@ module Repository
             
             if @repo_dir
                 @repo = Repository.new @repo_dir
-                valid? @repo['Current Revision'], "You cannot log until you start a new revision with 'begin'"
+                valid?((@path or @repo['Current Revision']), "You cannot log until you start a new revision with 'begin'")
             end
             
             return @valid
@@ -28,6 +29,12 @@ module Repository
         
         def run
             
+            if @path
+                # straight from the revision index, newest first
+                @repo['Path'].reverse.each { |id| puts @repo.summary_line(id) || "#{id} -- not in the repository" }
+                return
+            end
+            
             # check that a revision is in progress
             if not @repo['Current Revision']
                 UI.failure :constraint, "You have not used begin to start a revision yet."
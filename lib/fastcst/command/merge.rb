@@ -42,21 +42,53 @@ class MergeCommand < Command
     end
     
     def run
+        current = @repo['Path'].last
+        if current and @repo.ancestor?(@id, current)
+            puts "This changeset is already part of the current revision."
+            return
+        elsif current
+            base = @repo.common_ancestor(@id, current)
+            puts "Merge base: #{base ? @repo.build_readable_name(base) + ' -- ' + base : 'NONE'}"
+        end
+        
         cs_path, md = @repo.find_changeset(@id)
         journal_file, data_file = MetaData.extract_journal_data(md)
         journal_path = File.join(cs_path, journal_file)
         puts "Loading journal #{journal_path}"
         
-        journal = Zlib::GzipReader.new(File.open(journal_path))
+        journal = ChangeSet.open_journal(journal_path)
+        data_path = File.join(cs_path, data_file)
+        data = ChangeSet.open_data(data_path)
+        bases = @repo.object_store
 
         # build the inverted list of files and things done to them, and the set of files
         apply_count = 0   # used later to figure out if we need to do anything
-        YAML.each_document(journal) do |data|
-            op = ChangeSet::Operation.create(data, ".")
+        ops = []
+        ChangeSet.each_operation(journal) do |info|
+            op = ChangeSet::Operation.create(info, ".")
             res = op.merge
+            length = op.info[:length] || 0
+            
+            # a changed file can still take the delta if the file it was made against is in
+            # the object store, the three-way merge finds out if the changes really overlap
+            if res < 0 and op.kind_of? ChangeSet::DeltaOperation and length > 0 and
+                File.exist?(op.info[:path]) and bases.has?(op.info[:digest])
+                res = op.merge_with_base(bases.read(op.info[:digest]), data.read(length))
+                puts "MERGED #{op.class::TYPE}: #{op.info[:path]}" if res == 1
+            elsif length > 0
+                data.seek(length, IO::SEEK_CUR)
+            end
+            ops << [op, res]
+            
             if res < 0
                 @conflicts << op
                 puts "CONFLICT #{op.class::TYPE}: #{op.info[:path]}"
+                
+                if op.respond_to? :conflicts and op.conflicts
+                    op.conflicts.each do |first, last|
+                        puts "    " + (first > last ? "both added after line #{last}" : "lines #{first}-#{last}")
+                    end
+                end
             elsif res == 0
                 puts "SKIP #{op.class::TYPE}: #{op.info[:path]}"
             elsif res == 1
@@ -66,6 +98,7 @@ class MergeCommand < Command
                 puts "ERROR: invalid response #{res} for #{op.class::TYPE}"
             end
         end
+        data.close
                 
         if @conflicts.empty?
             # No point in continuing if everything was skipped and there were no conflicts
@@ -77,22 +110,21 @@ class MergeCommand < Command
             good = UI.ask("Looks like there are no conflicts.  Want to merge now? [yN]")
             
             if good.downcase == "y"
-                # since there are no conflicts we can just apply this thing like normal
-                journal.rewind
-                
-                data_path = File.join(cs_path, data_file)
-                data = Zlib::GzipReader.new(File.open(data_path))
+                # since there are no conflicts we can just apply this thing like normal,
+                # using the same operations so the three-way merged files are kept
+                data = ChangeSet.open_data(data_path)
                 
-                YAML.each_document(journal) do |info|
-                    op = ChangeSet::Operation.create(info, ".")
+                ops.each do |op, result|
                     # having merge return 1 means that this operation is "greater" (has
                     # more information) so it should be applied
-                    if op.merge == 1
+                    if result == 1
                         op.run(data)
-                    elsif op.merge == -1
-                        puts "WHAT! No conflicts were detected, yet now there's conflicts!"
+                    else
+                        # skipping jumps over the operation's data without reading it
+                        op.skip(data)
                     end
                 end
+                data.close
                 
                 # and now we add a disposition record saying that this revision was merged in
                 md_file = File.join(@repo.work_dir, MetaData::META_DATA_FILE)
@@ -0,0 +1,44 @@
+require 'fastcst/ui'
+require 'fastcst/repo'
+
+
+module Repository
+
+    # Moves the loose changesets in the root directory into a Pack so the
+    # repository doesn't need a directory and a handful of files for each one.
+    # With -a all the existing packs are combined into the new one as well.
+    # Loose objects left by older versions are moved into the ObjectStore's pack.
+    class PackCommand < Command
+        def initialize(argv)
+            super(argv, [
+            ["-a", "--all", "Repack everything (including the old packs) into one pack", :@all]
+            ])
+            
+            @repo_dir = Repository.search
+        end
+    
+        def validate
+            valid? @repo_dir, "Could not find a repository directory"
+            
+            return @valid
+        end
+    
+    
+        def run
+            repo = Repository.new @repo_dir
+            
+            count = UI.start_finish("Packing changesets") do
+                repo.pack_changesets(@all)
+            end
+            
+            if count == 0
+                UI.event :info, "Nothing to pack, every changeset is already packed"
+            else
+                UI.event :info, "Packed #{count} changesets, there are #{repo.packs.length} packs"
+            end
+            
+            moved = repo.object_store.pack_loose
+            UI.event :info, "Moved #{moved} loose objects into the object pack" if moved > 0
+        end
+    end
+end
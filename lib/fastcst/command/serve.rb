@@ -38,7 +38,15 @@ module Repository
                 :MimeTypes => @mime_table
                 )
             
-            @server.mount("/root", HTTPServlet::FileHandler, repo.root_dir, {:FancyIndexing => true})
+            @server.mount_proc("/root") {|req, resp|
+                # packed changesets are served the same as the loose ones in root
+                id, name = req.path.split("/")[2, 2]
+                data = (id and name) ? repo.read_changeset_file(id, name) : nil
+                raise HTTPStatus::NotFound, "#{req.path} not found." if not data
+                
+                resp['Content-Type'] = HTTPUtils.mime_type(name, @mime_table)
+                resp.body = data
+            }
             @server.mount_proc("/index.yaml") {|req, resp|
                 # handles generating the index.yaml file that is normally published
                 repo = Repository.new Repository.search
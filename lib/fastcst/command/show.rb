@@ -11,7 +11,11 @@ module Repository
             ["-i", "--id ID", "Specify a changeset ID to send (defaults to current)", :@id],
             ["-r", "--rev ID", "Specify a changeset Revision name to send", :@rev],
             ["-c", "--current", "The currently active revision (the one you're building)", :@current],
-            ["-l", "--list", "List the operations and file names in the journal.", :@list]
+            ["-l", "--list", "List the operations and file names in the journal.", :@list],
+            ["-d", "--deltas", "List the journal and print each delta's contents (implies -l).", :@deltas],
+            ["-y", "--yaml", "Print the whole journal as YAML.", :@yaml],
+            ["-f", "--file PATH", "Print just the data stored for this path (like ./src/file.c).", :@file],
+            ["-s", "--summary", "Print only the one line summary, without loading the meta-data.", :@summary]
             ])
             
             @repo_dir = Repository.search
@@ -39,6 +43,9 @@ module Repository
                 if not @id
                     UI.failure :search, "Could not find the specified revision"
                     return
+                elsif @summary
+                    puts repo.summary_line(@id)
+                    return
                 end
                 
                 cs_path, md = repo.find_changeset(@id)
@@ -49,20 +56,78 @@ module Repository
                     puts "**** Revision meta-data ****"
                     YAML.dump(md, $stdout)
                     
-                    if @list
+                    if @list or @deltas
                         puts "\n\n----- Revision Journal Contents -----"
                         journal_file, data_file = MetaData.extract_journal_data(md)
-                        journal_in = Zlib::GzipReader.new(File.open(File.join(cs_path, journal_file)))
+                        journal_in = ChangeSet.open_journal(File.join(cs_path, journal_file))
+                        data_in = ChangeSet.open_data(File.join(cs_path, data_file)) if @deltas
                         
-                        YAML.each_document(journal_in) do |type, info|
+                        ChangeSet.each_operation(journal_in) do |type, info|
                             puts "#{type}: #{info[:path]}" if info[:path]
+                            
+                            # the data has to be read in order even for the operations we don't print
+                            if @deltas and info[:length] and info[:length] > 0
+                                if type == ChangeSet::DeltaOperation::TYPE
+                                    data = data_in.read(info[:length])
+                                    DeltaReader.new.apply(StringIO.new(data), TextEmitter.new)
+                                else
+                                    data_in.seek(info[:length], IO::SEEK_CUR)
+                                end
+                            end
                         end
                         
                         journal_in.close
+                        data_in.close if data_in
+                    end
+                    
+                    if @file
+                        journal_file, data_file = MetaData.extract_journal_data(md)
+                        show_file(File.join(cs_path, journal_file), File.join(cs_path, data_file))
+                    end
+                    
+                    if @yaml
+                        puts "\n\n----- Revision Journal -----"
+                        journal_file, data_file = MetaData.extract_journal_data(md)
+                        journal_in = ChangeSet.open_journal(File.join(cs_path, journal_file))
+                        ChangeSet.export_journal(journal_in, $stdout)
+                        journal_in.close
                     end
                 end
             end
         end
+        
+        
+        # Prints the data for just the @file path.  With a data file that has a table of
+        # contents it goes straight to that payload, the old gzip ones are read up to it.
+        def show_file(journal_path, data_path)
+            journal_in = ChangeSet.open_journal(journal_path)
+            data_in = ChangeSet.open_data(data_path)
+            record = nil
+            
+            ChangeSet.each_operation(journal_in) do |type, info|
+                length = info[:length] || 0
+                if info[:path] == @file and length > 0
+                    data = data_in.respond_to?(:read_entry) ? data_in.read_entry(@file) : data_in.read(length)
+                    record = [type, data]
+                    break
+                elsif not data_in.respond_to?(:read_entry)
+                    data_in.read(length)
+                end
+            end
+            
+            journal_in.close
+            data_in.close
+            
+            if not record
+                UI.failure :search, "No data stored for #@file in this revision"
+            elsif record[0] == ChangeSet::DeltaOperation::TYPE
+                puts "\n\n----- Delta for #@file -----"
+                DeltaReader.new.apply(StringIO.new(record[1]), TextEmitter.new)
+            else
+                puts "\n\n----- Contents of #@file -----"
+                puts record[1]
+            end
+        end
     end
 end
 
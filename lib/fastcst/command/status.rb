@@ -26,7 +26,23 @@ module Repository
             
             base_dir = File.dirname(repo.path)
             
-            changes = ChangeSet::ChangeSetBuilder.new(repo.originals_dir, base_dir)
+            # the originals are all in the stat index so none of them have to be written out
+            index = repo.stat_index
+            
+            # with the watcher running only the dirty paths need to be looked at
+            journal = repo.dirty_journal
+            dirty = repo.dirty_paths
+            changes = repo.with_originals([]) do |originals|
+                ChangeSet::ChangeSetBuilder.new(originals, base_dir, index, dirty)
+            end
+            
+            # files that were only touched have their new stats so they aren't hashed again
+            index.save if not changes.refreshed.empty?
+            
+            if not dirty and journal.watching?
+                # we had to do a full scan, so start the journal over with what was found
+                repo.reset_dirty_journal(changes.changed_paths)
+            end
             
             if not changes.has_changes?
                 UI.event :exit, "Nothing changed.  Exiting."
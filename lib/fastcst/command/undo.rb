@@ -30,6 +30,8 @@ module Repository
             cs_path, md = @repo.find_changeset(id)
             
             undo_journal = File.join(cs_path, Repository::UNDO_JOURNAL)
+            old_journal = File.join(cs_path, Repository::OLD_UNDO_JOURNAL)
+            undo_journal = old_journal if not File.exist?(undo_journal) and File.exist?(old_journal)
             undo_data = File.join(cs_path, Repository::UNDO_DATA)
             
             if not File.exist?(undo_journal)
@@ -39,18 +41,17 @@ module Repository
             elsif cs_path
                 # get the undo revision and apply it to both directories
                 
-                UI.start_finish("Applying undo revision for #{md['Revision']}") do
-                    journal_in = Zlib::GzipReader.new(File.open(undo_journal))
-                    data_in = Zlib::GzipReader.new(File.open(undo_data))
+                failures = UI.start_finish("Applying undo revision for #{md['Revision']}") do
+                    journal_in = ChangeSet.open_journal(undo_journal)
+                    data_in = ChangeSet.open_data(undo_data)
                     
                     ChangeSet.apply_changeset(journal_in, data_in, ".")
                 end
                 
-                UI.start_finish("Applying undo revision to originals directory") do
-                    journal_in = Zlib::GzipReader.new(File.open(undo_journal))
-                    data_in = Zlib::GzipReader.new(File.open(undo_data))
-                    
-                    ChangeSet.apply_changeset(journal_in, data_in, @repo.originals_dir)
+                if failures > 0 or not @repo.sync_originals(undo_journal, ".")
+                    UI.start_finish("Applying undo revision to the originals") do
+                        @repo.apply_to_originals(undo_journal, undo_data)
+                    end
                 end
                 
                 # now update the path to have the new 
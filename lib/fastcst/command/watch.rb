@@ -0,0 +1,72 @@
+require 'fastcst/ui'
+require 'fastcst/repo'
+require 'dir_scan'
+
+
+module Repository
+
+    # Starts or stops the background watcher that records changed paths in the
+    # DirtyJournal using inotify (see DirScan.watch).  While it's running status,
+    # finish, and index only look at the paths it recorded.
+    class WatchCommand < Command
+        def initialize(argv)
+            super(argv, [
+            ["-k", "--kill", "Stop the running watcher", :@kill],
+            ["-s", "--status", "Report whether the watcher is running", :@status]
+            ])
+            
+            @repo_dir = Repository.search
+        end
+    
+        def validate
+            valid? @repo_dir, "Could not find a repository directory"
+            
+            return @valid
+        end
+    
+    
+        def run
+            repo = Repository.new @repo_dir
+            journal = repo.dirty_journal
+            pid = journal.watcher_pid
+            
+            if @status
+                if pid
+                    UI.event :info, "Watcher is running as process #{pid}"
+                else
+                    UI.event :info, "Watcher is not running"
+                end
+            elsif @kill
+                if pid
+                    Process.kill("TERM", pid)
+                    File.unlink journal.pid_file
+                    UI.event :info, "Stopped watcher #{pid}"
+                else
+                    UI.failure :constraint, "The watcher is not running"
+                end
+            elsif pid
+                UI.failure :constraint, "The watcher is already running as process #{pid}"
+            elsif not (lock = journal.lock_pid_file)
+                UI.failure :constraint, "Another watcher is starting up"
+            else
+                base_dir = File.dirname(repo.path)
+                
+                # nobody knows what changed while it wasn't running, so start with a full scan
+                journal.reset
+                
+                # the watcher keeps the pid file's lock until it exits
+                pid = fork do
+                    Process.setsid
+                    $stdin.reopen("/dev/null")
+                    $stdout.reopen("/dev/null", "w")
+                    $stderr.reopen("/dev/null", "w")
+                    DirScan.watch(base_dir, journal.path)
+                end
+                
+                Process.detach(pid)
+                journal.write_pid(lock, pid)
+                UI.event :info, "Watcher started as process #{pid}"
+            end
+        end
+    end
+end
@@ -0,0 +1,253 @@
+require 'zlib'
+require 'digest/md5'
+require 'fastcst/codec'
+
+
+module ChangeSet
+
+    DATA_MAGIC = "FCSTDAT3"
+    # data files from before the compressed length was 64 bits
+    DATA2_MAGIC = "FCSTDAT2"
+    # data files from before the codec was recorded, they're all zlib
+    OLD_DATA_MAGIC = "FCSTDAT1"
+    TOC_MAGIC = "FCSTTOC1"
+
+    # = Introduction
+    #
+    # Writes the changeset data file (the .fcs) as a container of separately
+    # compressed blocks with a table of contents at the end.  The data file used
+    # to be one gzip stream of every payload run together, so getting to one
+    # file's data meant decompressing everything before it.  With the table of
+    # contents a DataReader can go straight to the block for a path, and skipping
+    # an operation skips its whole block without decompressing it.
+    #
+    # The operations don't know about any of this.  They write their payload with
+    # write like before, and Operation#store calls end_entry when each one is done.
+    #
+    # Each block is compressed with the Codec given to the writer and the codec's
+    # name is in the header, so the reader always knows how to read it.
+    #
+    # = File Format
+    #
+    #   DATA_MAGIC V(codec_name_length) codec_name
+    #   blocks -- one compressed block per payload, one after the other
+    #   V(count) count * [ V(path_length) path V(offset_lo) V(offset_hi) V(compressed_lo)
+    #                      V(compressed_hi) V(length_lo) V(length_hi) a16(digest) ]
+    #   V(toc_offset_lo) V(toc_offset_hi) TOC_MAGIC
+    #
+    # The entries are in the same order as the journal.  The offset is from the
+    # start of the file, the length is the uncompressed length, and the digest is
+    # the MD5 of the uncompressed payload so each block can be checked on its own.
+    #
+    # Older data files (OLD_DATA_MAGIC and DATA2_MAGIC) have a 32 bit V(compressed_length)
+    # instead of the lo/hi pair, and the OLD_DATA_MAGIC ones have no codec name.
+    class DataWriter
+
+        # Starts a data file on out (which it takes over and closes) that compresses
+        # with the codec (a name or a Codec).
+        def initialize(out, codec=DEFAULT_CODEC)
+            @out = out
+            @codec = codec.kind_of?(String) ? Codec.get(codec) : codec
+            @entries = []
+            @pos = 0
+            @compressor = nil
+            emit DATA_MAGIC + [@codec.name.length].pack("V") + @codec.name
+        end
+
+
+        # Adds to the payload of the current operation.
+        def write(data)
+            if not @compressor
+                @compressor = @codec.compressor
+                @md5 = Digest::MD5.new
+                @block_start = @pos
+                @length = 0
+            end
+
+            @md5 << data
+            @length += data.length
+            emit(@compressor << data)
+        end
+
+
+        # Ends the current payload and records it under the path.  Operations that
+        # didn't write anything don't get an entry.
+        def end_entry(path)
+            return if not @compressor
+
+            emit @compressor.finish
+            @compressor = nil
+            @entries << [path, @block_start, @pos - @block_start, @length, @md5.digest]
+        end
+
+
+        # Writes the table of contents and closes the output.
+        def close
+            toc_offset = @pos
+
+            emit [@entries.length].pack("V")
+            @entries.each do |path, offset, compressed, length, digest|
+                emit [path.length].pack("V") + path
+                emit [offset & 0xffffffff, offset >> 32, compressed & 0xffffffff, compressed >> 32,
+                      length & 0xffffffff, length >> 32, digest].pack("VVVVVVa16")
+            end
+
+            emit [toc_offset & 0xffffffff, toc_offset >> 32].pack("VV") + TOC_MAGIC
+            @out.close
+        end
+
+
+        private
+
+        def emit(data)
+            @out.write data
+            @pos += data.length
+        end
+    end
+
+
+    # Reads a data file written by DataWriter.  It can be read in order like a
+    # stream with read and seek (which is how the operations use it), or any one
+    # payload can be read directly with read_entry.
+    class DataReader
+        FOOTER_SIZE = 8 + TOC_MAGIC.length
+        ENTRY_SIZE = 24 + 16
+        OLD_ENTRY_SIZE = 20 + 16
+
+        Entry = Struct.new(:path, :offset, :compressed, :length, :digest)
+
+        attr_reader :entries, :file, :codec
+
+        def initialize(file)
+            @file = file
+            @in = File.open(file, "rb")
+            @entries = []
+            @by_path = {}
+            @next_block = 0
+            @buffer = ""
+            @buffer_pos = 0
+
+            magic = @in.read(DATA_MAGIC.length)
+            if magic == OLD_DATA_MAGIC
+                @codec = Codec.get("zlib")
+            else
+                @codec = Codec.get(@in.read(@in.read(4).unpack("V")[0]))
+            end
+
+            @in.seek(-FOOTER_SIZE, IO::SEEK_END)
+            lo, hi, toc_magic = @in.read(FOOTER_SIZE).unpack("VVa8")
+            raise "#{file} is not a changeset data file or it is damaged." if toc_magic != TOC_MAGIC
+
+            @in.seek((hi << 32) | lo)
+            count = @in.read(4).unpack("V")[0]
+            count.times do
+                path = @in.read(@in.read(4).unpack("V")[0])
+                if magic == DATA_MAGIC
+                    off_lo, off_hi, comp_lo, comp_hi, len_lo, len_hi, digest = @in.read(ENTRY_SIZE).unpack("VVVVVVa16")
+                else
+                    off_lo, off_hi, comp_lo, len_lo, len_hi, digest = @in.read(OLD_ENTRY_SIZE).unpack("VVVVVa16")
+                    comp_hi = 0
+                end
+                entry = Entry.new(path, (off_hi << 32) | off_lo, (comp_hi << 32) | comp_lo, (len_hi << 32) | len_lo, digest)
+                @entries << entry
+                @by_path[path] = entry
+            end
+        end
+
+
+        # Returns the Entry for the path or nil if it has no payload.
+        def entry(path)
+            @by_path[path]
+        end
+
+
+        # Reads and checks the whole payload for the path (or Entry), or nil if
+        # there isn't one.
+        def read_entry(path)
+            entry = path.kind_of?(Entry) ? path : @by_path[path]
+            return nil if not entry
+
+            @in.seek(entry.offset)
+            data = @codec.decompress(@in.read(entry.compressed), entry.length)
+
+            if Digest::MD5.digest(data) != entry.digest
+                raise "The payload for #{entry.path} is damaged."
+            end
+
+            return data
+        end
+
+
+        # Reads the next len bytes of payload in journal order.
+        def read(len)
+            out = ""
+
+            while out.length < len
+                if @buffer_pos >= @buffer.length
+                    break if not next_block
+                end
+
+                take = [len - out.length, @buffer.length - @buffer_pos].min
+                out << @buffer[@buffer_pos, take]
+                @buffer_pos += take
+            end
+
+            return out
+        end
+
+
+        # Skips ahead len bytes of payload.  Whole blocks that are skipped are
+        # never read or decompressed.  Only IO::SEEK_CUR is supported since that's
+        # all Operation#skip needs.
+        def seek(len, whence=IO::SEEK_CUR)
+            raise "DataReader can only seek forward from the current position." if whence != IO::SEEK_CUR
+
+            while len > 0
+                left = @buffer.length - @buffer_pos
+
+                if left > 0
+                    take = [len, left].min
+                    @buffer_pos += take
+                    len -= take
+                elsif @next_block < @entries.length and @entries[@next_block].length <= len
+                    len -= @entries[@next_block].length
+                    @next_block += 1
+                else
+                    break if not next_block
+                end
+            end
+
+            return 0
+        end
+
+
+        def close
+            @in.close
+        end
+
+
+        private
+
+        def next_block
+            return false if @next_block >= @entries.length
+
+            @buffer = read_entry(@entries[@next_block])
+            @buffer_pos = 0
+            @next_block += 1
+            return true
+        end
+    end
+
+
+    # Opens a changeset data file for reading, either the DataReader container or
+    # a plain gzip stream from before there was one.
+    def ChangeSet.open_data(file)
+        magic = File.open(file, "rb") { |f| f.read(DATA_MAGIC.length) }
+
+        if magic == DATA_MAGIC or magic == DATA2_MAGIC or magic == OLD_DATA_MAGIC
+            DataReader.new(file)
+        else
+            Zlib::GzipReader.new(File.open(file, "rb"))
+        end
+    end
+end
@@ -0,0 +1,161 @@
+require 'set'
+
+
+module Repository
+
+    # = Introduction
+    #
+    # The DirtyJournal is the file (.fastcst/dirty.log) that the fcst watch daemon
+    # writes the paths of changed files into.  As long as the watcher is running the
+    # commands can read it to find out which parts of the working tree were touched
+    # instead of walking the whole tree.
+    #
+    # The journal is always relative to the originals:  it lists every path that
+    # might be different from the originals.  The finish command resets it once
+    # the originals match the working tree again.
+    #
+    # = File Format
+    #
+    # The first line is "FCSTDIRTY generation" where the generation changes every time
+    # the journal is reset.  After that it's one "./path" per line as written by
+    # DirScan.watch.  A "!OVERFLOW" line means events were lost and anyone reading
+    # past it has to do a full scan.
+    #
+    # Readers that only want what changed since they last looked (like fcst index)
+    # remember the generation and the offset they read up to and pass them to read.
+    #
+    # The pid file holds the watcher's pid, and the watcher holds an flock on it for
+    # as long as it runs (see lock_pid_file).  A pid alone can't be trusted since
+    # once the watcher is gone the pid can be given to some other process.
+    class DirtyJournal
+        attr_reader :path, :pid_file
+
+        HEADER = "FCSTDIRTY"
+        OVERFLOW = "!OVERFLOW"
+
+        def initialize(path, pid_file)
+            @path = path
+            @pid_file = pid_file
+        end
+
+
+        # Returns the pid of the running watcher or nil if there isn't one.
+        def watcher_pid
+            return nil if not File.exist? @pid_file
+
+            File.open(@pid_file, "r") do |pid_in|
+                # if nobody holds the lock the watcher is gone, whatever the pid says
+                return nil if pid_in.flock(File::LOCK_SH | File::LOCK_NB)
+                pid = pid_in.read.to_i
+                return pid > 0 ? pid : nil
+            end
+        end
+
+
+        # Opens the pid file and takes the lock that says a watcher is running,
+        # returning the open File or nil if another watcher has it.  The lock goes
+        # with the file to a forked child, so the watch command takes it, forks the
+        # watcher, and then writes the pid with write_pid.
+        def lock_pid_file
+            lock = File.open(@pid_file, File::RDWR | File::CREAT, 0644)
+            return lock if lock.flock(File::LOCK_EX | File::LOCK_NB)
+
+            lock.close
+            return nil
+        end
+
+
+        # Writes the pid into the pid file opened by lock_pid_file and closes it.
+        # Whoever forked from it still has the lock.
+        def write_pid(lock, pid)
+            lock.truncate(0)
+            lock.write pid.to_s
+            lock.close
+        end
+
+
+        # True if the watcher is running, which means the journal can be trusted.
+        def watching?
+            watcher_pid != nil
+        end
+
+
+        # Starts a new generation of the journal with the given paths in it.  With no
+        # paths it records an overflow so the first reader does a full scan.  The file
+        # is replaced with a rename since the watcher may be appending to it.
+        #
+        # The generation and offset are what the read that fed the caller's scan gave
+        # back.  Anything the watcher wrote after that offset happened during the scan,
+        # so it's copied into the new journal (the old file is kept open across the
+        # rename so nothing written before it is missed).  If the journal isn't that
+        # generation anymore there's no telling what was lost and an overflow is
+        # recorded instead.  Without a generation nothing is carried over, which is
+        # only right when nothing was read, like when the watcher starts.
+        def reset(paths=nil, generation=nil, offset=0)
+            tmp = @path + ".tmp"
+            old = File.exist?(@path) ? File.open(@path, "rb") : nil
+
+            begin
+                File.open(tmp, "w") do |out|
+                    out.write "#{HEADER} #{Time.now.to_i}.#{$$}.#{rand(100000)}\n"
+
+                    if paths
+                        paths.each { |p| out.write "#{p}\n" }
+                    else
+                        out.write "#{OVERFLOW}\n"
+                    end
+                end
+
+                File.rename(tmp, @path)
+                return if not generation
+
+                # the old file only gets what was written before the rename, after it the
+                # watcher appends to the new one
+                if old and old.gets == "#{HEADER} #{generation}\n"
+                    old.seek(offset) if offset > old.pos
+                    missed = old.read
+                else
+                    missed = "#{OVERFLOW}\n"
+                end
+
+                File.open(@path, "a") { |out| out.write missed } if not missed.empty?
+            ensure
+                old.close if old
+            end
+        end
+
+
+        # Reads the dirty paths and returns [paths, generation, offset].  The paths are
+        # a Set, or nil if the journal can't be trusted (the watcher isn't running, the
+        # journal is missing, it's a different generation than the one given, or there
+        # was an overflow) and a full scan is needed.  The returned generation and offset
+        # can be given back later to only get the paths written after this read.
+        def read(generation=nil, offset=0)
+            return nil, nil, 0 if not watching? or not File.exist? @path
+
+            data = File.open(@path, "rb") { |f| f.read }
+            header_end = data.index("\n")
+            return nil, nil, 0 if not header_end or data[0, HEADER.length] != HEADER
+
+            current = data[HEADER.length + 1 ... header_end]
+            # only read up to the last full line, the watcher might be in the middle of one
+            last_line = data.rindex("\n")
+
+            if generation and generation != current
+                return nil, current, last_line + 1
+            end
+
+            offset = header_end + 1 if offset <= header_end
+            paths = Set.new
+
+            data[offset ... last_line + 1].split("\n").each do |line|
+                if line == OVERFLOW
+                    return nil, current, last_line + 1
+                end
+                paths << line
+            end
+
+            return paths, current, last_line + 1
+        end
+    end
+end
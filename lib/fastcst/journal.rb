@@ -0,0 +1,163 @@
+require 'yaml'
+require 'journal_reader'
+
+
+module ChangeSet
+
+    # = Introduction
+    #
+    # Writes the binary changeset journal.  Journals used to be one YAML document
+    # per operation, which made parsing the journal the slowest part of applying a
+    # changeset with lots of files.  The binary format is read natively by
+    # JournalReader.parse and gives back exactly the same [type, info] records, so
+    # nothing that uses a journal has to care which format it's in.  Use
+    # ChangeSet.each_operation to read either kind.
+    #
+    # YAML is still the readable format:  ChangeSet.export_journal turns any
+    # journal into the old YAML documents (fcst show -y uses it).
+    #
+    # = File Format
+    #
+    # Everything is little endian.  The file starts with JournalReader::MAGIC
+    # ("FCSTJRN1", the last character is the version) followed by the records:
+    #
+    #   V(body_length) C(type) C(field_count) field_count * [ C(key) value ]
+    #
+    # The type and key are codes from OPERATION_TYPES and KEYS.  A key of
+    # CUSTOM_KEY is followed by a V(length) name for keys not in the list.  Each
+    # value starts with a tag character:
+    #
+    # * s -- V(length) and the bytes of a String
+    # * p -- a path, see below
+    # * h -- a 32 character hex digest stored as the 16 raw bytes
+    # * i -- an Integer from 0 to 2**64 as V(low) V(high)
+    # * t -- a Time as V(seconds_low) V(seconds_high) V(microseconds), the seconds
+    #   signed so times before 1970 and after 2106 come back the same
+    # * T, F, N -- true, false, and nil
+    # * a -- V(count) and that many values, nested at most JournalReader::MAX_DEPTH deep
+    #
+    # Paths are split at the last / and the directory is interned.  The first
+    # time a directory shows up it's written as V(0xffffffff) V(length) name and
+    # gets the next number (starting at 0), after that it's just V(number).  The
+    # base name follows as V(length) name.  In a big changeset most of the
+    # directories repeat, so this keeps the journal small.
+    class JournalWriter
+        OPERATION_TYPES = [nil, "delete", "create", "move", "delta", "directory"]
+        KEYS = [nil, :path, :to_path, :digest, :mtime, :length, :symlink_target, :symlink,
+            :delta_mode, :deleted_dirs, :created_dirs, :target_digest]
+        CUSTOM_KEY = 0xff
+        NEW_DIR = 0xffffffff
+        PATH_KEYS = [:path, :to_path, :deleted_dirs, :created_dirs]
+
+        # Starts a journal on the given output stream by writing the header.
+        def initialize(out)
+            @out = out
+            @dirs = {}
+            @out.write JournalReader::MAGIC
+        end
+
+
+        # Writes one operation record.  Raises an error for types or values that
+        # the format can't hold rather than writing something unreadable.
+        def write_operation(type, info)
+            code = OPERATION_TYPES.index(type)
+            raise "Operation type #{type} can't be written to a binary journal." if not code
+
+            body = [code, info.length].pack("CC")
+            info.each do |key, value|
+                key_code = KEYS.index(key)
+                if key_code
+                    body << [key_code].pack("C")
+                else
+                    body << [CUSTOM_KEY].pack("C") << encode_string(key.to_s)
+                end
+
+                body << encode(value, PATH_KEYS.include?(key), (key == :digest or key == :target_digest))
+            end
+
+            @out.write [body.length].pack("V")
+            @out.write body
+        end
+
+
+        # Closes the output stream.
+        def close
+            @out.close
+        end
+
+
+        private
+
+        def encode_string(str)
+            [str.length].pack("V") + str
+        end
+
+        def encode(value, path=false, digest=false, depth=0)
+            if value.kind_of? String
+                if digest and value =~ /\A[0-9a-f]{32}\z/
+                    "h" + [value].pack("H*")
+                elsif path and value.index("/")
+                    encode_path(value)
+                else
+                    "s" + encode_string(value)
+                end
+            elsif value.kind_of? Integer
+                raise "Integer #{value} can't be written to a binary journal." if value < 0 or value >= 2**64
+                "i" + [value & 0xffffffff, value >> 32].pack("VV")
+            elsif value.kind_of? Time
+                seconds = value.to_i
+                raise "Time #{value} can't be written to a binary journal." if seconds < -2**63 or seconds >= 2**63
+                "t" + [seconds & 0xffffffff, (seconds >> 32) & 0xffffffff, value.usec].pack("VVV")
+            elsif value == true
+                "T"
+            elsif value == false
+                "F"
+            elsif value == nil
+                "N"
+            elsif value.kind_of? Array
+                raise "Arrays nested more than #{JournalReader::MAX_DEPTH} deep can't be written to a binary journal." if depth >= JournalReader::MAX_DEPTH
+                value.inject("a" + [value.length].pack("V")) { |out, v| out << encode(v, path, digest, depth + 1) }
+            else
+                raise "A #{value.class} can't be written to a binary journal."
+            end
+        end
+
+        def encode_path(path)
+            split = path.rindex("/")
+            dir, base = path[0 ... split], path[split + 1 .. -1]
+
+            if @dirs.has_key? dir
+                out = "p" + [@dirs[dir]].pack("V")
+            else
+                @dirs[dir] = @dirs.length
+                out = "p" + [NEW_DIR].pack("V") + encode_string(dir)
+            end
+
+            out << encode_string(base)
+        end
+    end
+
+
+    # Reads every operation in the journal stream (binary or the old YAML) and
+    # yields each [type, info] record.  The whole journal is read in first, which
+    # is fine since the data file holds everything big.
+    def ChangeSet.each_operation(journal_in)
+        data = journal_in.read
+        magic = JournalReader::MAGIC
+
+        if data[0, magic.length] == magic
+            JournalReader.parse(data).each { |record| yield record }
+        else
+            YAML.each_document(data) { |record| yield record }
+        end
+    end
+
+
+    # Writes the journal out as YAML documents, the same as the journals used to be.
+    def ChangeSet.export_journal(journal_in, out)
+        ChangeSet.each_operation(journal_in) do |record|
+            YAML.dump(record, out)
+            out.write("\n")
+        end
+    end
+end
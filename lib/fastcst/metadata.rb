@@ -1,11 +1,23 @@
 require 'guid'
 require 'yaml'
+require 'zlib'
 require 'fastcst/changeset'
 
 
 module MetaData
 
     META_DATA_FILE = "meta-data.yaml"
+    META_DATA_CACHE = "meta-data.cache"
+    CACHE_MAGIC = "FCSTMDC2"
+    CHECKSUMS = ["md5", "crc32"]
+    DIGEST_BUFFER = 64 * 1024
+    # files smaller than this are hashed one after the other, it's not worth a fork
+    PARALLEL_DIGEST_SIZE = 4 * 1024 * 1024
+    # at most this many children hash at the same time
+    DIGEST_WORKERS = ChangeSet::ParallelApply::DEFAULT_WORKERS
+    
+    # full path => [[mtime, nsec, size, inode], Marshal dump] for everything load_metadata has read
+    @loaded = {}
     
     
     # A wrapper function that loads the given YAML file, passes the
@@ -15,23 +27,111 @@ module MetaData
         md = YAML.load_file(file_name)
         yield md
         File.open(file_name, "w") { |out| YAML.dump(md, out) }
+        MetaData.forget(file_name)
     end
     
     # Adds a mentioned file to the meta-data along with its
     # digest.  You would do this for all of the files EXCEPT
     # the .fcs data and .yaml journal files.  MetaData.finish_metadata
-    # does that.
-    def MetaData.add_file(md_file, name, purpose)
-        digest = Digest::MD5.hexdigest(File.read(name))
+    # does that.  The checksum is one of CHECKSUMS, anything but md5
+    # is recorded as the "Checksum" of the entry.
+    def MetaData.add_file(md_file, name, purpose, checksum="md5")
+        digest = MetaData.file_digest(name, checksum)
         
         MetaData.update_md(md_file) do |md|
             md["Contents"] ||= []
-            md["Contents"] << { "Name" => name, "Digest" => digest, "Purpose" => purpose }
+            info = { "Name" => name, "Digest" => digest, "Purpose" => purpose }
+            info["Checksum"] = checksum if checksum != "md5"
+            md["Contents"] << info
         end
         
     end
     
     
+    # Hashes the file DIGEST_BUFFER bytes at a time so big data files are never
+    # read in whole.  The checksum is md5 (the default, and what older changesets
+    # all have) or crc32, which zlib computes several times faster but only catches
+    # damage and not someone deliberately changing the file.  That's why
+    # verify_digests only accepts crc32 for changesets made in the same repository.
+    def MetaData.file_digest(path, checksum="md5")
+        File.open(path, "rb") do |input|
+            case checksum
+            when "md5"
+                md5 = Digest::MD5.new
+                while chunk = input.read(DIGEST_BUFFER)
+                    md5 << chunk
+                end
+                return md5.hexdigest
+            when "crc32"
+                crc = 0
+                while chunk = input.read(DIGEST_BUFFER)
+                    crc = Zlib.crc32(chunk, crc)
+                end
+                return "%08x" % crc
+            else
+                raise "Unknown checksum #{checksum}, use #{CHECKSUMS.join(' or ')}."
+            end
+        end
+    end
+    
+    
+    # Returns the digests of the files, given as [path, checksum] pairs, in the
+    # same order.  When there's more than one big file they're dealt out to a pool
+    # of DIGEST_WORKERS forked children (like ChangeSet::ParallelApply) so verifying runs
+    # at the speed of the disk instead of one hash after another.  Each child writes
+    # back its digests one per line.  Without fork they're just done here.
+    def MetaData.file_digests(files, workers=DIGEST_WORKERS)
+        big = []
+        files.each_with_index do |file, i|
+            big << i if (File.size(file[0]) >= PARALLEL_DIGEST_SIZE rescue false)
+        end
+        return files.collect { |path, checksum| MetaData.file_digest(path, checksum) } if big.length < 2 or workers < 2
+        
+        children = []
+        workers.times do |n|
+            mine = []
+            n.step(big.length - 1, workers) { |i| mine << big[i] }
+            next if mine.empty?
+            
+            reader, writer = IO.pipe
+            begin
+                pid = fork do
+                    reader.close
+                    begin
+                        writer.write mine.collect { |i| MetaData.file_digest(*files[i]) }.join("\n")
+                        writer.close
+                        # skip at_exit handlers, they belong to the parent
+                        exit!(0)
+                    rescue Exception
+                        exit!(1)
+                    end
+                end
+            rescue NotImplementedError
+                reader.close
+                writer.close
+                break
+            end
+            
+            writer.close
+            children << [pid, reader, mine]
+        end
+        
+        digests = {}
+        children.each do |pid, reader, mine|
+            result = reader.read
+            reader.close
+            Process.waitpid(pid)
+            next if not $?.success?
+            result.split("\n").each_with_index { |digest, j| digests[mine[j]] = digest }
+        end
+        
+        # anything small, left over, or whose child died is done here
+        results = []
+        files.each_with_index { |file, i| results << (digests[i] || MetaData.file_digest(*file)) }
+        return results
+    end
+    
+    
     # Creates an initial meta-data file from the given information.
     def MetaData.create_metadata(md_file, project, revision, purpose, dev_name, dev_email)
         md = {
@@ -50,14 +150,16 @@ module MetaData
         UI.event :info, "Writing meta-data file to #{md_file}"
         UI.event :info, "ID: #{md['ID']}"
         File.open(md_file, "w") { |out| YAML.dump(md, out) }
+        MetaData.forget(md_file)
 
         return md
     end
     
     
     # This finishes off a meta-data file by adding the .fcs data file and
-    # .yaml journal file and setting a few other required elements.
-    def MetaData.finish_metadata(md_file, parent_id, fcs_file, journal)
+    # .yaml journal file and setting a few other required elements.  The
+    # Codec the data file was compressed with is recorded too.
+    def MetaData.finish_metadata(md_file, parent_id, fcs_file, journal, checksum="md5")
         MetaData.update_md(md_file) do |md|
             md["Contents"] ||= []
             md["Parent ID"] = parent_id
@@ -65,16 +167,18 @@ module MetaData
         
         
         UI.start_finish("Adding data and journal files #{fcs_file}, #{journal}") do
-            MetaData.add_file(md_file, fcs_file, "data")
-            MetaData.add_file(md_file, journal, "journal")
+            MetaData.add_file(md_file, fcs_file, "data", checksum)
+            MetaData.add_file(md_file, journal, "journal", checksum)
         end
             
         MetaData.update_md(md_file) do |md|
             UI.start_finish("Calculating summary statistics for #{journal}") do
-                open(journal) do |journal_in|
-                    md["Summary"] = ChangeSet.statistics(Zlib::GzipReader.new(journal_in))
-                end
+                md["Summary"] = ChangeSet.statistics(ChangeSet.open_journal(journal))
             end
+
+            data_in = ChangeSet.open_data(fcs_file)
+            md["Codec"] = data_in.kind_of?(ChangeSet::DataReader) ? data_in.codec.name : "gzip"
+            data_in.close
         end
     end
     
@@ -101,9 +205,87 @@ module MetaData
         end
     end
     
-    # Loads the meta-data from a file.
-    def MetaData.load_metadata(md_file)
-        return YAML.load_file(md_file)
+    # Loads the meta-data from a file.  Each file read is remembered as a Marshal
+    # dump along with its modification time (to the nanosecond where the Time has
+    # them), size, and inode, so loading it again during
+    # the same command skips the YAML parse (and callers still get their own copy
+    # to change).  With sidecar true the dump is also kept next to the file in
+    # META_DATA_CACHE for later commands.  The Repository does that for stored
+    # changesets since their meta-data doesn't change once they're in.
+    def MetaData.load_metadata(md_file, sidecar=false)
+        stat = File.stat(md_file)
+        mtime = stat.mtime
+        key = [mtime.to_i, mtime.respond_to?(:nsec) ? mtime.nsec : mtime.usec * 1000, stat.size, stat.ino]
+        cached = @loaded[File.expand_path(md_file)]
+        
+        if not cached or cached[0] != key
+            dump = sidecar ? MetaData.read_cache(md_file, key) : nil
+            
+            if not dump
+                dump = Marshal.dump(YAML.load_file(md_file))
+                MetaData.write_cache(md_file, key, dump) if sidecar
+            end
+            
+            cached = @loaded[File.expand_path(md_file)] = [key, dump]
+        end
+        
+        return Marshal.load(cached[1])
+    end
+    
+    
+    # Drops anything remembered about the meta-data file, which is needed
+    # whenever it's written.
+    def MetaData.forget(md_file)
+        @loaded.delete File.expand_path(md_file)
+        cache = MetaData.cache_file(md_file)
+        File.unlink cache if File.exist? cache
+    end
+    
+    
+    # Where the sidecar cache for the meta-data file goes, META_DATA_CACHE for
+    # a META_DATA_FILE.
+    def MetaData.cache_file(md_file)
+        md_file.sub(/\.yaml\z/, "") + ".cache"
+    end
+    
+    
+    # The sidecar cache is CACHE_MAGIC V(mtime) V(nsec) V(size) V(inode_lo) V(inode_hi)
+    # and the Marshal dump.  It's only used if all of those still match the meta-data
+    # file, so a rewrite within the same second or a different file renamed over it
+    # isn't mistaken for the one that was cached.
+    def MetaData.read_cache(md_file, key)
+        cache = MetaData.cache_file(md_file)
+        return nil if not File.exist? cache
+        
+        data = File.open(cache, "rb") { |f| f.read }
+        header = MetaData.cache_header(key)
+        if data[0, header.length] == header
+            return data[header.length .. -1]
+        else
+            return nil
+        end
+    end
+    
+    
+    # The start of a sidecar cache for the [mtime, nsec, size, inode] key.
+    def MetaData.cache_header(key)
+        mtime, nsec, size, inode = key
+        CACHE_MAGIC + [mtime, nsec, size, inode & 0xffffffff, inode >> 32].pack("VVVVV")
+    end
+    
+    
+    # Writes the sidecar cache, quietly giving up if the directory can't be
+    # written since the cache is only there to save time.
+    def MetaData.write_cache(md_file, key, dump)
+        cache = MetaData.cache_file(md_file)
+        tmp = cache + ".#$$.tmp"
+        
+        begin
+            File.open(tmp, "wb") { |out| out.write MetaData.cache_header(key) + dump }
+            File.rename(tmp, cache)
+        rescue SystemCallError
+            File.unlink tmp rescue nil
+        end
     end
     
     
@@ -136,19 +318,29 @@ module MetaData
     end
     
     # Verifies that all the files mentioned in the Contents section of the
-    # meta-data have valid md5 digests.  It returns an array of the failures
-    # and prints an error message.  If you get an empty array then all the files
-    # checked out.
-    def MetaData::verify_digests(base_path, md)
+    # meta-data have valid digests (md5 unless the entry has a "Checksum").
+    # It returns an array of the failures and prints an error message.  If you
+    # get an empty array then all the files checked out.
+    #
+    # The "Checksum" comes from whoever made the changeset, so anything but md5
+    # is only accepted when local is true (see Repository#local_changeset?).
+    # Otherwise a sender could pick crc32 and get a changed file past the check.
+    def MetaData::verify_digests(base_path, md, local=false)
         failures = []
+        contents = md['Contents']
+        
+        files = contents.collect { |info| [File.join(base_path, info['Name']), info['Checksum'] || "md5"] }
+        digests = MetaData.file_digests(files)
         
         # verify the digests
-        md['Contents'].each do |info|
-            name, digest, purpose = info['Name'], info['Digest'], info['Purpose']
+        contents.each_with_index do |info, i|
+            name, digest = info['Name'], info['Digest']
             
-            target = File.join(base_path, name)
-            if digest != Digest::MD5.hexdigest(File.read(target))
-                UI.failure :security, "#{name} MD5 digest does not match. Aborting."
+            if files[i][1] != "md5" and not local
+                UI.failure :security, "#{name} only has a #{files[i][1].upcase} checksum, which is only trusted for changesets made here. Aborting."
+                failures << name
+            elsif digest != digests[i]
+                UI.failure :security, "#{name} #{files[i][1].upcase} digest does not match. Aborting."
                 failures << name
             end
         end
@@ -0,0 +1,307 @@
+require 'digest/md5'
+require 'fileutils'
+require 'zlib'
+require 'fastcst/ui'
+
+
+module Repository
+
+    # = Introduction
+    #
+    # A content addressed store of file contents kept in .fastcst/objects.  Every
+    # version of every file the originals have ever had is stored once, compressed,
+    # under its MD5 hex digest (the same digest the journals record), so two files
+    # or two revisions with the same contents only cost one object.
+    #
+    # The objects are all appended to one pack file with an index next to it, the
+    # same way a changeset Pack works, so a store with a hundred thousand objects is
+    # two files instead of a hundred thousand.  The index is read in with one read
+    # and searched in place, so finding an object is a binary search and one seek
+    # into the pack.
+    #
+    # Objects are only ever added, never changed.  New ones go on the end of the
+    # pack right away but only get into the index when flush writes it out again
+    # (StatIndex#save does this before it saves itself), so a crash leaves some
+    # unused bytes at the end of the pack and nothing else.  If the index is lost
+    # or damaged it's made again from the pack.
+    #
+    # More than one ObjectStore (or process) can be adding objects at once, so
+    # appending and writing the index are done holding an flock on objects.lock,
+    # and flush reads the index again inside the lock so it only adds to what the
+    # others flushed.
+    #
+    # Repositories from before the objects were packed have them loose, one file
+    # per object spread over 256 directories:
+    #
+    #   objects/3f/0a1b2c3d4e5f60718293a4b5c6d7e8f9.gz
+    #
+    # These are still read, and pack_loose moves them into the pack.
+    #
+    # = File Format
+    #
+    # The pack is PACK_MAGIC followed by one entry per object:
+    #
+    #   a16(digest) V(length) length bytes of deflated contents
+    #
+    # The index is INDEX_MAGIC V(count) and then count records sorted by digest:
+    #
+    #   a16(digest) V(offset_lo) V(offset_hi) V(length)
+    #
+    # where the offset is where the deflated contents start in the pack.
+    class ObjectStore
+        PACK_MAGIC = "FCSTOPK1"
+        INDEX_MAGIC = "FCSTOIX1"
+        PACK_FILE = "objects.pack"
+        INDEX_FILE = "objects.idx"
+        LOCK_FILE = "objects.lock"
+        DIGEST_SIZE = 16
+        ENTRY_HEADER_SIZE = DIGEST_SIZE + 4
+        RECORD_SIZE = DIGEST_SIZE + 12
+        HEADER_SIZE = INDEX_MAGIC.length + 4
+
+        attr_reader :path, :pack_path, :index_path
+
+        def initialize(path)
+            @path = path
+            @pack_path = File.join(path, PACK_FILE)
+            @index_path = File.join(path, INDEX_FILE)
+            @index = nil
+            @added = {}
+            @loose = nil
+            @locked = false
+        end
+
+
+        # Returns the path of the loose object file for the given hex digest.
+        def object_path(digest)
+            File.join(@path, digest[0,2], digest[2 .. -1] + ".gz")
+        end
+
+
+        # True if the object is already in the store.
+        def has?(digest)
+            find(digest) != nil or (loose? and File.exist? object_path(digest))
+        end
+
+
+        # Stores the data and returns its hex digest.  Data that's already
+        # stored isn't written again.
+        def store(data)
+            digest = Digest::MD5.hexdigest(data)
+            return digest if has? digest
+
+            append([digest].pack("H*"), Zlib::Deflate.deflate(data))
+            return digest
+        end
+
+
+        # Reads the file and stores it, returning the hex digest.
+        def store_file(file)
+            store(File.open(file, "rb") { |f| f.read })
+        end
+
+
+        # Returns the contents of the object or raises an error if it's missing
+        # or damaged.
+        def read(digest)
+            offset, length = find(digest)
+
+            if offset
+                packed = File.open(@pack_path, "rb") do |input|
+                    input.seek(offset)
+                    input.read(length)
+                end
+            else
+                packed = File.open(object_path(digest), "rb") { |f| f.read }
+            end
+
+            data = Zlib::Inflate.inflate(packed.to_s) rescue nil
+            if not data or Digest::MD5.hexdigest(data) != digest
+                raise "Object #{digest} in #@path is damaged."
+            end
+
+            return data
+        end
+
+
+        # Writes the object's contents out to the file (making any directories
+        # needed) and sets its mtime if one is given.
+        def materialize(digest, file, mtime=nil)
+            FileUtils.mkdir_p File.dirname(file)
+            File.open(file, "wb") { |out| out.write read(digest) }
+            File.utime(Time.now, mtime, file) if mtime
+        end
+
+
+        # Writes the index out again with the objects stored since it was read
+        # added to whatever is in the index file now.
+        def flush
+            return if @added.empty?
+
+            locked do
+                load_index
+                records = {}
+                (0 ... count).each do |i|
+                    record = @index[HEADER_SIZE + i * RECORD_SIZE, RECORD_SIZE]
+                    records[record[0, DIGEST_SIZE]] = record
+                end
+
+                @added.each do |raw, location|
+                    offset, length = location
+                    records[raw] ||= [raw, offset & 0xffffffff, offset >> 32, length].pack("a16VVV")
+                end
+
+                write_index(records.values.sort)
+                @added = {}
+            end
+        end
+
+
+        # Moves the loose objects of an older repository into the pack and
+        # returns how many were moved.
+        def pack_loose
+            moved = 0
+
+            Dir.glob(File.join(@path, "??", "*.gz")).each do |file|
+                digest = File.basename(File.dirname(file)) + File.basename(file, ".gz")
+                if not find(digest)
+                    append([digest].pack("H*"), File.open(file, "rb") { |f| f.read })
+                    moved += 1
+                end
+            end
+
+            flush
+            Dir.glob(File.join(@path, "??")).each { |dir| FileUtils.rm_rf dir }
+            @loose = false
+
+            return moved
+        end
+
+
+        private
+
+        # The number of objects in the index file.
+        def count
+            load_index if not @index
+            (@index.length - HEADER_SIZE) / RECORD_SIZE
+        end
+
+
+        # Returns [offset, length] of the object in the pack, or nil if it isn't packed.
+        def find(digest)
+            raw = [digest].pack("H*")
+            return @added[raw] if @added[raw]
+
+            low, high = 0, count - 1
+            while low <= high
+                mid = (low + high) / 2
+                record = HEADER_SIZE + mid * RECORD_SIZE
+                id = @index[record, DIGEST_SIZE]
+
+                if id == raw
+                    lo, hi, length = @index[record + DIGEST_SIZE, 12].unpack("VVV")
+                    return [(hi << 32) | lo, length]
+                elsif id < raw
+                    low = mid + 1
+                else
+                    high = mid - 1
+                end
+            end
+
+            return nil
+        end
+
+
+        # True if there are any loose object directories.
+        def loose?
+            @loose = Dir.glob(File.join(@path, "??")).length > 0 if @loose == nil
+            @loose
+        end
+
+
+        # Runs the block holding the lock on objects.lock.  An flock isn't shared
+        # between two opens of the file, so a nested call just runs the block.
+        def locked
+            return yield if @locked
+
+            FileUtils.mkdir_p @path
+            File.open(File.join(@path, LOCK_FILE), File::RDWR | File::CREAT, 0644) do |lock|
+                lock.flock(File::LOCK_EX)
+                begin
+                    @locked = true
+                    return yield
+                ensure
+                    @locked = false
+                end
+            end
+        end
+
+
+        # Puts a deflated object on the end of the pack.  The size is taken inside
+        # the lock so no one else's object gets in between.
+        def append(raw, packed)
+            locked do
+                offset = File.exist?(@pack_path) ? File.size(@pack_path) : 0
+
+                File.open(@pack_path, "ab") do |out|
+                    if offset == 0
+                        out.write PACK_MAGIC
+                        offset = PACK_MAGIC.length
+                    end
+                    out.write [raw, packed.length].pack("a16V")
+                    out.write packed
+                end
+
+                @added[raw] = [offset + ENTRY_HEADER_SIZE, packed.length]
+            end
+        end
+
+
+        def write_index(records)
+            tmp = @index_path + ".#$$.tmp"
+            @index = INDEX_MAGIC + [records.length].pack("V") + records.join
+            File.open(tmp, "wb") { |out| out.write @index }
+            File.rename(tmp, @index_path)
+        end
+
+
+        # Reads the index, making it again from the pack if it's missing or damaged.
+        def load_index
+            @index = File.exist?(@index_path) ? File.open(@index_path, "rb") { |f| f.read } : ""
+
+            if @index[0, INDEX_MAGIC.length] == INDEX_MAGIC and
+                    @index.length == HEADER_SIZE + @index[INDEX_MAGIC.length, 4].unpack("V")[0] * RECORD_SIZE
+                return
+            end
+
+            @index = INDEX_MAGIC + [0].pack("V")
+            return if not File.exist? @pack_path
+
+            locked { rebuild_index }
+        end
+
+
+        # Makes the index again by reading through the pack.
+        def rebuild_index
+            UI.failure :index, "Object index #@index_path is damaged, it will be rebuilt" if File.exist? @index_path
+            records = []
+            File.open(@pack_path, "rb") do |input|
+                size = File.size(@pack_path)
+                pos = PACK_MAGIC.length
+                input.seek(pos)
+
+                # anything cut off at the end was never indexed, so it's left out
+                while pos + ENTRY_HEADER_SIZE <= size
+                    raw, length = input.read(ENTRY_HEADER_SIZE).unpack("a16V")
+                    break if pos + ENTRY_HEADER_SIZE + length > size
+                    pos += ENTRY_HEADER_SIZE
+                    records << [raw, pos & 0xffffffff, pos >> 32, length].pack("a16VVV")
+                    pos += length
+                    input.seek(pos)
+                end
+            end
+
+            write_index(records.sort)
+        end
+    end
+end
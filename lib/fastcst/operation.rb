@@ -1,4 +1,7 @@
 require 'fastcst/ui'
+require 'digest/md5'
+require 'fastcst/journal'
+require 'fastcst/data_file'
 
 
 module ChangeSet
@@ -34,7 +37,10 @@ module ChangeSet
     # Ruby specific stuff which chokes other languages.  This format should be language
     # agnostic.
     class Operation
-        attr_reader :info
+        attr_reader :info, :bytes_read
+        
+        # How much of a file is read at a time when it's streamed.
+        CHUNK_SIZE = 64 * 1024
         
         # Initializes the base with information needed to load it later.
         # The dir parameter should not be stored in the info by the
@@ -48,17 +54,27 @@ module ChangeSet
         def initialize(info, dir)
             @dir = dir
             @info = info
+            @bytes_read = 0
         end
 
         
         # Stores the operation to the journal output stream so that it can
         # be recovered later using Operation.load.  The data is written
         # as an array of [ class_name, @info ] so that Operation.load 
-        # will know what operation to create.
+        # will know what operation to create.  If the journal_out is a
+        # JournalWriter then it's a binary record, otherwise it's YAML.
+        # Subclasses write their payload before calling this, so it also
+        # ends the payload's entry when data_out is a DataWriter.
         def store(journal_out, data_out)
-            op_data = [ self.class::TYPE, @info ]
-            YAML.dump(op_data, journal_out)
-            journal_out.write("\n")
+            data_out.end_entry(@info[:path]) if data_out.kind_of? DataWriter
+            
+            if journal_out.kind_of? JournalWriter
+                journal_out.write_operation(self.class::TYPE, @info)
+            else
+                op_data = [ self.class::TYPE, @info ]
+                YAML.dump(op_data, journal_out)
+                journal_out.write("\n")
+            end
         end
 
         
@@ -224,7 +240,8 @@ module ChangeSet
         # Stores the file data to the data_out, and then lets the Operation.store
         # do the rest.  It fills in additional information for the @info such
         # as mtime, whether the file is a symlink (:symlink_target), and the length
-        # of the file.
+        # of the file.  The file is copied in chunks and the :digest is taken
+        # along the way if it wasn't given.
         def store(journal_out, data_out)
             path = @info[:path]
             
@@ -233,11 +250,19 @@ module ChangeSet
                 
                 if not File.symlink?(path)
                     # regular file so go to town and write the data_out
-                    data = File.read info[:path]
-                    @info[:length] = data.length
-                    data_out.write data
+                    md5 = Digest::MD5.new
+                    File.open(path, "rb") do |f|
+                        while chunk = f.read(CHUNK_SIZE)
+                            md5 << chunk
+                            data_out.write chunk
+                            @bytes_read += chunk.length
+                        end
+                    end
+                    @info[:length] = @bytes_read
+                    @info[:digest] ||= md5.hexdigest
                 else
                     @info[:symlink_target] = File.readlink(path)
+                    @info[:digest] ||= Digest::MD5.hexdigest(File.read(path))
                 end
             end
 
@@ -248,7 +273,8 @@ module ChangeSet
         # Creates the file in the target directory, reading the data out of the
         # data_in stream.  After the file is created this function will set the
         # mtime so it matches the original.  This will overwrite the file  it
-        # it already exists, so it isn't safe yet.
+        # it already exists, so it isn't safe yet.  The file is written to a
+        # temporary name and renamed so it's never seen half written.
         def run(data_in)
             path = @info[:path]
             symlink_target = @info[:symlink_target]
@@ -261,7 +287,9 @@ module ChangeSet
                         File.symlink(symlink_target, path)
                     else
                         data = data_in.read(@info[:length])
-                        File.open(path, "wb") {|out| out.write data }
+                        tmp = "#{path}.#$$.tmp"
+                        File.open(tmp, "wb") {|out| out.write data }
+                        File.rename(tmp, path)
                     end
                     
                     File.utime(Time.now, @info[:mtime], path)
@@ -425,9 +453,24 @@ module ChangeSet
     #
     # * :path -- The file path relative to :source and @dir
     # * :source -- The source directory to use for analysis,  @dir is considered target.
+    #
+    # The :digest of the source file and the :target_digest are taken from what's read
+    # if they weren't given.  A target that was already read (see target_data) isn't
+    # read again.
+    #
+    # Text files bigger than TOKEN_DELTA_SIZE are done with a line based delta
+    # (SuffixArrayDelta#make_token_delta) which is much faster on big files and 
+    # records :delta_mode => "lines" so that people reading the journal know.
     class DeltaOperation < Operation
     
         TYPE = "delta"
+        TOKEN_DELTA_SIZE = 256 * 1024
+        
+        # the base line ranges both sides changed when merge_with_base fails
+        attr_reader :conflicts
+        
+        # the target's contents when they were already read, so store doesn't read them again
+        attr_accessor :target_data
         
         def store(journal_out, data_out)
             path, source, target = @info[:path], @info[:source], @dir
@@ -436,6 +479,7 @@ module ChangeSet
             if File.symlink? path
                 # we just ignore symlinks since the real change happens in the target file
                 info[:symlink] = true
+                @info[:digest] ||= Digest::MD5.hexdigest(File.read(File.join(source, path)))
                 UI.event :warn, "Deltas against symlinks are ignored since they are pointless"
             else
                 # setup the remaining journal info
@@ -444,13 +488,22 @@ module ChangeSet
 
                 @info[:mtime] = File.mtime(target_path)
 
-                # read the gear and do the delta
-                src_data = File.read(source_path)
-                tgt_data = File.read(target_path)
+                # read the gear and do the delta, the source digest comes from the same read
+                src_data = File.open(source_path, "rb") { |f| f.read }
+                tgt_data = @target_data || File.open(target_path, "rb") { |f| f.read }
+                @bytes_read = src_data.length + (@target_data ? 0 : tgt_data.length)
+                @info[:digest] ||= Digest::MD5.hexdigest(src_data)
+                # what the file is after the delta, so the originals can be checked against it
+                @info[:target_digest] ||= Digest::MD5.hexdigest(tgt_data)
 
                 # write the delta to a string io temporarily
                 io_out = StringIO.new
-                results = SuffixArrayDelta::make_delta(src_data, tgt_data, io_out)
+                if src_data.length > TOKEN_DELTA_SIZE and SuffixArrayDelta::text?(src_data) and SuffixArrayDelta::text?(tgt_data)
+                    @info[:delta_mode] = "lines"
+                    results = SuffixArrayDelta::make_token_delta(src_data, tgt_data, io_out)
+                else
+                    results = SuffixArrayDelta::make_delta(src_data, tgt_data, io_out)
+                end
             
                 # don't bother if there's no changes
                 if no_changes?(results, src_data.length, tgt_data.length)
@@ -473,12 +526,25 @@ module ChangeSet
         
         # Run reads in the delta, changes to the dir, and then applies the delta
         # in order to create the changed file.  It will skip a file if it's missing.
+        # The new file is written to a temporary name and renamed over the old one.
         def run(data_in)
             path, mtime, length, digest = @info[:path], @info[:mtime], @info[:length], @info[:digest]
             
             # don't bother running if this is a symlink
             if @info[:symlink]
                 UI.event :warn, "Skipped delta of symlink #{path}"
+            elsif @merged
+                # merge_with_base already made the file, so the delta just gets skipped
+                begin
+                    skip(data_in)
+                    tmp = File.join(@dir, "#{path}.#$$.tmp")
+                    File.open(tmp, "wb") { |out| out.write @merged }
+                    File.rename(tmp, File.join(@dir, path))
+                    File.utime(Time.new, mtime, File.join(@dir, path))
+                rescue
+                    UI.failure :delta, "#$!"
+                    return false
+                end
             else
                 outfile = nil
                 
@@ -495,14 +561,19 @@ module ChangeSet
                             reference = File.read path
                             if digest != Digest::MD5.hexdigest(reference)
                                 UI.failure :constraint, "The reference file digests don't match.  Can't apply this delta."
+                                skip(data_in)
+                                return false
                             else
                                 # digest matches, we can continue
                                 delta = StringIO.new(data_in.read(length))
-                                outfile = File.open(path, "wb")
+                                tmp = "#{path}.#$$.tmp"
+                                outfile = File.open(tmp, "wb")
                                 
                                 SuffixArrayDelta::apply_delta(reference, delta, outfile)
                                 
+                                # rename over the old one so it's never half written
                                 outfile.close
+                                File.rename(tmp, path)
                             end
                         end
                 
@@ -571,6 +642,31 @@ module ChangeSet
         end
         
     
+        # Three-way merges the delta into a file that changed since the delta was
+        # made.  The base is the file the delta was made against (the one with
+        # the :digest) and delta is this operation's data.  Applying the delta to
+        # the base gives their version, and SuffixArrayDelta::ThreeWayMerge puts it
+        # together with the current file.  If the changes don't overlap the merged
+        # file is kept for run and it returns 1, otherwise it returns -1 and
+        # conflicts has the base line ranges (from 1) that both sides changed.
+        # Binary files are always a conflict.
+        def merge_with_base(base, delta)
+            current = File.open(File.join(@dir, @info[:path]), "rb") { |f| f.read }
+            theirs = StringIO.new
+            SuffixArrayDelta::apply_delta(base, StringIO.new(delta), theirs)
+            
+            @conflicts = []
+            if not [base, current, theirs.string].all? { |data| SuffixArrayDelta::text?(data) }
+                return -1
+            end
+            
+            merger = SuffixArrayDelta::ThreeWayMerge.new(base)
+            @merged = merger.merge(current, theirs.string)
+            @conflicts = merger.conflicts.collect { |first, last| [first + 1, last] }
+            return @merged ? 1 : -1
+        end
+        
+        
         # Skips ahead in the data stream by the @length
         def skip(data_in)
             data_in.seek(@info[:length], IO::SEEK_CUR)
@@ -0,0 +1,233 @@
+require 'fileutils'
+
+
+module Repository
+
+    # = Introduction
+    #
+    # A pack holds the files of many changesets (the meta-data, journal, and data
+    # file) in one append-only file, so a repository with thousands of changesets
+    # doesn't need a directory and three files for each one.  fcst pack moves the
+    # loose changesets in the root directory into a new pack, and the Repository
+    # looks in the packs for anything that isn't loose.
+    #
+    # Each pack has an index next to it (the .pack becomes .idx) with one fixed
+    # size record per changeset sorted by UUID.  The index is read in with one read
+    # and searched in place, so finding a changeset is a binary search and one seek
+    # into the pack no matter how many changesets there are.
+    #
+    # Packs are never changed after they're written.  Deleting a changeset only
+    # takes it out of the index, the space comes back when fcst pack -a writes
+    # everything into one new pack.
+    #
+    # = File Format
+    #
+    # The pack is PACK_MAGIC followed by one entry per changeset:
+    #
+    #   V(file_count) file_count * [ V(name_length) name V(length_lo) V(length_hi) ]
+    #   the contents of each file, one after the other
+    #
+    # The index is INDEX_MAGIC V(count) and then count records of:
+    #
+    #   a36(uuid) V(offset_lo) V(offset_hi)
+    #
+    # where the offset is where the changeset's entry starts in the pack.
+    class Pack
+        PACK_MAGIC = "FCSTPAK1"
+        INDEX_MAGIC = "FCSTPIX1"
+        ID_SIZE = 36
+        RECORD_SIZE = ID_SIZE + 8
+        HEADER_SIZE = INDEX_MAGIC.length + 4
+        COPY_SIZE = 64 * 1024
+
+        attr_reader :path, :index_path
+
+        # Opens the pack at path and reads its index.
+        def initialize(path)
+            @path = path
+            @index_path = Pack.index_path(path)
+            load_index
+        end
+
+
+        def Pack.index_path(path)
+            path.sub(/\.pack\z/, "") + ".idx"
+        end
+
+
+        # Writes a new pack at path from the changesets, which is an Array of
+        # [uuid, files] where files is a list of [name, full_path].  The file
+        # contents are copied over in pieces so big data files aren't read in whole.
+        def Pack.write(path, changesets)
+            offsets = {}
+            tmp = path + ".#$$.tmp"
+
+            File.open(tmp, "wb") do |out|
+                out.write PACK_MAGIC
+                pos = PACK_MAGIC.length
+
+                changesets.each do |uuid, files|
+                    raise "Changeset ID #{uuid} can't be packed." if uuid.length != ID_SIZE
+                    offsets[uuid] = pos
+
+                    header = [files.length].pack("V")
+                    files.each do |name, full_path|
+                        size = File.size(full_path)
+                        header << [name.length].pack("V") << name << [size & 0xffffffff, size >> 32].pack("VV")
+                    end
+                    out.write header
+                    pos += header.length
+
+                    files.each do |name, full_path|
+                        File.open(full_path, "rb") do |input|
+                            while data = input.read(COPY_SIZE)
+                                out.write data
+                                pos += data.length
+                            end
+                        end
+                    end
+                end
+            end
+
+            Pack.write_index(Pack.index_path(path), offsets)
+            File.rename(tmp, path)
+        end
+
+
+        # Writes the index for the uuid => offset Hash, sorted by uuid.
+        def Pack.write_index(index_path, offsets)
+            tmp = index_path + ".#$$.tmp"
+
+            File.open(tmp, "wb") do |out|
+                out.write INDEX_MAGIC + [offsets.length].pack("V")
+                offsets.keys.sort.each do |uuid|
+                    offset = offsets[uuid]
+                    out.write [uuid, offset & 0xffffffff, offset >> 32].pack("a36VV")
+                end
+            end
+
+            File.rename(tmp, index_path)
+        end
+
+
+        # All the changeset UUIDs in this pack.
+        def ids
+            (0 ... @count).collect { |i| @index[HEADER_SIZE + i * RECORD_SIZE, ID_SIZE] }
+        end
+
+
+        # True if the changeset is in this pack.
+        def include?(uuid)
+            offset(uuid) != nil
+        end
+
+
+        # Returns where the changeset's entry starts in the pack or nil if it isn't
+        # in this pack.
+        def offset(uuid)
+            low, high = 0, @count - 1
+
+            while low <= high
+                mid = (low + high) / 2
+                record = HEADER_SIZE + mid * RECORD_SIZE
+                id = @index[record, ID_SIZE]
+
+                if id == uuid
+                    lo, hi = @index[record + ID_SIZE, 8].unpack("VV")
+                    return (hi << 32) | lo
+                elsif id < uuid
+                    low = mid + 1
+                else
+                    high = mid - 1
+                end
+            end
+
+            return nil
+        end
+
+
+        # Returns the [name, length, offset] of each file in the changeset, where
+        # the offset is where the contents start in the pack.
+        def files(uuid)
+            start = offset(uuid)
+            return [] if not start
+
+            File.open(@path, "rb") do |input|
+                input.seek(start)
+                count = input.read(4).unpack("V")[0]
+
+                files = []
+                pos = start + 4
+                count.times do
+                    name_length = input.read(4).unpack("V")[0]
+                    name = input.read(name_length)
+                    lo, hi = input.read(8).unpack("VV")
+                    files << [name, (hi << 32) | lo]
+                    pos += 4 + name_length + 8
+                end
+
+                files.each do |info|
+                    info << pos
+                    pos += info[1]
+                end
+
+                return files
+            end
+        end
+
+
+        # Reads one file of the changeset, or nil if it doesn't have that file.
+        def read(uuid, name)
+            file = files(uuid).find { |info| info[0] == name }
+            return nil if not file
+
+            File.open(@path, "rb") do |input|
+                input.seek(file[2])
+                return input.read(file[1])
+            end
+        end
+
+
+        # Writes every file of the changeset into dir.
+        def extract(uuid, dir)
+            FileUtils.mkdir_p dir
+
+            File.open(@path, "rb") do |input|
+                files(uuid).each do |name, length, offset|
+                    input.seek(offset)
+                    File.open(File.join(dir, name), "wb") do |out|
+                        while length > 0
+                            data = input.read([length, COPY_SIZE].min)
+                            raise "Pack #@path is truncated." if not data
+                            out.write data
+                            length -= data.length
+                        end
+                    end
+                end
+            end
+        end
+
+
+        # Takes the changeset out of the index.  Its data stays in the pack until
+        # the next fcst pack -a.
+        def remove(uuid)
+            offsets = {}
+            ids.each { |id| offsets[id] = offset(id) if id != uuid }
+            Pack.write_index(@index_path, offsets)
+            load_index
+        end
+
+
+        private
+
+        def load_index
+            @index = File.open(@index_path, "rb") { |f| f.read }
+
+            if @index[0, INDEX_MAGIC.length] != INDEX_MAGIC
+                raise "Pack index #@index_path is damaged."
+            end
+
+            @count = @index[INDEX_MAGIC.length, 4].unpack("V")[0]
+        end
+    end
+end
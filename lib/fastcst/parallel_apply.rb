@@ -0,0 +1,177 @@
+require 'set'
+require 'stringio'
+require 'fastcst/ui'
+require 'fastcst/data_file'
+
+
+module ChangeSet
+
+    # = Introduction
+    #
+    # Applies a changeset with a pool of worker processes.  Most operations in a
+    # changeset touch different files and don't care what order they run in, so
+    # they're split into batches of independent operations and each batch is
+    # spread over the workers.  Batches run one after the other.
+    #
+    # The workers are forked processes and not threads since the operations
+    # Dir.chdir into the target and Ruby's threads wouldn't overlap the I/O
+    # anyway.  Each worker opens its own DataReader and reads the payloads it
+    # needs straight from the table of contents, so this only works with the new
+    # data files.  ChangeSet.apply_changeset decides when to use it.
+    #
+    # = Ordering
+    #
+    # Operations go into the current batch in journal order until one touches a
+    # path that's already in the batch, or a directory above or below one, which
+    # starts a new batch.  A move counts both of its paths.  A DirectoryOperation
+    # always runs by itself after everything before it, since it removes the
+    # directories that the earlier operations emptied.
+    #
+    # Payloads are looked up by the operation's :path in the data file's table of
+    # contents, which is what Operation#store gives DataWriter#end_entry.
+    class ParallelApply
+        DEFAULT_WORKERS = 4
+        # batches smaller than this aren't worth forking for
+        MIN_FORK_BATCH = 8
+
+        def initialize(workers=DEFAULT_WORKERS)
+            @workers = workers
+        end
+
+
+        # Applies the operations from the journal_in to the target_dir using the
+        # data_in DataReader and returns the number that failed.  The only PathSpec
+        # works the same as for ChangeSet.apply_changeset.
+        def apply(journal_in, data_in, target_dir, only=nil)
+            failures = 0
+
+            batches(journal_in, only).each do |batch|
+                if batch.length < MIN_FORK_BATCH or @workers < 2
+                    failures += run_ops(batch, data_in, target_dir)
+                else
+                    failures += run_parallel(batch, data_in, target_dir)
+                end
+            end
+
+            return failures
+        end
+
+
+        # Splits the journal records into batches of operations that can run at the
+        # same time (see Ordering above).
+        def batches(journal_in, only=nil)
+            batches = []
+            batch = []
+            paths = Set.new
+            dirs = Set.new
+
+            ChangeSet.each_operation(journal_in) do |record|
+                record = only.select(record) if only
+                next if not record
+
+                type, info = record
+                if type == DirectoryOperation::TYPE
+                    batches << batch if not batch.empty?
+                    batches << [record]
+                    batch, paths, dirs = [], Set.new, Set.new
+                    next
+                end
+
+                touched = [info[:path], info[:to_path]].compact
+                if touched.find { |p| paths.include?(p) or dirs.include?(p) or ancestors(p).find { |d| paths.include? d } }
+                    batches << batch
+                    batch, paths, dirs = [], Set.new, Set.new
+                end
+
+                batch << record
+                touched.each do |p|
+                    paths << p
+                    ancestors(p).each { |d| dirs << d }
+                end
+            end
+
+            batches << batch if not batch.empty?
+            return batches
+        end
+
+
+        private
+
+        # Runs the operations in this process, each with its own payload.
+        def run_ops(records, data_in, target_dir)
+            failures = 0
+
+            records.each do |record|
+                op = Operation.create(record, target_dir)
+                path = record[1][:path]
+                payload = (path and data_in.read_entry(path)) || ""
+                failures += 1 unless op.run(StringIO.new(payload))
+            end
+
+            return failures
+        end
+
+
+        # Deals the operations out to the workers and adds up their failures, which
+        # each one writes back on a pipe.  Without fork they're all run here.
+        def run_parallel(records, data_in, target_dir)
+            children = []
+            failures = 0
+
+            @workers.times do |n|
+                mine = []
+                n.step(records.length - 1, @workers) { |i| mine << records[i] }
+                next if mine.empty?
+
+                reader, writer = IO.pipe
+                begin
+                    pid = fork do
+                        reader.close
+                        begin
+                            own_data = DataReader.new(data_in.file)
+                            writer.write run_ops(mine, own_data, target_dir).to_s
+                            writer.close
+                            # skip at_exit handlers, they belong to the parent
+                            exit!(0)
+                        rescue Exception
+                            UI.failure :apply, "Apply worker failed: #$!"
+                            exit!(1)
+                        end
+                    end
+                rescue NotImplementedError
+                    reader.close
+                    writer.close
+                    failures += run_ops(mine, data_in, target_dir)
+                    next
+                end
+
+                writer.close
+                children << [pid, reader, mine.length]
+            end
+
+            children.each do |pid, reader, count|
+                result = reader.read
+                reader.close
+                Process.waitpid(pid)
+
+                if $?.success? and result =~ /\A\d+\z/
+                    failures += result.to_i
+                else
+                    UI.failure :apply, "An apply worker died, #{count} operations may not have run"
+                    failures += count
+                end
+            end
+
+            return failures
+        end
+
+
+        def ancestors(path)
+            dirs = []
+            while (path = File.dirname(path)) != "." and path != "/"
+                dirs << path
+            end
+            return dirs
+        end
+    end
+end
@@ -1,6 +1,11 @@
 require 'fileutils'
 require 'yaml'
 require 'fastcst/metadata'
+require 'fastcst/stat_index'
+require 'fastcst/object_store'
+require 'fastcst/dirty_journal'
+require 'fastcst/pack'
+require 'fastcst/revision_index'
 
 
 module Repository
@@ -21,10 +26,17 @@ module Repository
     # 1.  The top directory is called .fastcst and sits at the top of the files being managed.
     # 2.  Under this directory is:
     #     a.  env.yaml -- holds the current state of the fcst program and any configuration info
-    #     c.  originals -- a snapshot of the source tree as it was at the last commit
-    #     d.  work -- This is where fastcst does most of its work while doing stuff.  Should be empty.
-    #     e.  pending -- any changesets which were received via e-mail and haven't been dealt with
-    #     f.  root -- holds all the changesets and their contents
+    #     b.  stat.index and objects -- the StatIndex and ObjectStore that together hold the
+    #         source tree as it was at the last commit (the "originals")
+    #     c.  work -- This is where fastcst does most of its work while doing stuff.  Should be empty.
+    #     d.  pending -- any changesets which were received via e-mail and haven't been dealt with
+    #     e.  root -- holds all the changesets and their contents, each in its own directory
+    #         along with snapshot.index, an optional full snapshot of the originals at that changeset
+    #     f.  dirty.log and watch.pid -- the DirtyJournal written by the fcst watch daemon
+    #     g.  packs -- Pack files made by fcst pack that hold changesets moved out of root
+    #     h.  revisions.index -- the RevisionIndex of every changeset's parent and name
+    #     i.  revisions.stamp -- the generation of the root directory, see revision_stamp
+    #     j.  local.ids -- the IDs of the changesets made in this repository, see local_changeset?
     # 3. Changesets are already uniquely identified by their ID which is a UUID/GUID number.
     # 4. The root directory contains all the changesets in a flat format that's easy to
     #    process, but might be hard to read by humans.
@@ -45,10 +57,10 @@ module Repository
     # keep track of the repository structure in a .yaml file so it could be loaded
     # quickly.  After testing I found that this was entirely unecessary since very large
     # revision trees could be loaded by direct analysis very quickly (less than a second
-    # to load a 1000 node repository).  As long as the revision tree is cached and updated
-    # when store/delete operations are called then everything works really quick.  This
-    # simplifies the design quite a bit and doesn't require any weird maintenance of an
-    # external file.
+    # to load a 1000 node repository).  That stopped being true with tens of thousands
+    # of changesets, so now there is a binary RevisionIndex after all.  It's updated by
+    # store_changeset and delete_changeset and is rebuilt from the meta-data whenever
+    # it doesn't have the generation in revisions.stamp, so it never needs looking after.
     #
     # The downside to this design is that it makes it nearly impossible for a person to
     # go in and see what's in the repository.  I'll hopefully have a set of commands or 
@@ -71,6 +83,13 @@ module Repository
     # external repositories a piece of cake since none of the directories will clash.  It
     # also makes it possible to upload new changesets to a repository without interfering
     # with people currently downloading.
+    #
+    # With lots of changesets all those little directories get slow, so fcst pack moves
+    # them into Pack files in the packs directory.  The Repository looks in the packs
+    # for any changeset that isn't loose in root.  The meta-data of a packed changeset
+    # is read straight out of the pack, and find_changeset writes the rest back out to
+    # its directory in root when a command needs the files (the next fcst pack cleans
+    # it up again).  Undo changesets and snapshots always stay in root.
     # 
     # = The "Human Name" For A Changeset
     #
@@ -87,6 +106,45 @@ module Repository
     # make the name fully unique.  It should be really rare that two revisions have the same
     # name, uuid_chunk, at the same place in the revision tree.
     # 
+    # = The Originals
+    #
+    # To figure out what changed the repository has to know what the tree looked like
+    # at the last revision.  This used to be a full copy of the tree in an originals
+    # directory, but now it is a StatIndex (path, size, mtime, digest) with the contents
+    # in a content addressed ObjectStore.  Each version of a file is only stored once
+    # no matter how many revisions or paths have it, so the repository grows with the
+    # history and not with the size of the tree.
+    #
+    # Nothing ever needs the whole tree.  When a command needs some of the original
+    # files (the source of a delta, a file being deleted) Repository#with_originals
+    # writes out just those files into a scratch directory.  Changesets are applied to
+    # the originals with Repository#apply_to_originals which does the same thing for
+    # the files the changeset touches and then records the results.  When a changeset
+    # was just applied cleanly to the working directory Repository#sync_originals
+    # records the results straight from there instead of applying it a second time.
+    #
+    # An old repository with an originals directory is moved into the store the first
+    # time the StatIndex is asked for.
+    #
+    # = Snapshots
+    #
+    # Each changeset only records the differences from its parent, so rebuilding an
+    # old revision from nothing means applying every changeset from the root down.
+    # To keep that bounded the repository stores a copy of the StatIndex
+    # (snapshot.index) in a changeset's directory whenever it is more than
+    # 'Snapshot Interval' changesets away from the last snapshot
+    # (DEFAULT_SNAPSHOT_INTERVAL if it isn't set, 0 turns them off).  Since the
+    # contents are already in the ObjectStore a snapshot costs next to nothing.
+    # Repository#checkout then starts from the nearest snapshot and only has to
+    # apply at most that many changesets after it.
+    #
+    # = Compression
+    #
+    # Changesets are compressed with the ChangeSet::Codec named by 'Codec' (zlib if it
+    # isn't set, zlib:9 makes smaller changesets to publish).  The undo changesets never
+    # leave the repository so they use 'Local Codec', which is the fast lz codec unless
+    # it's set.  The codec is recorded in the files so readers never need the setting.
+    #
     # = Building A Repository From Scratch
     #
     # I think a good way to understand the repository layout is to describe how someone would
@@ -111,22 +169,37 @@ module Repository
     #
     class Repository
     
-        attr_reader :path, :env_yaml, :work_dir, :root_dir, :originals_dir, :pending_mbox, :plugin_dir
+        attr_reader :path, :env_yaml, :work_dir, :root_dir, :originals_dir, :objects_dir, :pending_mbox, :plugin_dir, :packs_dir
 
         DEFAULT_FASTCST_DIR=".fastcst"
+        SNAPSHOT_INDEX = "snapshot.index"
+        DEFAULT_SNAPSHOT_INTERVAL = 16
+        DEFAULT_LOCAL_CODEC = "lz"
+        STAT_INDEX = "stat.index"
+        REVISION_INDEX = "revisions.index"
+        REVISION_STAMP = "revisions.stamp"
+        DIRTY_JOURNAL = "dirty.log"
+        WATCH_PID = "watch.pid"
+        LOCAL_CHANGESETS = "local.ids"
         
         # Opens the repository that is at the given path which should be the
         # full path to the top of the repository (where the env.yaml file is
-        # located).
+        # located).  The path is expanded so the repository keeps working when
+        # a command changes directory (like into the work directory).
         def initialize(path)
+            path = File.expand_path(path)
             @path = path
             @env_yaml = File.join(path, "env.yaml")
             @root_dir = File.join(path, "root")
             @originals_dir = File.join(path, "originals")
+            @objects_dir = File.join(path, "objects")
             @pending_mbox = File.join(path, "pending")
             @work_dir = File.join(path, "work")
             @plugin_dir = File.join(path, "plugins")
+            @packs_dir = File.join(path, "packs")
             @cached_rev_tree = nil
+            @packs = nil
+            @revision_index = nil
         end
     
     
@@ -172,7 +245,7 @@ module Repository
         # The path given is created if it does not exist.
         # The newly created repository is completely baren and useless.
         # To get it into a reasonable state you'd then need to add some changesets
-        # and fill in the originals dir.
+        # and apply them to the originals.
         def self.create(path, env = {})
             if not File.exist? path
                 Dir.mkdir path
@@ -182,9 +255,9 @@ module Repository
             # create a base env.yaml and index.yaml
             File.open(repo.env_yaml, "w") { |out| YAML.dump(env, out) }
 
-            # create the originals and root directory
+            # create the objects and root directory
             Dir.mkdir repo.root_dir
-            Dir.mkdir repo.originals_dir
+            Dir.mkdir repo.objects_dir
             Dir.mkdir repo.work_dir
             Dir.mkdir repo.plugin_dir
         
@@ -239,9 +312,12 @@ module Repository
         # it will move the files into the root directory in the proper organization
         # and then reset the @cached_rev_tree so it gets recreated.
         # It returns the meta-data so you can analyze it.
-        def store_changeset(path, md_file, move=false)
+        def store_changeset(path, md_file, move=false, local=false)
             md_path = File.join(path, md_file)
             md = MetaData.load_metadata(md_path)
+            # loaded first so it doesn't look out of date once the changeset is in
+            index = revision_index
+            generation = next_revision_stamp
         
             # create a directory in root with the UUID as the name
             md_dir = File.join(@root_dir, md['ID'])
@@ -266,45 +342,212 @@ module Repository
 
             # force rebuilding of the revision tree
             @cached_rev_tree = nil
+            index.add(md)
+            index.stamp(generation)
+            File.open(File.join(@path, LOCAL_CHANGESETS), "a") { |out| out.write "#{md['ID']}\n" } if local
         
             return md
         end
+        
+        
+        # True if the uuid changeset was made in this repository (store_changeset was
+        # told it's local), so MetaData.verify_digests can trust a crc32 checksum on it.
+        def local_changeset?(uuid)
+            file = File.join(@path, LOCAL_CHANGESETS)
+            File.exist?(file) and File.read(file).split("\n").include?(uuid)
+        end
+        
+        
+        # Returns the RevisionIndex, rebuilding it from the meta-data if it's missing,
+        # damaged, or doesn't have the generation in the revision_stamp.  When it's
+        # up to date the changesets aren't listed at all.
+        def revision_index
+            return @revision_index if @revision_index
+            
+            index = RevisionIndex.new(File.join(@path, REVISION_INDEX))
+            generation = revision_stamp
+            
+            if not index.loaded? or generation == 0 or index.generation != generation
+                ids = list_changesets
+                generation = next_revision_stamp if generation == 0
+                index.clear
+                
+                if not ids.empty?
+                    UI.start_finish("Rebuilding the revision index") do
+                        ids.each do |id|
+                            md = metadata(id)
+                            index.add(md, false) if md
+                        end
+                    end
+                end
+                
+                index.stamp(generation, false)
+                index.save
+            end
+            
+            @revision_index = index
+        end
+        
+        
+        # The generation of the root directory from the revisions.stamp file, or 0
+        # if there isn't one.  store_changeset and delete_changeset move it on with
+        # next_revision_stamp before they change anything, and stamp the RevisionIndex
+        # once it's updated, so a change that didn't finish leaves them different.
+        def revision_stamp
+            File.read(File.join(@path, REVISION_STAMP)).to_i rescue 0
+        end
+        
+        
+        # Writes the next generation to the revisions.stamp file and returns it.
+        def next_revision_stamp
+            generation = revision_stamp + 1
+            stamp_file = File.join(@path, REVISION_STAMP)
+            
+            File.open(stamp_file + ".#$$.tmp", "w") { |out| out.write generation }
+            File.rename(stamp_file + ".#$$.tmp", stamp_file)
+            
+            return generation
+        end
     
     
     
-        # Returns the full path to the meta-data file for this UUID.
+        # Returns the full path to the meta-data file for this UUID.  A packed
+        # changeset is written out to its directory first (see find_changeset).
         def find_meta_data(uuid)
             md_file = File.join(@root_dir, uuid, MetaData::META_DATA_FILE)
         
             # grep for the first file with .md, should only be one
             if File.exists? md_file
                 return md_file
+            elsif pack = find_pack(uuid)
+                pack.extract(uuid, File.join(@root_dir, uuid))
+                return md_file
+            else
+                return nil
+            end
+        end
+        
+        
+        # Loads the meta-data for the UUID without writing anything out, or returns
+        # nil if there's no such changeset.  Use this when only the meta-data is needed.
+        def metadata(uuid)
+            md_file = File.join(@root_dir, uuid, MetaData::META_DATA_FILE)
+            
+            if File.exist? md_file
+                return MetaData.load_metadata(md_file, true)
+            elsif pack = find_pack(uuid)
+                return YAML.load(pack.read(uuid, MetaData::META_DATA_FILE))
+            else
+                return nil
+            end
+        end
+        
+        
+        # True if the changeset is in the repository, loose or packed.
+        def has_changeset?(uuid)
+            File.exist?(File.join(@root_dir, uuid, MetaData::META_DATA_FILE)) or find_pack(uuid) != nil
+        end
+        
+        
+        # Reads one of the changeset's files (like its journal) from wherever the
+        # changeset is, or returns nil if it isn't there.
+        def read_changeset_file(uuid, name)
+            return nil if name.index("/") or name == ".." or name == "."
+            
+            file = File.join(@root_dir, uuid, name)
+            if File.file? file
+                return File.open(file, "rb") { |f| f.read }
+            elsif pack = find_pack(uuid)
+                return pack.read(uuid, name)
             else
                 return nil
             end
         end
+        
+        
+        # The Pack files in the packs directory, oldest first.
+        def packs
+            @packs ||= Dir.glob(File.join(@packs_dir, "*.pack")).sort.collect { |file| Pack.new(file) }
+        end
+        
+        
+        # Returns the Pack holding the changeset or nil if it isn't packed.
+        def find_pack(uuid)
+            packs.find { |pack| pack.include? uuid }
+        end
+        
+        
+        # Moves the loose changesets in root into a new Pack and returns how many
+        # were packed.  Only the meta-data and its contents are packed, anything else
+        # (the undo changeset and snapshots) stays in the changeset's directory.  Loose
+        # copies of changesets that are already packed are just removed.  With all
+        # the changesets in the old packs are written into the new one too and the old
+        # packs are removed, which also gets back the space of deleted changesets.
+        def pack_changesets(all=false)
+            loose = Dir.glob(File.join(@root_dir, "*", MetaData::META_DATA_FILE)).collect { |f| File.basename(File.dirname(f)) }
+            old_packs = packs
+            unpack_dir = File.join(@work_dir, "unpacked")
+            to_pack = []
+            
+            begin
+                if all
+                    old_packs.each do |pack|
+                        pack.ids.each do |uuid|
+                            next if loose.include? uuid
+                            pack.extract(uuid, File.join(unpack_dir, uuid))
+                            to_pack << [uuid, File.join(unpack_dir, uuid)]
+                        end
+                    end
+                end
+                
+                loose.each do |uuid|
+                    to_pack << [uuid, File.join(@root_dir, uuid)] if all or not find_pack(uuid)
+                end
+                
+                if not to_pack.empty?
+                    changesets = to_pack.collect do |uuid, dir|
+                        md = MetaData.load_metadata(File.join(dir, MetaData::META_DATA_FILE))
+                        names = [MetaData::META_DATA_FILE] + md['Contents'].collect { |info| info['Name'] }
+                        [uuid, names.collect { |name| [name, File.join(dir, name)] }]
+                    end
+                    
+                    FileUtils.mkdir_p @packs_dir
+                    number = old_packs.collect { |pack| File.basename(pack.path)[/\d+/].to_i }.max || 0
+                    Pack.write(File.join(@packs_dir, "pack-%04d.pack" % (number + 1)), changesets)
+                end
+                
+                # everything loose is in a pack now
+                loose.each do |uuid|
+                    dir = File.join(@root_dir, uuid)
+                    md = MetaData.load_metadata(File.join(dir, MetaData::META_DATA_FILE))
+                    md['Contents'].each { |info| FileUtils.rm_f File.join(dir, info['Name']) }
+                    FileUtils.rm_f [File.join(dir, MetaData::META_DATA_FILE), File.join(dir, MetaData::META_DATA_CACHE)]
+                    Dir.rmdir dir if Dir.entries(dir).length == 2
+                end
+                
+                if all
+                    old_packs.each { |pack| FileUtils.rm_f [pack.path, pack.index_path] }
+                end
+            ensure
+                FileUtils.rm_rf unpack_dir
+                @packs = nil
+            end
+            
+            return to_pack.length
+        end
     
     
         # Builds a list of all changesets which match the given name.
         # It returns an Array of [revision_name, uuid] for each one found.
         def find_revision(rev)
-            list = list_changesets
-            possibles = []
-                
-            # build a list of possible revisions to use
-            list.each do |id|
-                path, md = find_changeset(id)
-                if path
-                    if md['Revision'] == rev
-                        # found a match, add it to the list
-                        possibles << [rev, id]
-                    end
-                else
-                    UI.failure :error, "BAD! An ID listed could not be found: #{id}"
-                end
-            end
-                        
-            return possibles
+            revision_index.find_revision(rev)
+        end
+        
+        
+        # Returns the revision names that start with prefix, sorted.  This is what
+        # fcst list -c gives for completing revision names.
+        def complete_revision(prefix)
+            revision_index.revisions_with_prefix(prefix)
         end
     
 
@@ -330,9 +573,12 @@ module Repository
                     id = possibles[0][1]
                 else
                     UI.failure :search, "Could not find the requested revision #{rev}"
+                    
+                    close = complete_revision(rev)
+                    UI.event :info, "Revisions starting with #{rev}: #{close.join(', ')}" if not close.empty?
                 end
             elsif id
-                if not find_meta_data(id)
+                if not has_changeset?(id)
                     UI.failure :input, "Given id #{id} is not in the repository"
                     id = nil  # unset id since it's bogus
                 end
@@ -346,7 +592,8 @@ module Repository
         # Given a uuid it will return an array of [full_path, meta_data]
         # so that you can load the meta-data and any contained files.
         # The full_path is the directory where the meta_data structure's
-        # contents reside.
+        # contents reside.  A packed changeset is written out there first,
+        # so if only the meta-data is needed use metadata instead.
         def find_changeset(uuid)
             # try to load the meta-data file out of the directory
             full_path = File.join(@root_dir, uuid)
@@ -354,7 +601,7 @@ module Repository
             md_file = find_meta_data(uuid)
         
             if md_file
-                md = MetaData.load_metadata(md_file)
+                md = MetaData.load_metadata(md_file, true)
                 # return the path to the user
                 return full_path, md
             else
@@ -365,22 +612,26 @@ module Repository
     
         # A convenience method that gives the UUID of a changeset's parent.
         def find_parent_of(child_uuid)
-            path, md = find_changeset child_uuid
-            return md['Parent ID']
+            return revision_index.parent(child_uuid)
         end
     
     
         # A convenience method that returns the UUIDs of all children to this
-        # changeset UUID.  It's currently horribly inneficient since it rebuilds
-        # the revision tree by scanning the changeset directory each time it's called.
-        # This is mostly done right now since it is simple and works without needing to
-        # update anything fancy.
-        #
-        # This actually turns out to be reasonably fast.  Initial tests said it can process
-        # 1000 randomly structured changesets in less than a second.
+        # changeset UUID, straight from the RevisionIndex.
         def find_all_children(parent_uuid)
-            root = revision_tree
-            return root[parent_uuid] || []
+            revision_index.children(parent_uuid)
+        end
+        
+        
+        # True if ancestor is uuid or comes before it in the revision tree.
+        def ancestor?(ancestor, uuid)
+            revision_index.ancestor?(ancestor, uuid)
+        end
+        
+        
+        # The closest changeset both a and b come from, or nil if they don't share one.
+        def common_ancestor(a, b)
+            revision_index.common_ancestor(a, b)
         end
 
     
@@ -399,29 +650,29 @@ module Repository
         # name in other parts of the tree, but the rationale is that this won't be necessary since
         # most operations are done relative to the current revision path.
         def build_readable_name(uuid)
-            path, md = find_changeset(uuid)
+            index = revision_index
+            entry = index[uuid]
         
             # abort if not found with a nil
-            return nil if not path
+            return nil if not entry
 
-            rev_name = md['Revision']
+            rev_name = entry.revision
         
-            parent = find_parent_of(uuid)
+            parent = entry.parent
             if parent and parent != "NONE"
-                # it has a parent so check the siblings
-                find_all_children(parent).each do |sibling|
-                    sib_path, sib_md = find_changeset(sibling)
-                    
+                # it has a parent so check the siblings, only the ones with the same
+                # name matter so those come straight from the index
+                index.find_revision(rev_name).each do |name, sibling|
                     # don't process ourself and check for at least one conflict
-                    if sib_path != path and rev_name == sib_md['Revision']
+                    if sibling != uuid and index.parent(sibling) == parent
                         # same revision name, add uuid chunk
-                        uuid_chunk = md['ID'][0,3]
+                        uuid_chunk = uuid[0,3]
                         rev_name += "-#{uuid_chunk}"
                         
                         # and if the uuid chunk STILL matched then
-                        if uuid_chunk == sib_md['ID'][0,3]
+                        if uuid_chunk == sibling[0,3]
                             # yep, a sibling has the same name and stuff
-                            rev_name += "-#{md['Created By']['E-Mail']}"
+                            rev_name += "-#{entry.email}"
                             break  # don't need more, that's enough
                         end
                     end
@@ -432,28 +683,30 @@ module Repository
         end
     
     
+        # A one line summary of the changeset made only from the RevisionIndex:
+        # its readable name, id, author e-mail, and creation date.  This is what
+        # fcst list -l, log -p, and show -s print so they never load any meta-data.
+        def summary_line(uuid)
+            entry = revision_index[uuid]
+            return nil if not entry
+            
+            created = entry.created > 0 ? Time.at(entry.created).strftime("%Y-%m-%d %H:%M:%S") : "unknown"
+            return "#{build_readable_name(uuid)} -- #{uuid} -- #{entry.email} -- #{created}"
+        end
+        
+        
         # Returns the "revision tree hash" which is a simple two-level representation
         # of all the UUIDs that have children and their children as an array.
         # It caches the results of building the revision tree in @cached_rev_tree
-        # and will just return that unless force==true.  Other functions will set
-        # the @cached_rev_tree = nil in order to have this function rebuild the
-        # tree the next time it is requested.
+        # and will just return that unless force==true, which also reloads the
+        # RevisionIndex.  Other functions will set the @cached_rev_tree = nil in order
+        # to have this function rebuild the tree the next time it is requested.
         def revision_tree(force = false)
             # check to see if we need to rebuild the cached revision tree
             if not @cached_rev_tree or force
-                changesets = list_changesets
-                @cached_rev_tree = {}
-        
                 # we only need a simple two level hash based tree structure
-                changesets.each do |uuid|
-                    pid = find_parent_of(uuid)
-                    # every node needs to be entered and given at least an empty list
-                    @cached_rev_tree[uuid] ||= []
-                    if pid and pid != "NONE"
-                        @cached_rev_tree[pid] ||= []
-                        @cached_rev_tree[pid] << uuid
-                    end
-                end
+                @revision_index = nil if force
+                @cached_rev_tree = revision_index.tree
             end
 
             return @cached_rev_tree
@@ -464,10 +717,17 @@ module Repository
         # Returns the same information as find_changeset so the caller
         # can analyze the results.
         def delete_changeset(uuid)
-            full_path, md = find_changeset(uuid)
+            full_path, md = File.join(@root_dir, uuid), metadata(uuid)
+            return nil, nil if not md
+            index = revision_index
+            generation = next_revision_stamp
     
-            # recursively remove the directory
+            # recursively remove the directory and take it out of its pack
             FileUtils.rm_rf(full_path)
+            pack = find_pack(uuid)
+            pack.remove(uuid) if pack
+            index.remove(uuid)
+            index.stamp(generation)
         
             # force rebuilding of the cached_rev_tree the next time it's requested
             @cached_rev_tree = nil
@@ -477,14 +737,382 @@ module Repository
     
     
     
+        # Returns true if the changeset with this uuid has a full snapshot stored with it.
+        def has_snapshot?(uuid)
+            File.exist?(File.join(@root_dir, uuid, SNAPSHOT_INDEX))
+        end
+        
+        
+        # Returns the list of changesets that have to be applied to rebuild the uuid
+        # revision, starting with the nearest ancestor (or uuid itself) that has a snapshot.
+        # If there's no snapshot anywhere up the tree then the first one is the root changeset
+        # and has to be applied to an empty directory.
+        def snapshot_chain(uuid)
+            chain = []
+            
+            while uuid and uuid != "NONE"
+                chain.unshift uuid
+                break if has_snapshot?(uuid)
+                uuid = find_parent_of(uuid)
+            end
+            
+            return chain
+        end
+        
+        
+        # The codec name for changesets that are made to be published.
+        def codec
+            self['Codec'] || ChangeSet::DEFAULT_CODEC
+        end
+        
+        
+        # The codec name for the undo changesets, which only get used locally.
+        def local_codec
+            self['Local Codec'] || DEFAULT_LOCAL_CODEC
+        end
+        
+        
+        # The checksum new changesets record for their files, from 'Checksum' in
+        # the env.yaml (see MetaData.file_digest).
+        def checksum
+            self['Checksum'] || "md5"
+        end
+        
+        
+        # Returns true if the uuid changeset is far enough away from the last snapshot
+        # that it should get one of its own.  The distance comes from 'Snapshot Interval'
+        # in the env.yaml.
+        def snapshot_due?(uuid)
+            # values set with 'fcst env' are always strings
+            interval = (self['Snapshot Interval'] || DEFAULT_SNAPSHOT_INTERVAL).to_i
+            return false if interval <= 0 or has_snapshot?(uuid)
+            
+            return snapshot_chain(uuid).length > interval
+        end
+        
+        
+        # Stores a snapshot of the originals with the uuid changeset, so the originals
+        # must be at that revision.  It's just a copy of the StatIndex since the file
+        # contents are all in the ObjectStore already.
+        def store_snapshot(uuid)
+            index = stat_index
+            index.save
+            FileUtils.mkdir_p File.join(@root_dir, uuid)
+            FileUtils.cp index.path, File.join(@root_dir, uuid, SNAPSHOT_INDEX)
+        end
+        
+        
+        # Rebuilds the uuid revision in dir (which should be empty) by writing out the
+        # nearest snapshot and then applying the changesets after it in order.  It returns
+        # the number of changesets applied after the snapshot, or nil if one of them failed.
+        def checkout(uuid, dir)
+            chain = snapshot_chain(uuid)
+            FileUtils.mkdir_p dir
+            return 0 if chain.empty?
+            
+            chain.each_with_index do |id, i|
+                cs_path, md = find_changeset(id)
+                
+                if i == 0 and has_snapshot?(id)
+                    snapshot = StatIndex.new(File.join(cs_path, SNAPSHOT_INDEX), object_store)
+                    return nil if snapshot.damaged?
+                    snapshot.dirs.each { |d| FileUtils.mkdir_p File.join(dir, d) }
+                    snapshot.materialize(snapshot.files.keys, dir)
+                    next
+                end
+                
+                journal_file, data_file = MetaData.extract_journal_data(md)
+                
+                if not journal_file or not data_file
+                    UI.failure :contents, "The meta-data for #{id} did not contain proper journal and data file contents."
+                    return nil
+                elsif MetaData.verify_digests(cs_path, md, local_changeset?(id)).length > 0
+                    UI.failure :security, "The changeset #{id} has been tampered with.  Aborting."
+                    return nil
+                end
+                
+                # apply_changeset closes the streams for us
+                journal_in = ChangeSet.open_journal(File.join(cs_path, journal_file))
+                data_in = ChangeSet.open_data(File.join(cs_path, data_file))
+                if ChangeSet.apply_changeset(journal_in, data_in, dir) > 0
+                    UI.failure :apply, "Changeset #{id} did not apply cleanly."
+                    return nil
+                end
+            end
+            
+            return has_snapshot?(chain[0]) ? chain.length - 1 : chain.length
+        end
+        
+        
+        # Returns the ObjectStore holding the contents of the originals.
+        def object_store
+            ObjectStore.new(@objects_dir)
+        end
+        
+        
+        # Returns the StatIndex of the originals.  If this is an old repository that
+        # still has an originals directory then it's moved into the object store first.
+        def stat_index
+            index_file = File.join(@path, STAT_INDEX)
+            
+            if File.directory? @originals_dir
+                UI.start_finish("Moving the originals directory into the object store") do
+                    FileUtils.mkdir_p @objects_dir
+                    FileUtils.rm_f index_file
+                    StatIndex.new(index_file, object_store).update(@originals_dir)
+                    FileUtils.rm_rf @originals_dir
+                end
+            end
+            
+            index = StatIndex.new(index_file, object_store)
+            if index.damaged?
+                raise StatIndexDamaged, "The record of the originals in #{index_file} is damaged.  Rebuild it from the revision path with 'fcst checkout -o'."
+            end
+            
+            return index
+        end
+        
+        
+        # Throws away the StatIndex and makes it again from the last revision in
+        # the 'Path', which is checked out into the work directory and indexed.
+        # This is how a damaged index gets fixed.  Returns false if the checkout failed.
+        def rebuild_stat_index
+            index_file = File.join(@path, STAT_INDEX)
+            scratch = File.join(@work_dir, "rebuild")
+            FileUtils.rm_rf scratch
+            
+            begin
+                id = (self['Path'] || []).last
+                return false if id and not checkout(id, scratch)
+                
+                FileUtils.mkdir_p scratch
+                FileUtils.mkdir_p @objects_dir
+                FileUtils.rm_f index_file
+                StatIndex.new(index_file, object_store).update(scratch)
+            ensure
+                FileUtils.rm_rf scratch
+            end
+            
+            return true
+        end
+        
+        
+        # Writes out just the given original files into a scratch directory in the
+        # work directory and gives its full path to the block.  The block can ask the
+        # StatIndex to materialize more files there.  The directory is removed after.
+        def with_originals(files)
+            scratch = File.expand_path(File.join(@work_dir, "originals"))
+            FileUtils.rm_rf scratch
+            FileUtils.mkdir_p scratch
+            
+            begin
+                stat_index.materialize(files, scratch)
+                return yield(scratch)
+            ensure
+                FileUtils.rm_rf scratch
+            end
+        end
+        
+        
+        # Applies the changeset in the journal and data files to the originals and
+        # returns the number of failed operations like ChangeSet.apply_changeset.  The
+        # files the changeset touches are written out with with_originals, the changeset
+        # is applied to them, and whatever results is put back in the StatIndex and
+        # ObjectStore.  Directories are tracked from the DirectoryOperation.
+        def apply_to_originals(journal_file, data_file, test_run=false)
+            touched = []
+            dir_ops = []
+            
+            journal_in = ChangeSet.open_journal(journal_file)
+            ChangeSet.each_operation(journal_in) do |type, info|
+                if type == ChangeSet::DirectoryOperation::TYPE
+                    dir_ops << info
+                else
+                    touched << info[:path]
+                    touched << info[:to_path] if info[:to_path]
+                end
+            end
+            journal_in.close
+            
+            with_originals(touched) do |scratch|
+                journal_in = ChangeSet.open_journal(journal_file)
+                data_in = ChangeSet.open_data(data_file)
+                failures = ChangeSet.apply_changeset(journal_in, data_in, scratch, test_run)
+                
+                if not test_run
+                    index = stat_index
+                    
+                    touched.each do |file|
+                        full_path = File.join(scratch, file)
+                        if File.file? full_path
+                            index.add(file, File.open(full_path, "rb") { |f| f.read }, File.mtime(full_path))
+                        else
+                            index.remove(file)
+                        end
+                    end
+                    
+                    dir_ops.each do |info|
+                        info[:created_dirs].each { |d| index.add_dir d }
+                        info[:deleted_dirs].sort.reverse.each { |d| index.remove_dir d }
+                    end
+                    
+                    index.save
+                end
+                
+                failures
+            end
+        end
+        
+        
+        # Brings the originals up to date after the changeset in the journal_file was
+        # applied to the working directory without any failures, so the changeset
+        # isn't decoded and applied a second time.  Moves and deletes only change the
+        # StatIndex, and created or changed files are read once from the working
+        # directory and put in the ObjectStore, with their working directory inodes
+        # recorded for the next status.  A created or changed file that
+        # doesn't match the digest the journal recorded for it (someone changed it
+        # already) means nothing is changed and false is returned, and then
+        # apply_to_originals has to be used.  The same goes for a journal with a
+        # symlink delta, since there's nothing in the working directory to refresh
+        # that entry from.
+        def sync_originals(journal_file, working)
+            updates = []
+
+            journal_in = ChangeSet.open_journal(journal_file)
+            begin
+                ChangeSet.each_operation(journal_in) do |type, info|
+                    path = info[:path]
+                    full_path = File.join(working, path.to_s)
+
+                    case type
+                    when ChangeSet::DeleteOperation::TYPE
+                        updates << [:remove, path]
+                    when ChangeSet::MoveOperation::TYPE
+                        to_path = File.join(working, info[:to_path])
+                        updates << [:move, path, info[:to_path], info[:mtime], File.file?(to_path) ? File.stat(to_path).ino : 0]
+                    when ChangeSet::CreateOperation::TYPE
+                        if not File.file? full_path
+                            updates << [:remove, path]
+                        else
+                            data = File.open(full_path, "rb") { |f| f.read }
+                            return false if info[:digest] and info[:digest] != Digest::MD5.hexdigest(data)
+                            updates << [:add, path, data, info[:mtime], File.stat(full_path).ino]
+                        end
+                    when ChangeSet::DeltaOperation::TYPE
+                        if info[:symlink]
+                            return false
+                        elsif info[:length].to_i == 0
+                            updates << [:move, path, path, info[:mtime], File.file?(full_path) ? File.stat(full_path).ino : 0]
+                        else
+                            # only trust the working file if it's what the delta makes, journals
+                            # from before :target_digest was recorded go through apply_to_originals
+                            data = File.open(full_path, "rb") { |f| f.read }
+                            return false if not info[:target_digest] or info[:target_digest] != Digest::MD5.hexdigest(data)
+                            updates << [:add, path, data, info[:mtime], File.stat(full_path).ino]
+                        end
+                    when ChangeSet::DirectoryOperation::TYPE
+                        updates << [:dirs, info]
+                    end
+                end
+            ensure
+                journal_in.close
+            end
+
+            index = stat_index
+            updates.each do |action, path, *args|
+                case action
+                when :remove
+                    index.remove(path)
+                when :move
+                    index.move(path, args[0], args[1], args[2])
+                when :add
+                    index.add(path, args[0], args[1], args[2])
+                when :dirs
+                    path[:created_dirs].each { |d| index.add_dir d }
+                    path[:deleted_dirs].sort.reverse.each { |d| index.remove_dir d }
+                end
+            end
+            index.save
+
+            return true
+        end
+
+
+        # Makes the changeset that takes the working directory back to the originals,
+        # writing it to cs_name in the current directory like ChangeSet.make_changeset.
+        # This is what undo and abort need.  It's made by finding the changes from the
+        # originals to the working directory and reversing them, so only the originals
+        # that are needed get written out.  It returns the ChangeSetBuilder.
+        #
+        # Giving the dirty paths (like ChangeSet.journal_paths for a changeset that was
+        # just applied) limits it to those, so the working directory isn't scanned.
+        def make_undo_changeset(cs_name, working, dirty=nil)
+            index = stat_index
+            
+            with_originals([]) do |scratch|
+                changes = ChangeSet::ChangeSetBuilder.new(scratch, working, index, dirty)
+                changes.detect_moved_files
+                undo = changes.reverse
+                
+                if undo.has_changes?
+                    index.materialize(changes.source_paths, scratch)
+                    ChangeSet.save_changeset(cs_name, undo, local_codec)
+                end
+                
+                undo
+            end
+        end
+        
+        
+        # Returns the DirtyJournal kept by the fcst watch daemon.
+        def dirty_journal
+            DirtyJournal.new(File.join(@path, DIRTY_JOURNAL), File.join(@path, WATCH_PID))
+        end
+        
+        
+        # Returns the Set of working tree paths that might differ from the originals
+        # directory according to the DirtyJournal, or nil if a full scan is needed.
+        # The StatIndex has to be there too since it stands in for the rest of the tree.
+        # Where the journal was read up to is kept for reset_dirty_journal.
+        def dirty_paths
+            @dirty_read = nil
+            return nil if stat_index.empty?
+            
+            paths, generation, offset = dirty_journal.read
+            @dirty_read = [generation, offset]
+            return paths
+        end
+        
+        
+        # Starts the DirtyJournal over with the paths after a scan that used
+        # dirty_paths, keeping whatever the watcher wrote since that read.  If the
+        # journal wasn't read first the next reader gets a full scan.
+        def reset_dirty_journal(paths)
+            generation, offset = @dirty_read
+            
+            if generation
+                dirty_journal.reset(paths, generation, offset)
+            else
+                dirty_journal.reset
+            end
+        end
+        
+        
         # Returns a list of all the changesets in the root directory
         # by loading the root directory contents and grepping for /^[a-zA-Z0-9]/
-        # which works since all UUIDs match this format.
+        # which works since all UUIDs match this format.  The packed changesets
+        # come from the pack indexes.
         def list_changesets
             dir = Dir.open(@root_dir)
             changesets =  dir.grep(/^[a-zA-Z0-9]/)
             dir.close
-            return changesets
+            
+            return changesets if packs.empty?
+            
+            # a packed changeset can have a directory for its undo or snapshot
+            changesets = Set.new(changesets)
+            packs.each { |pack| changesets.merge pack.ids }
+            return changesets.to_a
         end
 
     end
@@ -0,0 +1,415 @@
+require 'set'
+require 'fastcst/ui'
+
+
+module Repository
+
+    # = Introduction
+    #
+    # The RevisionIndex kept in .fastcst/revisions.index has the parts of every
+    # changeset's meta-data that the revision tree needs:  its parent, revision
+    # name, author, and creation date.  Without it every lookup meant loading the
+    # meta-data YAML of every changeset, so building readable names and listing
+    # the tree got slower with each changeset.  With it all of that is in memory
+    # after one read, and the parent and children of a changeset are hash lookups.
+    # Revision names are kept the same way (a name can belong to more than one
+    # changeset), along with a sorted list of them for looking names up by prefix.
+    #
+    # For ancestry it also works out (when first asked) the depth of every
+    # changeset and its skip pointers, the ancestors 1, 2, 4, 8 ... steps up.  With
+    # those ancestor? and common_ancestor jump up the tree in powers of two, so
+    # they take O(log depth) steps instead of walking parent by parent.
+    #
+    # The Repository keeps it up to date as changesets are stored and deleted.
+    # Each change is appended to the file, so storing a changeset doesn't rewrite
+    # the whole index.  When more than half the records are deletes the file is
+    # written again from what's left.  Each change ends with a STAMP record of the
+    # repository's generation at the time (see Repository#revision_stamp), so if the
+    # file is missing, damaged, or has a different generation than the repository
+    # it's rebuilt from the meta-data (see Repository#revision_index).
+    #
+    # = File Format
+    #
+    #   "FCSTRIX1"
+    #   records -- C(kind) and the fields for that kind
+    #
+    # Strings are V(length) and the bytes.  An ADD record is the uuid, parent id,
+    # revision name, author name, author e-mail (all strings) and V(created) in
+    # seconds.  A DELETE record is just the uuid.  A STAMP record is V(generation).
+    # Later records win.
+    class RevisionIndex
+        MAGIC = "FCSTRIX1"
+        ADD = 1
+        DELETE = 2
+        STAMP = 3
+
+        Entry = Struct.new(:id, :parent, :revision, :name, :email, :created)
+
+        attr_reader :path, :generation
+
+        # Opens the index at the given path and loads it if it exists.
+        def initialize(path)
+            @path = path
+            clear
+            @loaded = File.exist?(@path) && load
+        end
+
+
+        # True if the file was there and read without problems.
+        def loaded?
+            @loaded
+        end
+
+
+        # Forgets everything, used before a rebuild.
+        def clear
+            @entries = {}
+            @children = {}
+            @by_revision = {}
+            @sorted_revisions = nil
+            @depths = nil
+            @skips = nil
+            @deletes = 0
+            @generation = 0
+        end
+
+
+        def length
+            @entries.length
+        end
+
+
+        def ids
+            @entries.keys
+        end
+
+
+        def include?(uuid)
+            @entries.has_key? uuid
+        end
+
+
+        # Returns the Entry for the changeset or nil.
+        def [](uuid)
+            @entries[uuid]
+        end
+
+
+        # The parent id of the changeset ("NONE" for a root) or nil if it isn't indexed.
+        def parent(uuid)
+            entry = @entries[uuid]
+            entry ? entry.parent : nil
+        end
+
+
+        # The ids of the changeset's children.
+        def children(uuid)
+            (@children[uuid] || []).to_a
+        end
+
+
+        # Returns [revision, id] for every changeset with that revision name.
+        def find_revision(rev)
+            (@by_revision[rev] || []).collect { |id| [rev, id] }
+        end
+
+
+        # Returns the revision names that start with prefix in sorted order.  The
+        # sorted list is made the first time it's needed after a change and then
+        # searched with a binary search.
+        def revisions_with_prefix(prefix)
+            @sorted_revisions ||= @by_revision.keys.sort
+            names = @sorted_revisions
+
+            # find the first name that isn't less than the prefix
+            low, high = 0, names.length
+            while low < high
+                mid = (low + high) / 2
+                if names[mid] < prefix
+                    low = mid + 1
+                else
+                    high = mid
+                end
+            end
+
+            found = []
+            while low < names.length and names[low][0, prefix.length] == prefix
+                found << names[low]
+                low += 1
+            end
+
+            return found
+        end
+
+
+        # How many parents up the changeset's root is (0 for a root), or nil if it
+        # isn't indexed.  A changeset whose parent isn't in the index counts as a root.
+        def depth(uuid)
+            build_ancestry if not @depths
+            @depths[uuid]
+        end
+
+
+        # Returns the ancestor of the changeset at the given depth (uuid itself if
+        # that's its depth), or nil if it isn't indexed or isn't that deep.
+        def ancestor_at(uuid, target)
+            from = depth(uuid)
+            return nil if not from or target < 0 or target > from
+
+            distance = from - target
+            level = 0
+            while distance > 0
+                uuid = @skips[uuid][level] if distance & 1 == 1
+                distance >>= 1
+                level += 1
+            end
+
+            return uuid
+        end
+
+
+        # True if ancestor is uuid itself or one of its parents, grandparents, and so on.
+        def ancestor?(ancestor, uuid)
+            depth = depth(ancestor)
+            depth != nil and ancestor_at(uuid, depth) == ancestor
+        end
+
+
+        # Returns the closest changeset that both a and b come from (which is one of
+        # them if one is an ancestor of the other), or nil if they aren't in the
+        # same tree.
+        def common_ancestor(a, b)
+            depth_a, depth_b = depth(a), depth(b)
+            return nil if not depth_a or not depth_b
+
+            # bring them to the same depth, then go up together as far as they differ
+            a = ancestor_at(a, depth_b) if depth_a > depth_b
+            b = ancestor_at(b, depth_a) if depth_b > depth_a
+            return a if a == b
+
+            (@skips[a].length - 1).downto(0) do |level|
+                if @skips[a][level] != @skips[b][level]
+                    a, b = @skips[a][level], @skips[b][level]
+                end
+            end
+
+            parent = @skips[a][0]
+            return parent == @skips[b][0] ? parent : nil
+        end
+
+
+        # Adds the changeset from its meta-data and appends it to the file unless
+        # append is false (which is how rebuild does it before one save).
+        def add(md, append=true)
+            created = md['Journal'] && md['Journal'].last ? md['Journal'].last['Date'] : nil
+            author = md['Created By'] || {}
+            entry = Entry.new(md['ID'], md['Parent ID'] || "NONE", md['Revision'].to_s,
+                author['Name'].to_s, author['E-Mail'].to_s, created.kind_of?(Time) ? created.to_i : 0)
+
+            insert entry
+            write_records([encode_add(entry)]) if append
+            return entry
+        end
+
+
+        # Takes the changeset out and appends the delete to the file.  Once there
+        # are more deletes than changesets the file is written out fresh.
+        def remove(uuid)
+            entry = @entries.delete uuid
+            return if not entry
+
+            unlink entry
+            @depths = @skips = nil
+            @deletes += 1
+
+            if @deletes > @entries.length
+                save
+            else
+                write_records([[DELETE].pack("C") + encode_string(uuid)])
+            end
+        end
+
+
+        # Records the repository generation the index is now up to date with, and
+        # appends it to the file unless append is false (like add).
+        def stamp(generation, append=true)
+            @generation = generation
+            write_records([[STAMP, generation].pack("CV")]) if append
+        end
+
+
+        # Writes the whole index out again with only the current changesets.
+        def save
+            tmp = @path + ".#$$.tmp"
+            File.open(tmp, "wb") do |out|
+                out.write MAGIC
+                @entries.each_value { |entry| out.write encode_add(entry) }
+                out.write [STAMP, @generation].pack("CV")
+            end
+            File.rename(tmp, @path)
+
+            @deletes = 0
+            @loaded = true
+        end
+
+
+        # Returns the revision tree the same way Repository#revision_tree does:  every
+        # id mapped to an Array of its children.
+        def tree
+            tree = {}
+            @entries.each_value do |entry|
+                tree[entry.id] ||= []
+                if entry.parent and entry.parent != "NONE"
+                    (tree[entry.parent] ||= []) << entry.id
+                end
+            end
+            return tree
+        end
+
+
+        private
+
+        def insert(entry)
+            old = @entries[entry.id]
+            unlink old if old
+
+            @entries[entry.id] = entry
+            (@children[entry.parent] ||= Set.new) << entry.id
+
+            @sorted_revisions = nil if not @by_revision.has_key? entry.revision
+            (@by_revision[entry.revision] ||= Set.new) << entry.id
+
+            # a new leaf only needs its own skip pointers, anything else means starting over
+            if @depths and not old and not @children[entry.id]
+                link entry.id
+            else
+                @depths = @skips = nil
+            end
+        end
+
+
+        # Works out the depth and skip pointers for every changeset.  Each chain is
+        # followed up to something already done (or a root) and then filled in on
+        # the way back down, so deep histories don't recurse.
+        def build_ancestry
+            @depths = {}
+            @skips = {}
+
+            @entries.each_key do |uuid|
+                chain = []
+                while uuid and not @depths.has_key? uuid
+                    chain << uuid
+                    parent = @entries[uuid].parent
+                    uuid = @entries.has_key?(parent) ? parent : nil
+                end
+
+                chain.reverse_each { |id| link id }
+            end
+        end
+
+
+        # Sets the depth and skip pointers of the changeset from its parent's, which
+        # have to be done already.
+        def link(uuid)
+            parent = @entries[uuid].parent
+
+            if not @depths.has_key? parent
+                @depths[uuid] = 0
+                @skips[uuid] = []
+                return
+            end
+
+            @depths[uuid] = @depths[parent] + 1
+            skips = @skips[uuid] = [parent]
+            while ancestor = @skips[skips.last][skips.length - 1]
+                skips << ancestor
+            end
+        end
+
+
+        # Takes the entry out of the children and revision name lookups.
+        def unlink(entry)
+            @children[entry.parent].delete entry.id if @children[entry.parent]
+
+            ids = @by_revision[entry.revision]
+            if ids
+                ids.delete entry.id
+                if ids.empty?
+                    @by_revision.delete entry.revision
+                    @sorted_revisions = nil
+                end
+            end
+        end
+
+
+        def write_records(records)
+            if not File.exist? @path
+                save
+            else
+                File.open(@path, "ab") { |out| records.each { |record| out.write record } }
+            end
+        end
+
+
+        def encode_string(str)
+            [str.length].pack("V") + str
+        end
+
+
+        def encode_add(entry)
+            [ADD].pack("C") + [entry.id, entry.parent, entry.revision, entry.name, entry.email].collect { |s| encode_string(s) }.join +
+                [entry.created].pack("V")
+        end
+
+
+        # Reads the file, returning false (with everything cleared) if it's damaged.
+        def load
+            data = File.open(@path, "rb") { |f| f.read }
+            return false if data[0, MAGIC.length] != MAGIC
+
+            pos = MAGIC.length
+            strings = lambda do |count|
+                (1 .. count).collect do
+                    raise "truncated" if pos + 4 > data.length
+                    len = data[pos, 4].unpack("V")[0]
+                    raise "truncated" if pos + 4 + len > data.length
+                    pos += 4 + len
+                    data[pos - len, len]
+                end
+            end
+
+            begin
+                while pos < data.length
+                    kind = data[pos, 1].unpack("C")[0]
+                    pos += 1
+
+                    if kind == ADD
+                        id, parent, revision, name, email = strings.call(5)
+                        raise "truncated" if pos + 4 > data.length
+                        created = data[pos, 4].unpack("V")[0]
+                        pos += 4
+                        insert Entry.new(id, parent, revision, name, email, created)
+                    elsif kind == DELETE
+                        id = strings.call(1)[0]
+                        entry = @entries.delete id
+                        unlink entry if entry
+                        @depths = @skips = nil
+                        @deletes += 1
+                    elsif kind == STAMP
+                        raise "truncated" if pos + 4 > data.length
+                        @generation = data[pos, 4].unpack("V")[0]
+                        pos += 4
+                    else
+                        raise "unknown record"
+                    end
+                end
+            rescue
+                UI.failure :index, "Revision index #@path is damaged, it will be rebuilt"
+                clear
+                return false
+            end
+
+            return true
+        end
+    end
+end
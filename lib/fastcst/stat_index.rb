@@ -0,0 +1,310 @@
+require 'set'
+require 'digest/md5'
+require 'dir_scan'
+
+
+module Repository
+
+    # Raised by Repository#stat_index when the index can't be read, since carrying
+    # on with an empty one would make every file look new.
+    class StatIndexDamaged < StandardError
+    end
+
+
+    # = Introduction
+    #
+    # The StatIndex kept in .fastcst/stat.index is the repository's record of the
+    # originals:  the size, mtime, and MD5 digest of every file as of the last
+    # revision, along with the list of directories.  The contents themselves are in
+    # the ObjectStore under the digest, so there is no copy of the tree on disk
+    # and files are only written out (see materialize) when something needs them.
+    #
+    # The commands change it through Repository#apply_to_originals (or
+    # Repository#sync_originals right after an apply).  It also lets
+    # fcst status skip reading the originals entirely and tell the difference
+    # between a file that was really changed and one that was just touched.
+    #
+    # The update method builds the index from a real directory, which is only used
+    # to import the old style originals directory.  Updating only hashes the files
+    # whose stat information changed since the last update.
+    #
+    # = File Format
+    #
+    # The file is a flat binary file so that it can be read with one read and a
+    # series of unpacks:
+    #
+    #   "FCSTIDX1" V(count)
+    #   count * [ C(type) v(path_length) path V(size_lo) V(size_hi) V(mtime) V(inode_lo) V(inode_hi) a16(digest) ]
+    #
+    # The type is FILE or DIR, and directories have everything after the path set to 0.
+    class StatIndex
+        attr_reader :path, :files, :dirs
+
+        MAGIC = "FCSTIDX1"
+        FILE = 0
+        DIR = 1
+        HEADER_SIZE = MAGIC.length + 4
+        RECORD_SIZE = 1 + 2 + 20 + 16
+
+        # Opens the index at the given path and loads it if it exists.  The store
+        # is the ObjectStore that file contents go into when they're indexed.
+        def initialize(path, store=nil)
+            @path = path
+            @store = store
+            @files = {}
+            @dirs = Set.new
+            @children = nil
+            @damaged = false
+            load if File.exist? @path
+        end
+
+
+        # True if the file was there but couldn't be read, in which case the index
+        # is empty and shouldn't be used.
+        def damaged?
+            @damaged
+        end
+
+
+        # True if nothing has been indexed yet.
+        def empty?
+            @files.empty? and @dirs.empty?
+        end
+
+
+        # Returns [size, mtime, inode] for the file (with the mtime as a Time) just like
+        # DirScan.scan gives, or nil if it's not in the index.
+        def stat(file)
+            info = @files[file]
+            info ? [info[0], Time.at(info[1]), info[2]] : nil
+        end
+
+
+        # Returns the stats for all the files in the same form as DirScan.scan.
+        def file_stats
+            stats = {}
+            @files.each { |file, info| stats[file] = [info[0], Time.at(info[1]), info[2]] }
+            return stats
+        end
+
+
+        # The raw 16 byte MD5 digest for the file when it was indexed.
+        def digest(file)
+            info = @files[file]
+            info ? info[3] : nil
+        end
+
+
+        # The digest as hex, which is how the ObjectStore and journals name it.
+        def hexdigest(file)
+            info = @files[file]
+            info ? info[3].unpack("H*")[0] : nil
+        end
+
+
+        # Records the file in the index.  The contents are put in the store (if
+        # there is one) and the directories leading up to it are added.  The inode
+        # is the working directory file's, or 0 when it isn't known (the file was
+        # written somewhere else), which makes the next status hash it once.
+        def add(file, data, mtime, inode=0)
+            digest = @store ? @store.store(data) : Digest::MD5.hexdigest(data)
+            counted(file, 1) if not @files.has_key? file
+            @files[file] = [data.length, mtime.to_i, inode, [digest].pack("H*")]
+            add_parents(file)
+        end
+
+
+        # Takes the file out of the index.  The contents stay in the store.
+        def remove(file)
+            counted(file, -1) if @files.delete file
+        end
+
+
+        # Moves the file's record to a new path with a new mtime.  The contents
+        # don't change so nothing is read or stored.  A from that's the same as
+        # to just changes the mtime.  The inode is the same as for add.
+        def move(from, to, mtime, inode=0)
+            info = @files.delete from
+            return if not info
+
+            counted(from, -1)
+            counted(to, 1) if not @files.has_key? to
+            @files[to] = [info[0], mtime.to_i, inode, info[3]]
+            add_parents(to)
+        end
+
+
+        # Replaces the stat information for a file whose contents were found to be
+        # the same as what's indexed (it was only touched), so it isn't hashed again
+        # the next time.  This is the same thing git does when it refreshes its index.
+        def refresh(file, size, mtime, inode)
+            info = @files[file]
+            @files[file] = [size, mtime.to_i, inode, info[3]] if info
+        end
+
+
+        # Adds a directory.
+        def add_dir(dir)
+            counted(dir, 1) if @dirs.add? dir
+        end
+
+
+        # Removes a directory, but only if no files are left in it.  Just like
+        # DirectoryOperation, it won't take away anything that isn't empty.
+        def remove_dir(dir)
+            return if children[dir] > 0
+            counted(dir, -1) if @dirs.delete? dir
+        end
+
+
+        # Writes the given files out of the store into dir with their mtimes set.
+        # Anything that isn't in the index is skipped.
+        def materialize(files, dir)
+            files.each do |file|
+                info = @files[file]
+                @store.materialize(hexdigest(file), File.join(dir, file), Time.at(info[1])) if info
+            end
+        end
+
+
+        # Brings the index up to date with the directory (an old originals directory)
+        # and saves it.  Files with the same size, mtime, and inode keep their digest,
+        # the rest are read and hashed again.  It returns the number of files hashed.
+        def update(dir)
+            stats, dirs = DirScan.scan(dir)
+            hashed = 0
+            files = {}
+
+            stats.each do |file, info|
+                size, mtime, inode = info
+                old = @files[file]
+
+                if old and old[0] == size and old[1] == mtime.to_i and old[2] == inode
+                    files[file] = old
+                else
+                    data = File.read(File.join(dir, file))
+                    digest = @store ? [@store.store(data)].pack("H*") : Digest::MD5.digest(data)
+                    files[file] = [size, mtime.to_i, inode, digest]
+                    hashed += 1
+                end
+            end
+
+            @files = files
+            @dirs = Set.new(dirs)
+            @children = nil
+            save
+
+            return hashed
+        end
+
+
+        # Writes the whole index out to a temporary file and renames it over the
+        # old one so a crash never leaves a half written index.  The store's index
+        # is flushed first so every digest in here can be found.
+        def save
+            @store.flush if @store
+            tmp = @path + ".tmp"
+
+            File.open(tmp, "wb") do |out|
+                out.write [MAGIC, @files.length + @dirs.length].pack("a8V")
+
+                @dirs.each do |dir|
+                    out.write [DIR, dir.length, dir, 0, 0, 0, 0, 0, "\0" * 16].pack("Cva*VVVVVa16")
+                end
+
+                @files.each do |file, info|
+                    size, mtime, inode, digest = info
+                    out.write [FILE, file.length, file, size & 0xffffffff, size >> 32, mtime,
+                        inode & 0xffffffff, inode >> 32, digest].pack("Cva*VVVVVa16")
+                end
+            end
+
+            File.rename(tmp, @path)
+        end
+
+
+        # Reads the index from disk.  A damaged index (a bad header, or records that
+        # run past the end of the file) is reported, left empty, and marked damaged?
+        # so the Repository won't use it.  The originals can be brought back with
+        # fcst checkout -o.
+        def load
+            data = File.open(@path, "rb") { |f| f.read }
+            @files = {}
+            @dirs = Set.new
+            @children = nil
+
+            if data.length < HEADER_SIZE or data[0, MAGIC.length] != MAGIC
+                return damaged
+            end
+
+            count = data[MAGIC.length, 4].unpack("V")[0]
+            pos = HEADER_SIZE
+
+            count.times do
+                return damaged if pos + 3 > data.length
+                type, path_len = data[pos, 3].unpack("Cv")
+                return damaged if pos + RECORD_SIZE + path_len > data.length or (type != FILE and type != DIR)
+
+                path = data[pos + 3, path_len]
+                size_lo, size_hi, mtime, ino_lo, ino_hi, digest = data[pos + 3 + path_len, RECORD_SIZE - 3].unpack("VVVVVa16")
+                pos += RECORD_SIZE + path_len
+
+                if type == DIR
+                    @dirs << path
+                else
+                    @files[path] = [(size_hi << 32) | size_lo, mtime, (ino_hi << 32) | ino_lo, digest]
+                end
+            end
+
+            return damaged if pos != data.length
+        end
+
+
+        private
+
+        # Reports the damage and empties the index.
+        def damaged
+            UI.failure :index, "Stat index #@path is damaged"
+            @files = {}
+            @dirs = Set.new
+            @children = nil
+            @damaged = true
+        end
+
+
+        # The number of files and directories directly in each directory, so
+        # remove_dir doesn't have to look through everything for each directory it's
+        # given.  It's only counted the first time remove_dir needs it, and after that
+        # every change to the files and dirs keeps it up to date through counted.
+        def children
+            if not @children
+                @children = Hash.new(0)
+                @files.each_key { |file| counted(file, 1) }
+                @dirs.each { |dir| counted(dir, 1) }
+            end
+
+            return @children
+        end
+
+
+        # Adds change to the count of the path's parent directory, if it's counted.
+        def counted(path, change)
+            return if not @children
+
+            parent = File.dirname(path)
+            @children[parent] += change if parent != path
+        end
+
+
+        # Adds the directories leading up to the file.
+        def add_parents(file)
+            dir = File.dirname(file)
+            while not @dirs.include? dir
+                @dirs << dir
+                counted(dir, 1)
+                break if dir == "." or dir == "/"
+                dir = File.dirname(dir)
+            end
+        end
+    end
+end
@@ -43,9 +43,23 @@ require 'suffix_array'
 # Each call to SuffixArray#longest_nonmatch returns a triplet of [non-match length, 
 # match start, match-length] which is used to send INSERT and MATCH events to the Emitter.
 #
+# Exact matching has one annoying weakness:  a single changed byte in the middle of a long
+# run splits what should be one MATCH into MATCH+INSERT+MATCH.  This happens all the time
+# in binary files where only an embedded timestamp or offset changes.  To handle this the
+# DeltaGenerator asks SuffixArray#extend_match to keep going past the end of each MATCH,
+# allowing a few mismatched bytes (DeltaGenerator#max_mismatches).  If it manages to extend
+# the match then a PATCH event is sent instead, which is a MATCH with a few bytes replaced.
+#
 # Refer to SuffixArrayDelta#generate for more details, and SuffixArray#longest_nonmatch for how
 # matching/non-matching is done.
 #
+# For text files there is also the TokenDeltaGenerator which splits the source and target into
+# lines (or words), gives each distinct one an integer ID, and builds a TokenSuffixArray over
+# the IDs instead of the bytes.  The search then runs in line units which is much faster on
+# large source files, and every INSERT and MATCH lines up with whole lines so a TextEmitter can
+# print something a human can actually read.  It still produces normal INSERT and MATCH byte
+# records so the DeltaReader doesn't know the difference.
+#
 # Once a series of INSERT/MATCH records is recorded, we can reconstruct the target file given only
 # the delta and the source.  We simply process each record by sending it to an ApplyEmitter which
 # either INSERTs the required block of data, or writes/copies the MATCH region from the source.
@@ -68,10 +82,14 @@ require 'suffix_array'
 #
 # The only format that matters at the moment is the delta file format created by the 
 # SuffixArrayDelta::FileEmitter, and read by the SuffixArray::DeltaReader.  The file
-# consists of a sequence of INSERT and MATCH records.  Each records has the format:
+# consists of a sequence of INSERT, MATCH, and PATCH records.  Each records has the format:
 #
 #   [INSERT] byte=0 uint32(length) string(data)  -- string is not 0 terminated.
 #   [MATCH] byte=1 uint32(start) uint32(length)
+#   [PATCH] byte=2 uint32(start) uint32(length) uint32(count) count * (uint32(offset) byte(value))
+#
+# A PATCH is a MATCH where the bytes at each offset (relative to the start of the match)
+# are replaced with the given value.
 #
 # The uint32 is a little-endian (think Intel) byte order.  This is only an artifact of
 # my using an Intel machine to make the program, and also a choice based on the fact that
@@ -91,13 +109,15 @@ module SuffixArrayDelta
     # these aren't included here since Ruby doesn't enforce any kind of abstract
     # functions (doesn't need them anyway).
     class BaseEmitter
-        attr_reader :match_count, :insert_count, :match_total, :insert_total
+        attr_reader :match_count, :insert_count, :match_total, :insert_total, :patch_count, :patch_total
         
         def initialize
             @insert_count = 0
             @match_count = 0
+            @patch_count = 0
             @insert_total = 0
             @match_total = 0
+            @patch_total = 0
         end
 
         def update_insert_stats(start, length)
@@ -109,6 +129,11 @@ module SuffixArrayDelta
             @match_count += 1
             @match_total += length
         end
+        
+        def update_patch_stats(start, length, patches)
+            @patch_count += 1
+            @patch_total += length
+        end
     end
     
     
@@ -125,9 +150,44 @@ module SuffixArrayDelta
             puts "M: #{start},#{length}"
             update_match_stats(start, length)
         end
+        
+        def patch(start, length, patches)
+            puts "P: #{start},#{length},#{patches.length}"
+            update_patch_stats(start, length, patches)
+        end
+    
+        def finished
+            puts "Match Count: #{@match_count}, Insert Count: #{@insert_count}, Patch Count: #{@patch_count}"
+        end
+    end
+
+
+    # Prints the records in a human readable way, which is mostly useful for deltas made by
+    # the TokenDeltaGenerator since its INSERT records are whole lines.  Inserted lines are
+    # printed with a "+ " in front, and MATCH/PATCH records just say where they copy from
+    # since the source isn't available when reading a stored delta.
+    class TextEmitter < BaseEmitter
+        def initialize(out=$stdout)
+            @out = out
+            super()
+        end
+        
+        def insert(start, length, from)
+            from[start, length].each_line { |line| @out.puts "+ #{line.chomp}" }
+            update_insert_stats(start, length)
+        end
+    
+        def match(start, length)
+            @out.puts "= #{length} bytes from #{start}"
+            update_match_stats(start, length)
+        end
+        
+        def patch(start, length, patches)
+            @out.puts "~ #{length} bytes from #{start} with #{patches.length} changed"
+            update_patch_stats(start, length, patches)
+        end
     
         def finished
-            puts "Match Count: #{@match_count}, Insert Count: #{@insert_count}"
         end
     end
 
@@ -139,6 +199,7 @@ module SuffixArrayDelta
     class FileEmitter < BaseEmitter
         MATCH = 1
         INSERT = 0
+        PATCH = 2
     
         def initialize(file, should_close=true)
             @file = file
@@ -160,6 +221,13 @@ module SuffixArrayDelta
             update_match_stats(start, length)
         end
         
+        def patch(start, length, patches)
+            header = [PATCH, start, length, patches.length].pack("cVVV")
+            @file.write(header)
+            @file.write(patches.flatten.pack("VC" * patches.length))
+            update_patch_stats(start, length, patches)
+        end
+        
         def finished
             if @should_close
                 @file.close
@@ -194,6 +262,13 @@ module SuffixArrayDelta
             @file.write data
             update_match_stats(start, length)
         end
+        
+        def patch(start, length, patches)
+            data = @source[start, length]
+            patches.each { |offset, byte| data[offset, 1] = byte.chr }
+            @file.write data
+            update_patch_stats(start, length, patches)
+        end
     
         def finished
             if @should_close
@@ -206,9 +281,11 @@ module SuffixArrayDelta
     # Uses a SuffixArray, a source, a target, and an Emitter to create a sequence of INSERT/MATCH
     # events.  The emitter is responsible for using these events to do something useful.
     class DeltaGenerator
-        attr_reader :short_match_threshold
-        attr_writer :short_match_threshold
+        attr_reader :short_match_threshold, :max_mismatches, :block_size
+        attr_writer :short_match_threshold, :max_mismatches, :block_size
         SHORT_MATCH_THRESHOLD=30
+        MAX_MISMATCHES=16
+        BLOCK_SIZE=64
     
     
         # Initializes the generator so that generate can do it's thing.
@@ -217,16 +294,61 @@ module SuffixArrayDelta
         # short_match_threshold to be changed hasn't been fully tested so it's
         # not allowed right now.  It might be a good idea in the future to make
         # this adaptable based on the input.
+        #
+        # The max_mismatches setting (default 16) is how many bytes a MATCH can
+        # be patched with before it's split up.  Setting it to 0 turns off PATCH
+        # records so only INSERT and MATCH are produced.
+        #
+        # The block_size (default 64) is the size of the blocks used by the rolling
+        # hash pre-filter that finds the unchanged regions (see generate).  Setting it
+        # to 0 turns the pre-filter off and everything is searched with the suffix array.
+        #
+        # The sary can be nil, and then the SuffixArray is only built (see sary) once
+        # search_window has something to search.  Until then the pre-filter and the
+        # match extension use a BlockIndex, which only needs the source.
         def initialize(sary, source)
             @sary = sary
+            @blocks = sary || BlockIndex.new(source)
             @source = source
             @short_match_threshold = SHORT_MATCH_THRESHOLD
+            @max_mismatches = MAX_MISMATCHES
+            @block_size = BLOCK_SIZE
         end
     
     
-        # Does the actual work of generating the INSERT/MATCH events.  The algorithm is dead simple
-        # and involves nothing more than a while loop that repeatedly calles SuffixArray#longest_nonmatch
-        # producing the required events.  It continues this until it exhausts the target data.
+        # Does the actual work of generating the INSERT/MATCH events.  Most of the time the target is
+        # the source with a few edits, so the first thing done is an rsync style pass with
+        # SuffixArray#next_block_match that finds the next block of the target that is unchanged
+        # and extends it as far as it goes.  These become long MATCH records for almost no work.
+        # Only the changed windows in between are given to search_window, which does the real
+        # suffix array searching.
+        def generate(target, emit)
+            start = 0
+            while start < target.length
+                block = nil
+                block = @blocks.next_block_match(target, start, @block_size) if @block_size > 0
+                
+                if not block
+                    # no more unchanged blocks, so the rest is searched the hard way
+                    search_window(target, start, target.length, emit)
+                    break
+                end
+                
+                tgt_start, src_start, length = block
+                search_window(target, start, tgt_start, emit) if tgt_start > start
+                length = emit_match(target, tgt_start, src_start, length, emit)
+                
+                start = tgt_start + length
+            end
+        
+            emit.finished
+        end
+        
+        
+        # Generates the INSERT/MATCH events for the from...to window of the target.  The
+        # algorithm is dead simple and involves nothing more than a while loop that repeatedly
+        # calles SuffixArray#longest_nonmatch producing the required events.  It continues this
+        # until it exhausts the window.
         #
         # The only strange part is the use of the @shortest_match_threshold as the third parameter
         # of the SuffixArray#longest_nonmatch target.  The shortest match threshold is a setting that
@@ -238,29 +360,258 @@ module SuffixArrayDelta
         # Currently it defaults to 30, which in my quick tests seemed to be a good limit on the
         # size of a match. A more adaptive algorithm would be better where the shortest_match_threshold
         # is adjusted either based on the size of the file, or the size of each match found.
-        def generate(target, emit)
+        #
+        # Every MATCH found is then given to SuffixArray#extend_match (see emit_match) to see if
+        # it can be continued past a few changed bytes.  When it can, a PATCH is sent instead of
+        # the MATCH and the following INSERT/MATCH pair is avoided entirely.
+        def search_window(target, from, to, emit)
+            # the searches run against just the window so they can't run into the next block
+            window = (from == 0 and to == target.length) ? target : target[from ... to]
+            
             start = 0
-            while start < target.length
-                non_len, match_start, match_len = @sary.longest_nonmatch target, start, @short_match_threshold
+            while start < window.length
+                non_len, match_start, match_len = sary.longest_nonmatch window, start, @short_match_threshold
             
                 if non_len > 0
                     # an insert of good non_len was found
-                    emit.insert start, non_len, target
+                    emit.insert from + start, non_len, target
                 end
             
                 if match_len > 0
-                    emit.match match_start, match_len
+                    match_len = emit_match(window, start + non_len, match_start, match_len, emit)
                 end
             
                 start += non_len + match_len
             end
+        end
+        
+        
+        # Sends the MATCH to the emitter, but first tries to extend it with SuffixArray#extend_match
+        # and sends a PATCH instead if that works.  It returns the final length of the match.
+        def emit_match(target, from, match_start, match_len, emit)
+            patches = []
+            if @max_mismatches > 0
+                match_len, patches = @blocks.extend_match target, from, match_start, match_len, @max_mismatches
+            end
+            
+            if patches.empty?
+                emit.match match_start, match_len
+            else
+                emit.patch match_start, match_len, patches
+            end
+            
+            return match_len
+        end
         
-            emit.finished
+        
+        # The SuffixArray of the source, built the first time it's asked for.
+        def sary
+            @sary ||= SuffixArray.new(@source)
+        end
+        
+        
+        # True if the SuffixArray was given or has been built.
+        def sary_built?
+            @sary != nil
         end
     
     end
 
 
+    # Does the same job as the DeltaGenerator, but works in lines (or words) instead of bytes.
+    # The source and target are split up with the pattern regex, each distinct token is given an
+    # integer ID, and a TokenSuffixArray is built over the source IDs.  The search happens on
+    # the token IDs and the results are converted back to byte offsets before they're sent to
+    # the emitter as ordinary INSERT and MATCH events.
+    #
+    # The short_match_threshold is in tokens here, so the default of 1 means a single matching
+    # line in the middle of changed lines gets folded into the INSERT.
+    class TokenDeltaGenerator
+        attr_reader :short_match_threshold
+        attr_writer :short_match_threshold
+        SHORT_MATCH_THRESHOLD=1
+        LINES=/[^\n]*\n|[^\n]+/
+        WORDS=/\w+|\s+|[^\w\s]+/
+        
+        # Tokenizes the source and builds the TokenSuffixArray.  The pattern must match
+        # every byte of the input, which LINES and WORDS both do.
+        def initialize(source, pattern=LINES)
+            @source = source
+            @pattern = pattern
+            @short_match_threshold = SHORT_MATCH_THRESHOLD
+            @ids = {}
+            
+            # the source is tokenized first so its IDs run from 1 with no gaps, like sarray needs
+            src_tokens, @src_offsets = tokenize(source)
+            @sary = TokenSuffixArray.new(src_tokens.pack("i*"))
+        end
+        
+        
+        # Splits the data up into token IDs and returns them along with the byte offset
+        # of each token (plus one extra offset for the end of the data).
+        def tokenize(data)
+            tokens = []
+            offsets = []
+            pos = 0
+            
+            data.scan(@pattern) do |token|
+                offsets << pos
+                pos += token.length
+                tokens << (@ids[token] ||= @ids.size + 1)
+            end
+            offsets << pos
+            
+            return tokens, offsets
+        end
+        
+        
+        # Generates the INSERT/MATCH events in exactly the same way as DeltaGenerator#generate
+        # but with TokenSuffixArray#longest_nonmatch, converting the token ranges back to bytes.
+        def generate(target, emit)
+            tgt_tokens, tgt_offsets = tokenize(target)
+            packed = tgt_tokens.pack("i*")
+            
+            start = 0
+            while start < tgt_tokens.length
+                non_len, match_start, match_len = @sary.longest_nonmatch packed, start, @short_match_threshold
+                
+                if non_len > 0
+                    emit.insert tgt_offsets[start], tgt_offsets[start + non_len] - tgt_offsets[start], target
+                end
+                
+                if match_len > 0
+                    emit.match @src_offsets[match_start], @src_offsets[match_start + match_len] - @src_offsets[match_start]
+                end
+                
+                start += non_len + match_len
+            end
+            
+            emit.finished
+        end
+        
+        
+        # Lines the target up against the source for ThreeWayMerge.  It returns the target's
+        # tokens (as Strings) and the matches as [target_start, source_start, length], all in
+        # tokens.  Only matches that go forward in the source are kept, so the matches and the
+        # gaps between them describe the target as edits to the source in order.
+        def align(target)
+            tgt_tokens, tgt_offsets = tokenize(target)
+            packed = tgt_tokens.pack("i*")
+            matches = []
+            
+            start = 0
+            src_pos = 0
+            while start < tgt_tokens.length
+                non_len, match_start, match_len = @sary.longest_nonmatch packed, start, @short_match_threshold
+                start += non_len
+                
+                if match_len > 0 and match_start >= src_pos
+                    matches << [start, match_start, match_len]
+                    src_pos = match_start + match_len
+                end
+                
+                start += match_len
+            end
+            
+            texts = (0 ... tgt_tokens.length).collect { |i| target[tgt_offsets[i], tgt_offsets[i + 1] - tgt_offsets[i]] }
+            return texts, matches
+        end
+    end
+    
+    
+    # Merges two different changes of the same base (ours and theirs) the way diff3 does.
+    # Each side is lined up against the base with TokenDeltaGenerator#align (so the suffix
+    # array does the matching) and turned into hunks, which are a range of base tokens and
+    # what replaces them.  Hunks that don't touch a hunk from the other side are all applied,
+    # and where both sides changed the same place it's a conflict unless they made exactly the
+    # same change.  Hunks that are only next to each other count as touching, just like diff3.
+    class ThreeWayMerge
+        # The [start, end] base token ranges (lines with the default pattern, starting at 0)
+        # that both sides changed in the last merge.
+        attr_reader :conflicts
+        
+        def initialize(base, pattern=TokenDeltaGenerator::LINES)
+            @pattern = pattern
+            @base_tokens = base.scan(pattern)
+            @conflicts = []
+            
+            if not base.empty?
+                @gen = TokenDeltaGenerator.new(base, pattern)
+                # every matching line counts when lining things up
+                @gen.short_match_threshold = 0
+            end
+        end
+        
+        
+        # Returns the merged String, or nil if there were conflicts (see conflicts).
+        def merge(ours, theirs)
+            changes = hunks(ours).collect { |hunk| hunk << :ours } + hunks(theirs).collect { |hunk| hunk << :theirs }
+            changes = changes.sort_by { |hunk| [hunk[0], hunk[1]] }
+            @conflicts = []
+            out = []
+            pos = 0
+            
+            i = 0
+            while i < changes.length
+                # gather up everything that touches this change
+                cluster = [changes[i]]
+                first, last = changes[i][0], changes[i][1]
+                i += 1
+                while i < changes.length and changes[i][0] <= last
+                    cluster << changes[i]
+                    last = changes[i][1] if changes[i][1] > last
+                    i += 1
+                end
+                
+                out.concat @base_tokens[pos ... first]
+                
+                if cluster.collect { |hunk| hunk[3] }.uniq.length == 1
+                    # only one side changed this part
+                    at = first
+                    cluster.each do |start, finish, tokens, side|
+                        out.concat @base_tokens[at ... start]
+                        out.concat tokens
+                        at = finish
+                    end
+                    out.concat @base_tokens[at ... last]
+                elsif cluster.length == 2 and cluster[0][0, 3] == cluster[1][0, 3]
+                    # both made the same change
+                    out.concat cluster[0][2]
+                else
+                    @conflicts << [first, last]
+                end
+                
+                pos = last
+            end
+            
+            out.concat @base_tokens[pos .. -1]
+            return @conflicts.empty? ? out.join : nil
+        end
+        
+        
+        # Turns the target into a list of [base_start, base_end, tokens] hunks that
+        # make the target when they replace those parts of the base.
+        def hunks(target)
+            tokens, matches = @gen ? @gen.align(target) : [target.scan(@pattern), []]
+            hunks = []
+            tgt_pos = 0
+            base_pos = 0
+            
+            # the extra match at the end picks up whatever is after the last real one
+            (matches + [[tokens.length, @base_tokens.length, 0]]).each do |tgt_start, base_start, length|
+                if tgt_start > tgt_pos or base_start > base_pos
+                    hunks << [base_pos, base_start, tokens[tgt_pos ... tgt_start]]
+                end
+                
+                tgt_pos = tgt_start + length
+                base_pos = base_start + length
+            end
+            
+            return hunks
+        end
+    end
+    
+    
     # Simply reads in a delta from the a data source (IO like) and then sends the events to 
     # an emitter.  One limitation of the DeltaReader is that the String#unpack function does
     # not allow an efficient streaming input.  This means it has to use fixed size records instead
@@ -282,6 +633,12 @@ module SuffixArrayDelta
                 if c == FileEmitter::MATCH
                     length = delta.read(4).unpack("V")[0]
                     emitter.match i,length
+                elsif c == FileEmitter::PATCH
+                    length, count = delta.read(8).unpack("VV")
+                    values = delta.read(count * 5).unpack("VC" * count)
+                    patches = []
+                    count.times { |n| patches << values[n * 2, 2] }
+                    emitter.patch i,length,patches
                 elsif c == FileEmitter::INSERT
                     data = delta.read(i)
                     emitter.insert 0,i,data
@@ -297,11 +654,11 @@ module SuffixArrayDelta
     
     # A Convenience method that takes a source data set (String like), a target data set (String like)
     # and an output target (IO like).  It then wires together all of the objects in SuffixArrayDelta
-    # required to create a delta and write it to output.
+    # required to create a delta and write it to output.  The SuffixArray is left for the
+    # DeltaGenerator to build, so it isn't built at all when the blocks match everything.
     ### @export "resume"
     def make_delta(source, target, output)
-        sa = SuffixArray.new(source)
-        gen = DeltaGenerator.new(sa, source)
+        gen = DeltaGenerator.new(nil, source)
         emitter = FileEmitter.new(output, should_close=false)
         gen.generate(target, emitter)
         return [emitter.match_count, emitter.match_total, 
@@ -309,6 +666,25 @@ module SuffixArrayDelta
     end
     ### @end
     
+    
+    # Just like make_delta, but uses the TokenDeltaGenerator to make the delta in units of
+    # whatever the pattern matches (lines by default).  The output is read with apply_delta
+    # like any other delta.
+    def make_token_delta(source, target, output, pattern=TokenDeltaGenerator::LINES)
+        gen = TokenDeltaGenerator.new(source, pattern)
+        emitter = FileEmitter.new(output, should_close=false)
+        gen.generate(target, emitter)
+        return [emitter.match_count, emitter.match_total, 
+            emitter.insert_count, emitter.insert_total]
+    end
+    
+    
+    # A quick guess at whether the data is text, which is true if there's no \0 in
+    # the first few thousand bytes (the same trick diff and friends use).
+    def text?(data)
+        return data[0, 8000].index("\0") == nil
+    end
+    
 
     # A Convenience method that takes a source data set (String like), a delta input source (IO like),
     # and an output source (IO like).  It then wires together the necessary SuffixArrayDelta objects
@@ -0,0 +1,104 @@
+require 'test/unit'
+require 'fastcst/codec'
+require 'fastcst/data_file'
+require 'fileutils'
+
+module UnitTest
+
+    class CodecTest < Test::Unit::TestCase
+
+        def setup
+            @samples = ["", "a", "abcd" * 1000, (1 .. 5000).collect { |i| "line #{i % 97}\n" }.join,
+                (0 ... 20000).collect { |i| ((i * 7919) % 251).chr }.join, File.read(__FILE__)]
+        end
+
+        def test_lz_codec
+            @samples.each do |data|
+                assert_equal data, LZCodec.decompress(LZCodec.compress(data), data.length)
+            end
+
+            assert LZCodec.compress("abcd" * 1000).length < 100
+            assert_raises(LZError) { LZCodec.decompress("\xff\x00", 10) }
+            assert_raises(LZError) { LZCodec.decompress(LZCodec.compress("abcd" * 100), 399) }
+            # a length no block that size could make is refused without allocating it
+            assert_raises(LZError) { LZCodec.decompress("\xff\x00", 1 << 40) }
+            data = "a" * 100000
+            assert_equal data, LZCodec.decompress(LZCodec.compress(data), data.length)
+        end
+
+        def test_codecs
+            ["zlib", "zlib:1", "zlib:9", "lz", "store"].each do |name|
+                codec = ChangeSet::Codec.get(name)
+                assert_equal name, codec.name
+
+                @samples.each do |data|
+                    assert_equal data, codec.decompress(codec.compress(data), data.length)
+
+                    compressor = codec.compressor
+                    packed = (compressor << data[0, 100]) + (compressor << data[100 .. -1].to_s) + compressor.finish
+                    assert_equal data, codec.decompress(packed, data.length)
+                end
+            end
+
+            ["zlib", "store"].each do |name|
+                codec = ChangeSet::Codec.get(name)
+                assert_raises(LZError) { codec.decompress(codec.compress("abcd" * 100), 399) }
+            end
+            assert_raises(LZError) { ChangeSet::Codec.get("zlib").decompress("\xff\x00", 10) }
+
+            assert_raises(RuntimeError) { ChangeSet::Codec.get("zlib:10") }
+            assert_raises(RuntimeError) { ChangeSet::Codec.get("bzip2") }
+        end
+
+        def test_files
+            journal = "test/codec.journal.gz"
+            data = "test/codec.fcs"
+
+            begin
+                ["zlib:9", "lz", "store"].each do |name|
+                    out = ChangeSet.create_journal(journal, name)
+                    out.write @samples[3]
+                    out.close
+                    assert_equal @samples[3], ChangeSet.open_journal(journal).read
+                    assert_equal [0x1f, 0x8b], File.open(journal, "rb") { |f| f.read(2).unpack("CC") }, "Journals are always gzip"
+
+                    writer = ChangeSet::DataWriter.new(File.open(data, "wb"), name)
+                    @samples.each_with_index do |sample, i|
+                        writer.write sample
+                        writer.end_entry "./#{i}"
+                    end
+                    writer.close
+
+                    reader = ChangeSet.open_data(data)
+                    assert_equal name, reader.codec.name
+                    assert_equal @samples.join, reader.read(@samples.join.length)
+                    assert_equal @samples[4], reader.read_entry("./4")
+                    reader.close
+                end
+            ensure
+                FileUtils.rm_f [journal, data]
+            end
+        end
+
+        def test_old_data_files
+            data = "test/codec_old.fcs"
+
+            begin
+                # FCSTDAT2 had a 32 bit compressed length in the table of contents
+                header = ChangeSet::DATA2_MAGIC + [5].pack("V") + "store"
+                toc = [1, 3].pack("VV") + "./a" + [header.length, 0, 5, 5, 0].pack("VVVVV") + Digest::MD5.digest("hello")
+                File.open(data, "wb") do |out|
+                    out.write header + "hello" + toc
+                    out.write [header.length + 5, 0].pack("VV") + ChangeSet::TOC_MAGIC
+                end
+
+                reader = ChangeSet.open_data(data)
+                assert_equal 5, reader.entry("./a").compressed
+                assert_equal "hello", reader.read_entry("./a")
+                reader.close
+            ensure
+                FileUtils.rm_f data
+            end
+        end
+    end
+end
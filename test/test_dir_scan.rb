@@ -0,0 +1,56 @@
+require 'test/unit'
+require 'dir_scan'
+require 'find'
+require 'set'
+require 'fileutils'
+
+module UnitTest
+    
+    class DirScanTest < Test::Unit::TestCase
+    
+        def setup
+            @dir = "test/scan"
+            FileUtils.rm_rf @dir
+            FileUtils.mkdir_p [File.join(@dir, "a", "b"), File.join(@dir, ".hidden"), File.join(@dir, "CVS")]
+            File.open(File.join(@dir, "top.txt"), "w") { |out| out.write "top" }
+            File.open(File.join(@dir, "a", "b", "deep.txt"), "w") { |out| out.write "deeper" }
+            File.open(File.join(@dir, ".hidden", "nope.txt"), "w") { |out| out.write "nope" }
+            File.open(File.join(@dir, "CVS", "Entries"), "w") { |out| out.write "nope" }
+            File.open(File.join(@dir, ".dotfile"), "w") { |out| out.write "nope" }
+        end
+        
+        def teardown
+            FileUtils.rm_rf @dir
+        end
+        
+        def test_scan
+            files, dirs = DirScan.scan(@dir)
+            
+            assert_equal ["./a/b/deep.txt", "./top.txt"], files.keys.sort
+            assert_equal [".", "./a", "./a/b"], dirs.sort
+            
+            size, mtime, inode = files["./top.txt"]
+            stat = File.stat(File.join(@dir, "top.txt"))
+            assert_equal 3, size
+            assert_equal stat.mtime.to_i, mtime.to_i
+            assert_equal stat.ino, inode
+        end
+        
+        def test_threads
+            # any number of threads has to give the same answer as Find.find
+            found = Set.new
+            Find.find("lib") { |f| found << f.sub(/^lib/, ".") if File.file?(f) }
+            
+            [1, 3, 16].each do |threads|
+                files, dirs = DirScan.scan("lib", threads)
+                assert_equal found, Set.new(files.keys)
+            end
+        end
+        
+        def test_bad_dir
+            assert_raises DSError do
+                DirScan.scan("test/not_there")
+            end
+        end
+    end
+end
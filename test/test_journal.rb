@@ -0,0 +1,85 @@
+require 'test/unit'
+require 'fastcst/journal'
+require 'stringio'
+require 'yaml'
+
+module UnitTest
+
+    class JournalTest < Test::Unit::TestCase
+
+        def setup
+            @records = [
+                ["delete", {:path => "./src/gone.c", :digest => "0123456789abcdef0123456789abcdef"}],
+                ["move", {:path => "./src/old.c", :to_path => "./lib/new.c", :digest => "ffffffffffffffffffffffffffffffff",
+                    :mtime => Time.at(1000, 250)}],
+                ["create", {:path => "./src/link", :symlink_target => "gone.c", :mtime => Time.at(2000), :digest => "not hex"}],
+                ["create", {:path => "top", :length => 2**40 + 7, :mtime => Time.at(3000)}],
+                ["create", {:path => "old", :mtime => Time.at(-86400, 5)}],
+                ["create", {:path => "later", :mtime => Time.at(2**33 + 1)}],
+                ["delta", {:path => "./src/old.c", :length => 0, :symlink => true, :delta_mode => "lines", :extra => nil}],
+                ["directory", {:deleted_dirs => ["./src", "./src/sub"], :created_dirs => []}],
+            ]
+        end
+
+        def write_binary(records)
+            out = StringIO.new
+            writer = ChangeSet::JournalWriter.new(out)
+            records.each { |type, info| writer.write_operation(type, info) }
+            out.string
+        end
+
+        def test_round_trip
+            data = write_binary(@records)
+            assert_equal @records, JournalReader.parse(data)
+
+            read = []
+            ChangeSet.each_operation(StringIO.new(data)) { |record| read << record }
+            assert_equal @records, read
+        end
+
+        def test_interned_paths
+            one = write_binary([["delete", {:path => "./some/long/directory/a.c"}]])
+            two = write_binary([["delete", {:path => "./some/long/directory/a.c"}], ["delete", {:path => "./some/long/directory/b.c"}]])
+
+            # the second record only has the directory number
+            assert two.length - one.length < one.length - JournalReader::MAGIC.length
+            assert_equal "./some/long/directory/b.c", JournalReader.parse(two)[1][1][:path]
+        end
+
+        def test_yaml_journals
+            out = StringIO.new
+            @records.each { |record| YAML.dump(record, out); out.write "\n" }
+
+            read = []
+            ChangeSet.each_operation(StringIO.new(out.string)) { |record| read << record }
+            assert_equal @records, read
+
+            # and a binary journal exports to the same YAML documents
+            exported = StringIO.new
+            ChangeSet.export_journal(StringIO.new(write_binary(@records)), exported)
+            read = []
+            ChangeSet.each_operation(StringIO.new(exported.string)) { |record| read << record }
+            assert_equal @records, read
+        end
+
+        def test_damaged
+            data = write_binary(@records)
+
+            assert_raises(JRError) { JournalReader.parse("FCSTJRN0" + data[8 .. -1]) }
+            assert_raises(JRError) { JournalReader.parse(data[0 .. -2]) }
+            assert_raises(RuntimeError) { write_binary([["rename", {}]]) }
+            assert_raises(RuntimeError) { write_binary([["delete", {:path => Object.new}]]) }
+
+            # arrays nested too deep, and an array longer than what's left
+            nested = []
+            (JournalReader::MAX_DEPTH - 1).times { nested = [nested] }
+            assert_equal [["directory", {:deleted_dirs => nested}]], JournalReader.parse(write_binary([["directory", {:deleted_dirs => nested}]]))
+            assert_raises(RuntimeError) { write_binary([["directory", {:deleted_dirs => [nested]}]]) }
+            deep = "a" + [1].pack("V")
+            body = [5, 1, 9].pack("CCC") + deep * 100000 + "a" + [0].pack("V")
+            assert_raises(JRError) { JournalReader.parse(JournalReader::MAGIC + [body.length].pack("V") + body) }
+            body = [5, 1, 9].pack("CCC") + "a" + [0xffffffff].pack("V") + "N"
+            assert_raises(JRError) { JournalReader.parse(JournalReader::MAGIC + [body.length].pack("V") + body) }
+        end
+    end
+end
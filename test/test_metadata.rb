@@ -1,5 +1,6 @@
 require 'test/unit'
 require 'fastcst/metadata'
+require 'fileutils'
 
 include SuffixArrayDelta
 
@@ -21,6 +22,73 @@ module UnitTest
             assert_not_nil md
         end
     
+        def test_load_cache
+            md = MetaData.load_metadata(@md_file, true)
+            cache = MetaData.cache_file(@md_file)
+            assert File.exist?(cache)
+
+            # callers get their own copy
+            md['Revision'] = "changed"
+            assert_equal "test", MetaData.load_metadata(@md_file)['Revision']
+
+            # a fresh process would read the sidecar, so fake one with a bad YAML file
+            stat = File.stat(@md_file)
+            good = File.read(@md_file)
+            File.open(@md_file, "w") { |out| out.write "--- [not: the, same" + " " * (stat.size - 19) }
+            File.utime(stat.atime, stat.mtime, @md_file)
+            MetaData.instance_variable_get(:@loaded).clear
+            assert_equal "test", MetaData.load_metadata(@md_file, true)['Revision']
+
+            # another file with the same size and mtime renamed over it isn't the cached one
+            other = @md_file + ".other"
+            File.open(other, "w") { |out| out.write good.sub("Revision: test", "Revision: tset") }
+            File.utime(stat.atime, stat.mtime, other)
+            File.rename(other, @md_file)
+            MetaData.instance_variable_get(:@loaded).clear
+            assert_equal "tset", MetaData.load_metadata(@md_file, true)['Revision']
+
+            # writing through update_md drops the cache
+            MetaData.create_metadata(@md_file, "test", "again", "test", "Zed A. Shaw", "zedshaw@zedshaw.com")
+            assert !File.exist?(cache)
+            MetaData.update_md(@md_file) { |md| md['Revision'] = "updated" }
+            assert_equal "updated", MetaData.load_metadata(@md_file, true)['Revision']
+        ensure
+            File.unlink cache if File.exist? cache
+        end
+
+        def test_digests
+            big = ["test/digest1.bin", "test/digest2.bin", "test/digest3.bin"]
+            begin
+                big.each_with_index do |file, i|
+                    File.open(file, "wb") { |out| out.write((i.to_s * 1024) * (MetaData::PARALLEL_DIGEST_SIZE / 1024 + 1)) }
+                end
+                files = [["test/case3.h", "md5"], [big[0], "md5"], [big[1], "crc32"], ["test/case4.h", "crc32"], [big[2], "md5"]]
+
+                expected = files.collect do |path, checksum|
+                    data = File.open(path, "rb") { |f| f.read }
+                    checksum == "md5" ? Digest::MD5.hexdigest(data) : "%08x" % Zlib.crc32(data)
+                end
+                assert_equal expected, MetaData.file_digests(files)
+                # fewer workers than big files, so one of them does two
+                assert_equal expected, MetaData.file_digests(files, 2)
+                assert_raises(RuntimeError) { MetaData.file_digest("test/case3.h", "sha0") }
+
+                # a crc32 entry is checked with crc32 and still catches changes
+                MetaData.add_file(@md_file, big[1], "data", "crc32")
+                md = MetaData.load_metadata(@md_file)
+                assert_equal "crc32", md['Contents'].last['Checksum']
+                assert_equal [], MetaData.verify_digests(".", md, true)
+
+                # but only for a changeset made here, a sender can't pick it
+                assert_equal [big[1]], MetaData.verify_digests(".", md)
+
+                File.open(big[1], "r+b") { |out| out.write "x" }
+                assert_equal [big[1]], MetaData.verify_digests(".", md, true)
+            ensure
+                FileUtils.rm_f big
+            end
+        end
+
         def finish_metadata
             parent_id = "112112212122112"
             MetaData.finish_metadata(@md_file, parent_id, "test/case3.h", "test/case4.h")
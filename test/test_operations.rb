@@ -128,6 +128,45 @@ module UnitTest
         end
         
         
+        def test_delta_merge
+            base = (1 .. 30).collect { |i| "line #{i}\n" }.join
+            theirs = base.sub("line 20\n", "line twenty\n")
+            ours = base.sub("line 2\n", "line two\n")
+
+            Dir.mkdir("test/delta")
+            File.open("test/delta/#{@test_file}", "w") { |f| f.write(base) }
+            File.open(@test_file_path, "w") { |f| f.write(theirs) }
+            File.utime(Time.now, Time.at(1000), @test_file_path)
+
+            info = {:source => "test/delta", :path => @test_file, :digest => Digest::MD5.hexdigest(base) }
+            DeltaOperation.new(info, @test_dir).store(@journal_out, @data_out)
+            delta = @data_out.string
+
+            # our file changed somewhere else, so it merges
+            File.open(@test_file_path, "w") { |f| f.write(ours) }
+            op = DeltaOperation.new(info, @test_dir)
+            assert_equal(-1, op.merge)
+            assert_equal 1, op.merge_with_base(base, delta)
+            @data_out.rewind
+            assert op.run(@data_out)
+            assert_equal theirs.sub("line 2\n", "line two\n"), File.read(@test_file_path)
+            assert_equal 1000, File.mtime(@test_file_path).to_i
+            assert @data_out.eof?
+
+            # changing the same line doesn't
+            File.open(@test_file_path, "w") { |f| f.write(base.sub("line 20\n", "line XX\n")) }
+            op = DeltaOperation.new(info, @test_dir)
+            assert_equal(-1, op.merge_with_base(base, delta))
+            assert_equal [[20, 20]], op.conflicts
+
+            # and plain apply refuses a file that isn't the delta's reference
+            @data_out.rewind
+            assert !op.run(@data_out)
+            assert @data_out.eof?
+            assert_equal base.sub("line 20\n", "line XX\n"), File.read(@test_file_path)
+        end
+
+
         def test_directory
             FileUtils.mkdir_p("test/dirs1/deleted")
             FileUtils.mkdir_p("test/dirs2/created")
@@ -152,5 +191,47 @@ module UnitTest
             FileUtils.rm_rf("test/dirs2/created")
             
         end
+        
+        
+        def test_data_file
+            data_file = "test/temp.fcs"
+            files = {"one.file" => "first file " * 100, "two.file" => "second", "three.file" => "third file " * 50}
+            files.each { |f, data| File.open(File.join(@test_dir, f), "w") { |out| out.write data } }
+            
+            begin
+                data_out = DataWriter.new(File.open(data_file, "wb"))
+                ["one.file", "two.file", "three.file"].each do |f|
+                    CreateOperation.new({:path => f}, @test_dir).store(@journal_out, data_out)
+                end
+                # no payload so no entry
+                DeleteOperation.new({:path => "gone.file"}, @test_dir).store(@journal_out, data_out)
+                data_out.close
+                
+                # jump straight to a payload
+                data_in = ChangeSet.open_data(data_file)
+                assert_equal ["one.file", "two.file", "three.file"], data_in.entries.collect { |e| e.path }
+                assert_equal files["three.file"], data_in.read_entry("three.file")
+                assert_nil data_in.entry("gone.file")
+                data_in.close
+                
+                # or read it in order, skipping the first one
+                data_in = ChangeSet.open_data(data_file)
+                data_in.seek(files["one.file"].length, IO::SEEK_CUR)
+                assert_equal files["two.file"] + files["three.file"][0,5], data_in.read(files["two.file"].length + 5)
+                assert_equal files["three.file"][5 .. -1], data_in.read(files["three.file"].length - 5)
+                assert_equal "", data_in.read(10)
+                data_in.close
+                
+                # a damaged block is caught
+                contents = File.open(data_file, "rb") { |f| f.read }
+                entry = ChangeSet.open_data(data_file).entry("two.file")
+                contents[entry.offset, entry.compressed] = Zlib::Deflate.new(Zlib::DEFAULT_COMPRESSION, -Zlib::MAX_WBITS).deflate("SECOND", Zlib::FINISH)[0, entry.compressed].ljust(entry.compressed, "\0")
+                File.open(data_file, "wb") { |out| out.write contents }
+                assert_raises(RuntimeError, Zlib::Error) { ChangeSet.open_data(data_file).read_entry("two.file") }
+            ensure
+                File.unlink data_file if File.exist? data_file
+                files.each_key { |f| File.unlink File.join(@test_dir, f) }
+            end
+        end
     end
 end
\ No newline at end of file
@@ -33,14 +33,14 @@ module UnitTest
             assert_not_nil repo
             assert_not_nil repo.path
             assert_not_nil repo.env_yaml
-            assert_not_nil repo.originals_dir
+            assert_not_nil repo.objects_dir
             assert_not_nil repo.pending_mbox
             assert_not_nil repo.root_dir
         
             # check that all the right files are there
             assert File.exists?(repo.path)
             assert File.exists?(repo.env_yaml)
-            assert File.exists?(repo.originals_dir)
+            assert File.exists?(repo.objects_dir)
             assert File.exists?(repo.pending_mbox)
             assert File.exists?(repo.root_dir)
         end
@@ -113,6 +113,676 @@ module UnitTest
         end
        
     
+        # Builds a line of revisions the same way finish does and checks that every
+        # one of them checks out right with only a few changesets after a snapshot.
+        def test_snapshots
+            repo = Repository::Repository.new @repo_dir
+            repo['Snapshot Interval'] = "2"
+            prev_dir = File.expand_path("test/snap_prev")
+            next_dir = File.expand_path("test/snap_next")
+            FileUtils.rm_rf [prev_dir, next_dir]
+            FileUtils.mkdir_p [prev_dir, next_dir]
+            
+            parent = "NONE"
+            expected = {}
+            
+            begin
+                6.times do |i|
+                    File.open(File.join(next_dir, "common.txt"), "w") { |out| out.write "line\n" * 50 + "rev #{i}\n" }
+                    File.open(File.join(next_dir, "file#{i}.txt"), "w") { |out| out.write "created in #{i}\n" }
+                    Dir.glob(File.join(next_dir, "*")).each { |f| File.utime(Time.now, Time.at(1000 + i), f) }
+                    
+                    Dir.chdir repo.work_dir do
+                        ChangeSet.make_changeset("rev#{i}", prev_dir, next_dir)
+                        MetaData.create_metadata(MetaData::META_DATA_FILE, "test", "rev#{i}", "testing", "tester", "test@test.com")
+                        MetaData.finish_metadata(MetaData::META_DATA_FILE, parent, "rev#{i}.fcs", "rev#{i}#{ChangeSet::JOURNAL_FILE_SUFFIX}")
+                    end
+                    
+                    md = repo.store_changeset repo.work_dir, MetaData::META_DATA_FILE, move=true
+                    parent = md['ID']
+                    
+                    cs_path, md = repo.find_changeset(parent)
+                    failures = repo.apply_to_originals(File.join(cs_path, "rev#{i}#{ChangeSet::JOURNAL_FILE_SUFFIX}"), File.join(cs_path, "rev#{i}.fcs"))
+                    assert_equal 0, failures
+                    
+                    FileUtils.rm_rf prev_dir
+                    FileUtils.cp_r next_dir, prev_dir, :preserve => true
+                    repo.store_snapshot(parent) if repo.snapshot_due?(parent)
+                    
+                    expected[parent] = Dir.glob(File.join(next_dir, "*")).collect { |f| [File.basename(f), File.read(f)] }.sort
+                    
+                    # the originals should now be the same as what was committed
+                    index = repo.stat_index
+                    assert_equal expected[parent].collect { |f, data| "./" + f }, index.files.keys.sort
+                    expected[parent].each do |f, data|
+                        assert_equal Digest::MD5.digest(data), index.digest("./" + f)
+                        assert_equal Time.at(1000 + i), index.stat("./" + f)[1]
+                    end
+                end
+                
+                assert repo.list_changesets.find { |id| repo.has_snapshot? id }, "No snapshots were made"
+                
+                expected.each do |id, files|
+                    out_dir = "test/snap_out"
+                    FileUtils.rm_rf out_dir
+                    
+                    count = repo.checkout(id, out_dir)
+                    assert_not_nil count, "Checkout of #{id} failed"
+                    assert count <= 3, "Checkout applied #{count} changesets, snapshots should keep it under 3"
+                    
+                    result = Dir.glob(File.join(out_dir, "*")).collect { |f| [File.basename(f), File.read(f)] }.sort
+                    assert_equal files, result
+                end
+            ensure
+                FileUtils.rm_rf [prev_dir, next_dir, "test/snap_out"]
+            end
+        end
+        
+        
+        def test_packs
+            repo = Repository::Repository.new @repo_dir
+            repo['Snapshot Interval'] = "0"
+            prev_dir = File.expand_path("test/pack_prev")
+            next_dir = File.expand_path("test/pack_next")
+            FileUtils.rm_rf [prev_dir, next_dir]
+            FileUtils.mkdir_p [prev_dir, next_dir]
+
+            parent = "NONE"
+            ids = []
+
+            begin
+                4.times do |i|
+                    File.open(File.join(next_dir, "file#{i}.txt"), "w") { |out| out.write "created in #{i}\n" }
+                    Dir.chdir repo.work_dir do
+                        ChangeSet.make_changeset("rev#{i}", prev_dir, next_dir)
+                        MetaData.create_metadata(MetaData::META_DATA_FILE, "test", "rev#{i}", "testing", "tester", "test@test.com")
+                        MetaData.finish_metadata(MetaData::META_DATA_FILE, parent, "rev#{i}.fcs", "rev#{i}#{ChangeSet::JOURNAL_FILE_SUFFIX}")
+                    end
+
+                    parent = repo.store_changeset(repo.work_dir, MetaData::META_DATA_FILE, move=true, local=(i == 3))['ID']
+                    ids << parent
+                    FileUtils.rm_rf prev_dir
+                    FileUtils.cp_r next_dir, prev_dir, :preserve => true
+                end
+                assert_equal [false, false, false, true], ids.collect { |id| repo.local_changeset? id }
+
+                # an undo changeset stays behind in root
+                File.open(File.join(repo.root_dir, ids[1], "undo.fcs"), "w") { |out| out.write "undo" }
+
+                assert_equal 4, repo.pack_changesets
+                assert_equal 1, repo.packs.length
+                assert_equal [ids[1]], Dir.entries(repo.root_dir).grep(/^[a-zA-Z0-9]/)
+                assert_equal ["undo.fcs"], Dir.entries(File.join(repo.root_dir, ids[1])).grep(/^[a-zA-Z0-9]/)
+                assert_equal ids.sort, repo.list_changesets.sort
+                assert_equal 0, repo.pack_changesets, "Everything is already packed"
+
+                # the meta-data and revision tree come straight out of the pack
+                assert_equal "rev2", repo.metadata(ids[2])['Revision']
+                assert_equal ids[1], repo.find_parent_of(ids[2])
+                assert_equal [[ "rev3", ids[3] ]], repo.find_revision("rev3")
+                assert_equal [ids[3]], repo.find_all_children(ids[2])
+                assert !File.exist?(File.join(repo.root_dir, ids[2]))
+
+                # find_changeset writes the files back out
+                cs_path, md = repo.find_changeset(ids[2])
+                assert_equal [], MetaData.verify_digests(cs_path, md)
+                assert_equal "undo", repo.read_changeset_file(ids[1], "undo.fcs")
+                assert_not_nil repo.read_changeset_file(ids[0], "rev0.fcs")
+                assert_nil repo.read_changeset_file(ids[0], "../env.yaml")
+
+                out_dir = "test/pack_out"
+                FileUtils.rm_rf out_dir
+                assert_equal 4, repo.checkout(ids[3], out_dir)
+                assert_equal "created in 3\n", File.read(File.join(out_dir, "file3.txt"))
+                FileUtils.rm_rf out_dir
+
+                # deleting only takes it out of the index until everything is repacked
+                repo.delete_changeset(ids[3])
+                assert !repo.has_changeset?(ids[3])
+                assert_equal 3, repo.pack_changesets(true)
+                assert_equal 1, repo.packs.length
+                assert_equal ids[0 .. 2].sort, repo.list_changesets.sort
+                assert !File.exist?(File.join(repo.root_dir, ids[2]))
+            ensure
+                FileUtils.rm_rf [prev_dir, next_dir, "test/pack_out"]
+            end
+        end
+
+
+        def test_ancestry
+            index = Repository::RevisionIndex.new(File.join(@repo_dir, "ancestry.index"))
+            add = lambda { |id, parent| index.add({ 'ID' => id, 'Parent ID' => parent, 'Revision' => id }, false) }
+
+            # a long trunk with a branch off of t50 and a second root
+            add.call("t0", "NONE")
+            1.upto(200) { |i| add.call("t#{i}", "t#{i - 1}") }
+            add.call("b0", "t50")
+            1.upto(30) { |i| add.call("b#{i}", "b#{i - 1}") }
+            add.call("other", "NONE")
+
+            assert_equal 0, index.depth("t0")
+            assert_equal 200, index.depth("t200")
+            assert_equal 81, index.depth("b30")
+            assert_equal "t37", index.ancestor_at("t200", 37)
+            assert_nil index.ancestor_at("t10", 11)
+
+            assert index.ancestor?("t0", "b30")
+            assert index.ancestor?("t50", "b3")
+            assert index.ancestor?("b3", "b3")
+            assert !index.ancestor?("t51", "b3")
+            assert !index.ancestor?("other", "t3")
+
+            assert_equal "t50", index.common_ancestor("t200", "b30")
+            assert_equal "t50", index.common_ancestor("b0", "t51")
+            assert_equal "t20", index.common_ancestor("t20", "t199")
+            assert_equal "b5", index.common_ancestor("b30", "b5")
+            assert_nil index.common_ancestor("other", "b1")
+
+            # new leaves are linked as they come and other changes start over
+            add.call("b31", "b30")
+            assert_equal 82, index.depth("b31")
+            assert_equal "t50", index.common_ancestor("b31", "t60")
+            index.remove("b0")
+            assert_equal 0, index.depth("b1")
+            assert_nil index.common_ancestor("b31", "t60")
+        end
+
+
+        def test_revision_index
+            repo = Repository::Repository.new @repo_dir
+            ids = []
+
+            # a root with two children that have the same revision name
+            [["base", "NONE"], ["same", 0], ["same", 0], ["next", 1]].each do |rev, parent|
+                Dir.chdir repo.work_dir do
+                    MetaData.create_metadata(MetaData::META_DATA_FILE, "test", rev, "testing", "tester", "test@test.com")
+                    MetaData.update_md(MetaData::META_DATA_FILE) do |md|
+                        md['Parent ID'] = parent == "NONE" ? parent : ids[parent]
+                    end
+                end
+                ids << repo.store_changeset(repo.work_dir, MetaData::META_DATA_FILE, move=true)['ID']
+            end
+
+            index_file = File.join(repo.path, Repository::Repository::REVISION_INDEX)
+            assert File.exist?(index_file)
+
+            # a new repository reads it all from the index
+            other = Repository::Repository.new @repo_dir
+            assert_equal 4, other.revision_index.length
+            assert_equal ids[0], other.find_parent_of(ids[2])
+            assert_equal ids[1 .. 2].sort, other.find_all_children(ids[0]).sort
+            assert_equal [["next", ids[3]]], other.find_revision("next")
+            assert_equal repo.revision_tree, other.revision_tree
+            assert_equal "base", other.build_readable_name(ids[0])
+            assert_match(/^same-/, other.build_readable_name(ids[1]))
+            assert_equal "test@test.com", other.revision_index[ids[3]].email
+            assert_match(/^next -- #{ids[3]} -- test@test.com -- \d{4}-\d\d-\d\d /, other.summary_line(ids[3]))
+            assert_nil other.summary_line("missing")
+            assert_equal ids[1 .. 2].sort, other.find_revision("same").collect { |rev, id| id }.sort
+            assert_equal ["next"], other.complete_revision("n")
+            assert_equal ["base", "next", "same"], other.complete_revision("")
+            assert_equal [], other.complete_revision("x")
+
+            # deletes are appended and show up in a new repository
+            size = File.size(index_file)
+            repo.delete_changeset(ids[3])
+            assert File.size(index_file) > size
+            other = Repository::Repository.new @repo_dir
+            assert_equal [], other.find_all_children(ids[1])
+            assert_nil other.find_parent_of(ids[3])
+            assert_equal [], other.find_revision("next")
+            assert_equal [], repo.complete_revision("ne")
+
+            # an index with the repository's stamp is used without listing the changesets
+            other = Repository::Repository.new @repo_dir
+            def other.list_changesets
+                raise "the changesets shouldn't be listed"
+            end
+            assert_equal 3, other.revision_index.length
+
+            # a damaged index or one that's out of date is rebuilt
+            File.open(index_file, "ab") { |out| out.write "\001junk" }
+            assert_equal 3, Repository::Repository.new(@repo_dir).revision_index.length
+            FileUtils.rm_rf File.join(repo.root_dir, ids[2])
+            repo.next_revision_stamp  # like a delete that stopped before the index was stamped
+            assert_equal [ids[1]], Repository::Repository.new(@repo_dir).find_all_children(ids[0])
+            File.delete File.join(repo.path, Repository::Repository::REVISION_STAMP)
+            assert_equal 2, Repository::Repository.new(@repo_dir).revision_index.length
+        end
+
+
+        def test_object_store
+            repo = Repository::Repository.new @repo_dir
+            store = repo.object_store
+            
+            digest = store.store("some contents\n")
+            assert_equal Digest::MD5.hexdigest("some contents\n"), digest
+            assert store.has?(digest)
+            assert_equal digest, store.store("some contents\n"), "Same contents should give the same object"
+            assert_equal "some contents\n", store.read(digest)
+            
+            # it's all in the pack, and the index has it once it's flushed
+            store.flush
+            assert_equal [store.index_path, File.join(repo.objects_dir, "objects.lock"), store.pack_path], Dir.glob(File.join(repo.objects_dir, "*")).sort
+            other = store.store("other contents\n")
+            store.flush
+            assert_equal "some contents\n", Repository::ObjectStore.new(repo.objects_dir).read(digest)
+            
+            # two stores adding at the same time both end up in the index
+            first = Repository::ObjectStore.new(repo.objects_dir)
+            second = Repository::ObjectStore.new(repo.objects_dir)
+            assert first.has?(digest) and second.has?(digest)
+            one = first.store("from the first store\n")
+            two = second.store("from the second store\n")
+            first.flush
+            second.flush
+            both = Repository::ObjectStore.new(repo.objects_dir)
+            assert_equal "from the first store\n", both.read(one)
+            assert_equal "from the second store\n", both.read(two)
+            
+            # a lost index is made again from the pack
+            File.delete store.index_path
+            assert_equal "other contents\n", Repository::ObjectStore.new(repo.objects_dir).read(other)
+            
+            # loose objects from older repositories are read and can be packed
+            loose = Digest::MD5.hexdigest("loose contents\n")
+            store = repo.object_store
+            FileUtils.mkdir_p File.dirname(store.object_path(loose))
+            File.open(store.object_path(loose), "wb") { |out| out.write Zlib::Deflate.deflate("loose contents\n") }
+            assert_equal "loose contents\n", store.read(loose)
+            assert_equal 1, store.pack_loose
+            assert !File.exist?(store.object_path(loose))
+            assert_equal "loose contents\n", repo.object_store.read(loose)
+            
+            out = "test/object_out/sub/file.txt"
+            begin
+                store.materialize(digest, out, Time.at(1000))
+                assert_equal "some contents\n", File.read(out)
+                assert_equal Time.at(1000), File.mtime(out)
+            ensure
+                FileUtils.rm_rf "test/object_out"
+            end
+            
+            # damaged objects are caught when they're read
+            data = File.open(store.pack_path, "rb") { |f| f.read }
+            File.open(store.pack_path, "wb") { |out| out.write data.sub(Zlib::Deflate.deflate("some contents\n"), Zlib::Deflate.deflate("some Contents\n")) }
+            assert_raises(RuntimeError) { repo.object_store.read(digest) }
+        end
+        
+        
+        def test_stat_index
+            repo = Repository::Repository.new @repo_dir
+            
+            # an old style originals directory gets moved into the object store
+            orig = repo.originals_dir
+            work = "test/stat_work"
+            FileUtils.rm_rf work
+            FileUtils.mkdir_p [File.join(orig, "sub"), File.join(work, "sub")]
+            
+            begin
+                ["one.txt", "sub/two.txt", "sub/three.txt"].each do |f|
+                    File.open(File.join(orig, f), "w") { |out| out.write "contents of #{f}\n" }
+                    File.utime(Time.now, Time.at(1000), File.join(orig, f))
+                end
+                
+                index = repo.stat_index
+                assert !File.exist?(orig), "The originals directory should be gone"
+                assert_equal 3, index.files.length
+                assert index.dirs.include?("./sub")
+                assert_equal Digest::MD5.digest("contents of one.txt\n"), index.digest("./one.txt")
+                assert repo.object_store.has?(index.hexdigest("./sub/two.txt"))
+                
+                # the working copy can be made from the store alone
+                index.materialize(index.files.keys, work)
+                assert_equal "contents of sub/three.txt\n", File.read(File.join(work, "sub", "three.txt"))
+                
+                # touch one and really change another
+                File.utime(Time.now, Time.at(2000), File.join(work, "one.txt"))
+                File.open(File.join(work, "sub/two.txt"), "w") { |out| out.write "new stuff\n" }
+                
+                index = repo.stat_index
+                changes = repo.with_originals([]) do |originals|
+                    ChangeSet::ChangeSetBuilder.new(originals, work, index)
+                end
+                assert_equal ["./sub/two.txt"], changes.changed.keys
+                assert changes.deleted.empty?
+                assert changes.created.empty?
+                
+                # the touched file and the one with a new inode get their stats refreshed,
+                # so once the index is saved the next build doesn't hash them again
+                assert_equal ["./one.txt", "./sub/three.txt"], changes.refreshed.sort
+                assert_equal File.stat(File.join(work, "one.txt")).ino, index.stat("./one.txt")[2]
+                index.save
+                changes = repo.with_originals([]) do |originals|
+                    ChangeSet::ChangeSetBuilder.new(originals, work, repo.stat_index)
+                end
+                assert_equal ["./sub/two.txt"], changes.changed.keys
+                assert changes.refreshed.empty?
+                assert_equal 0, changes.bytes_read
+                
+                # a same size change is read once to check it and the delta uses that read
+                File.open(File.join(work, "sub/three.txt"), "w") { |out| out.write "contents of sub/3hree.txt\n" }
+                repo.with_originals(index.files.keys) do |originals|
+                    changes = ChangeSet::ChangeSetBuilder.new(originals, work, repo.stat_index)
+                    assert_equal ["./sub/three.txt", "./sub/two.txt"], changes.changed.keys.sort
+                    changes.write_changeset(StringIO.new, StringIO.new)
+                end
+                assert_equal 26 * 2 + 24 + 10, changes.bytes_read
+                
+                # a directory is only removed once nothing is left in it
+                index.add_dir("./sub/empty")
+                index.remove_dir("./sub")
+                assert index.dirs.include?("./sub")
+                index.remove("./sub/two.txt")
+                index.move("./sub/three.txt", "./three.txt", Time.at(1000))
+                index.remove_dir("./sub")
+                assert index.dirs.include?("./sub"), "./sub/empty is still there"
+                index.remove_dir("./sub/empty")
+                index.remove_dir("./sub")
+                assert !index.dirs.include?("./sub")
+                index.add("./sub/again.txt", "again", Time.at(1000))
+                index.remove_dir("./sub")
+                assert index.dirs.include?("./sub")
+                
+                # updating from a directory only hashes what changed
+                other = Repository::StatIndex.new(File.join(@repo_dir, "other.index"))
+                assert_equal 3, other.update(work)
+                assert_equal 0, other.update(work), "Nothing changed so nothing should be hashed"
+                
+                # a count that runs past the end is damage, not a crash, and nothing
+                # that needs the originals carries on with an empty index
+                data = File.open(index.path, "rb") { |f| f.read }
+                File.open(index.path, "wb") { |out| out.write data[0, data.length - 10] }
+                assert Repository::StatIndex.new(index.path).damaged?
+                File.open(index.path, "wb") { |out| out.write data[0, 8] + [1000].pack("V") }
+                assert Repository::StatIndex.new(index.path).damaged?
+                assert_raises(Repository::StatIndexDamaged) { repo.stat_index }
+                
+                # with nothing in the path the rebuild is just an empty index
+                assert repo.rebuild_stat_index
+                assert repo.stat_index.files.empty?
+            ensure
+                FileUtils.rm_rf work
+            end
+        end
+        
+        
+        def test_sync_originals
+            repo = Repository::Repository.new @repo_dir
+            orig = repo.originals_dir
+            work = "test/sync_work"
+            tgt = "test/sync_tgt"
+            FileUtils.rm_rf [work, tgt]
+            FileUtils.mkdir_p [File.join(orig, "sub"), File.join(tgt, "moved")]
+
+            begin
+                ["one.txt", "sub/two.txt", "sub/three.txt"].each do |f|
+                    File.open(File.join(orig, f), "w") { |out| out.write "contents of #{f}\n" * 20 }
+                    File.utime(Time.now, Time.at(1000), File.join(orig, f))
+                end
+                repo.stat_index.materialize(repo.stat_index.files.keys, work)
+
+                # change one, move one, delete one, and add one
+                File.open(File.join(tgt, "one.txt"), "w") { |out| out.write "contents of one.txt\n" * 19 + "changed\n" }
+                FileUtils.cp File.join(work, "sub", "two.txt"), File.join(tgt, "moved", "two.txt")
+                File.open(File.join(tgt, "four.txt"), "w") { |out| out.write "four" }
+
+                repo.with_originals(repo.stat_index.files.keys) { |scratch| ChangeSet.make_changeset("test/sync", scratch, tgt) }
+                journal_file = "test/sync" + ChangeSet::JOURNAL_FILE_SUFFIX
+                data_in = ChangeSet.open_data("test/sync" + ChangeSet::DATA_FILE_SUFFIX)
+                assert_equal 0, ChangeSet.apply_changeset(Zlib::GzipReader.new(File.open(journal_file)), data_in, work)
+
+                # the undo only has to look at what the changeset touched
+                touched = ChangeSet.journal_paths(Zlib::GzipReader.new(File.open(journal_file)))
+                assert_equal ["./four.txt", "./moved", "./moved/two.txt", "./one.txt", "./sub", "./sub/three.txt", "./sub/two.txt"], touched.sort
+                undo = repo.make_undo_changeset("test/sync_undo", work, touched)
+                assert_equal ["./four.txt"], undo.deleted.to_a
+                assert_equal ["./one.txt"], undo.changed.keys
+
+                assert repo.sync_originals(journal_file, work)
+
+                index = repo.stat_index
+                assert_equal ["./four.txt", "./moved/two.txt", "./one.txt"], index.files.keys.sort
+                index.files.keys.each do |f|
+                    assert_equal Digest::MD5.digest(File.read(File.join(tgt, f))), index.digest(f)
+                    assert repo.object_store.has?(index.hexdigest(f))
+                end
+                assert !index.dirs.include?("./sub")
+
+                # a created file that isn't what the changeset made leaves the index alone
+                File.open(File.join(work, "four.txt"), "w") { |out| out.write "someone else" }
+                assert !repo.sync_originals(journal_file, work)
+                assert_equal Digest::MD5.digest("four"), repo.stat_index.digest("./four.txt")
+
+                # and so does a changed file that isn't what the delta made
+                File.open(File.join(work, "four.txt"), "w") { |out| out.write "four" }
+                File.open(File.join(work, "one.txt"), "a") { |out| out.write "local edit\n" }
+                assert !repo.sync_originals(journal_file, work)
+
+                # a symlink delta can't be synced from the working directory
+                writer = ChangeSet::JournalWriter.new(ChangeSet.create_journal("test/sync_link" + ChangeSet::JOURNAL_FILE_SUFFIX))
+                writer.write_operation("delta", {:path => "./link", :length => 0, :symlink => true})
+                writer.close
+                assert !repo.sync_originals("test/sync_link" + ChangeSet::JOURNAL_FILE_SUFFIX, work)
+            ensure
+                FileUtils.rm_rf [work, tgt]
+                FileUtils.rm_f ["test/sync", "test/sync_undo", "test/sync_link"].collect { |cs| [cs + ChangeSet::JOURNAL_FILE_SUFFIX, cs + ChangeSet::DATA_FILE_SUFFIX] }.flatten
+            end
+        end
+
+
+        def test_digest_cache
+            src = "test/digest_src"
+            tgt = "test/digest_tgt"
+            FileUtils.rm_rf [src, tgt]
+            FileUtils.mkdir_p [File.join(src, "old"), File.join(tgt, "new")]
+            
+            begin
+                files = {
+                    File.join(src, "gone.txt") => "deleted\n",
+                    File.join(src, "old", "moved.txt") => "moved\n" * 10,
+                    File.join(tgt, "new", "moved.txt") => "moved\n" * 10,
+                    File.join(src, "changed.txt") => "before\n" * 20,
+                    File.join(tgt, "changed.txt") => "after\n" * 20,
+                    File.join(tgt, "created.txt") => "created\n",
+                }
+                files.each { |f, data| File.open(f, "w") { |out| out.write data } }
+                File.utime(Time.now, Time.at(1000), File.join(src, "changed.txt"))
+                
+                changes = ChangeSet::ChangeSetBuilder.new(src, tgt)
+                changes.detect_moved_files
+                assert_equal ["./old/moved.txt"], changes.moved.keys
+                
+                journal_out = StringIO.new
+                changes.write_changeset(journal_out, StringIO.new)
+                
+                # every file is read exactly once
+                total = files.values.inject(0) { |sum, data| sum + data.length }
+                assert_equal total, changes.bytes_read
+                
+                journal_out.rewind
+                YAML.each_document(journal_out) do |info|
+                    next if info[0] == ChangeSet::DirectoryOperation::TYPE
+                    dir = info[0] == ChangeSet::CreateOperation::TYPE ? tgt : src
+                    file = File.join(dir, info[1][:path][2 .. -1])
+                    assert_equal Digest::MD5.hexdigest(files[file]), info[1][:digest], "Wrong digest for #{file}"
+                end
+            ensure
+                FileUtils.rm_rf [src, tgt]
+            end
+        end
+        
+        
+        def test_partial_apply
+            src = "test/partial_src"
+            tgt = "test/partial_tgt"
+            out = "test/partial_out"
+            FileUtils.rm_rf [src, tgt, out]
+            FileUtils.mkdir_p [File.join(src, "a"), File.join(src, "b"), File.join(tgt, "a", "new"), File.join(tgt, "b")]
+            
+            begin
+                ["a/one.txt", "b/two.txt"].each do |f|
+                    File.open(File.join(src, f), "w") { |o| o.write "old #{f}\n" * 10 }
+                    File.open(File.join(tgt, f), "w") { |o| o.write "new #{f}\n" * 10 }
+                    File.utime(Time.now, Time.at(1000), File.join(src, f))
+                end
+                File.open(File.join(tgt, "a", "new", "three.txt"), "w") { |o| o.write "three" }
+                File.open(File.join(tgt, "b", "four.txt"), "w") { |o| o.write "four" }
+                FileUtils.cp_r src, out, :preserve => true
+                
+                ChangeSet.make_changeset("test/partial", src, tgt)
+                journal_in = Zlib::GzipReader.new(File.open("test/partial" + ChangeSet::JOURNAL_FILE_SUFFIX))
+                data_in = ChangeSet.open_data("test/partial" + ChangeSet::DATA_FILE_SUFFIX)
+                only = ChangeSet::PathSpec.new(["a/"])
+                assert_equal 0, ChangeSet.apply_changeset(journal_in, data_in, out, false, only)
+                
+                assert_equal File.read(File.join(tgt, "a", "one.txt")), File.read(File.join(out, "a", "one.txt"))
+                assert_equal "three", File.read(File.join(out, "a", "new", "three.txt"))
+                assert_equal File.read(File.join(src, "b", "two.txt")), File.read(File.join(out, "b", "two.txt"))
+                assert !File.exist?(File.join(out, "b", "four.txt"))
+                
+                globs = ChangeSet::PathSpec.new(["*/*.txt", "./c"])
+                assert globs.match?("./b/two.txt")
+                assert globs.match?("./c/deep/file")
+                assert !globs.match?("./a/new/three.txt")
+                assert !globs.match?("./cc")
+            ensure
+                FileUtils.rm_rf [src, tgt, out]
+                FileUtils.rm_f ["test/partial" + ChangeSet::JOURNAL_FILE_SUFFIX, "test/partial" + ChangeSet::DATA_FILE_SUFFIX]
+            end
+        end
+        
+        
+        def test_parallel_apply
+            src = "test/parallel_src"
+            tgt = "test/parallel_tgt"
+            out = "test/parallel_out"
+            FileUtils.rm_rf [src, tgt, out]
+            FileUtils.mkdir_p [File.join(src, "old"), File.join(tgt, "new")]
+            
+            begin
+                20.times do |i|
+                    File.open(File.join(src, "old", "f#{i}.txt"), "w") { |o| o.write "old #{i}\n" * 50 }
+                    File.open(File.join(tgt, "new", "f#{i}.txt"), "w") { |o| o.write "new #{i}\n" * 50 }
+                    File.open(File.join(tgt, "g#{i}.txt"), "w") { |o| o.write "#{i}" }
+                end
+                FileUtils.cp_r src, out, :preserve => true
+                
+                ChangeSet.make_changeset("test/parallel", src, tgt)
+                journal = "test/parallel" + ChangeSet::JOURNAL_FILE_SUFFIX
+                data = "test/parallel" + ChangeSet::DATA_FILE_SUFFIX
+                
+                batches = ChangeSet::ParallelApply.new.batches(Zlib::GzipReader.new(File.open(journal)))
+                assert_equal "directory", batches.last[0][0], "Directory operations run last by themselves"
+                batches.each do |batch|
+                    paths = batch.map { |type, info| info[:path] }
+                    assert_equal paths.uniq, paths, "A path shows up once per batch"
+                end
+                
+                journal_in = Zlib::GzipReader.new(File.open(journal))
+                assert_equal 0, ChangeSet.apply_changeset(journal_in, ChangeSet.open_data(data), out, false, nil, 4)
+                
+                20.times do |i|
+                    assert_equal File.read(File.join(tgt, "new", "f#{i}.txt")), File.read(File.join(out, "new", "f#{i}.txt"))
+                    assert_equal "#{i}", File.read(File.join(out, "g#{i}.txt"))
+                end
+                assert !File.exist?(File.join(out, "old"))
+                assert_equal [], Dir.glob(File.join(out, "**", "*.tmp"))
+            ensure
+                FileUtils.rm_rf [src, tgt, out]
+                FileUtils.rm_f ["test/parallel" + ChangeSet::JOURNAL_FILE_SUFFIX, "test/parallel" + ChangeSet::DATA_FILE_SUFFIX]
+            end
+        end
+        
+        
+        def test_dirty_journal
+            repo = Repository::Repository.new @repo_dir
+            journal = repo.dirty_journal
+            
+            assert_nil journal.read[0], "No watcher means a full scan"
+            
+            # a pid file nobody holds the lock on is stale, even if the pid is running
+            File.open(journal.pid_file, "w") { |out| out.write $$.to_s }
+            assert !journal.watching?
+            
+            # pretend we're the watcher
+            lock = journal.lock_pid_file
+            assert_nil journal.lock_pid_file, "Only one watcher gets the lock"
+            journal.write_pid(File.open(journal.pid_file, "r+"), $$)
+            assert_equal $$, journal.watcher_pid
+            
+            journal.reset
+            assert_nil journal.read[0], "A new journal needs a full scan"
+            
+            journal.reset(["./one"])
+            File.open(journal.path, "a") { |out| out.write "./two\n./two\n./thr" }
+            paths, generation, offset = journal.read
+            assert_equal ["./one", "./two"], paths.to_a.sort
+            
+            # only the new complete lines show up from the last offset
+            File.open(journal.path, "a") { |out| out.write "ee\n" }
+            paths, generation, offset = journal.read(generation, offset)
+            assert_equal ["./three"], paths.to_a
+            
+            File.open(journal.path, "a") { |out| out.write "#{Repository::DirtyJournal::OVERFLOW}\n" }
+            assert_nil journal.read(generation, offset)[0]
+            
+            journal.reset([])
+            assert_nil journal.read(generation, offset)[0], "A different generation needs a full scan"
+            assert journal.read[0].empty?
+            
+            # what the watcher writes after the read that fed a scan survives the reset
+            paths, generation, offset = journal.read
+            File.open(journal.path, "a") { |out| out.write "./during\n" }
+            journal.reset(["./found"], generation, offset)
+            assert_equal ["./during", "./found"], journal.read[0].to_a.sort
+            
+            # unless the journal was started over in the meantime
+            paths, generation, offset = journal.read
+            journal.reset([])
+            journal.reset(["./found"], generation, offset)
+            assert_nil journal.read[0]
+            
+            lock.close
+            assert !journal.watching?
+        end
+        
+        
+        def test_scan_dirty
+            repo = Repository::Repository.new @repo_dir
+            orig = "test/dirty_orig"
+            work = "test/dirty_work"
+            FileUtils.rm_rf [orig, work]
+            FileUtils.mkdir_p [File.join(orig, "sub", "deep"), File.join(orig, "gone")]
+            
+            begin
+                ["one.txt", "sub/two.txt", "sub/deep/three.txt", "gone/four.txt"].each do |f|
+                    File.open(File.join(orig, f), "w") { |out| out.write "contents of #{f}\n" }
+                end
+                FileUtils.cp_r File.join(orig, "."), work, :preserve => true
+                repo.stat_index.update(orig)
+                
+                FileUtils.rm_rf File.join(work, "gone")
+                FileUtils.mkdir_p File.join(work, "new", "dir")
+                File.open(File.join(work, "new", "dir", "five.txt"), "w") { |out| out.write "new file\n" }
+                File.open(File.join(work, "sub", "two.txt"), "w") { |out| out.write "changed\n" }
+                File.utime(Time.now, Time.at(5000), File.join(work, "sub", "two.txt"))
+                
+                full = ChangeSet::ChangeSetBuilder.new(orig, work)
+                quick = ChangeSet::ChangeSetBuilder.new(orig, work, repo.stat_index, ["./gone", "./new", "./sub/two.txt"])
+                
+                assert_equal full.created.to_a.sort, quick.created.to_a.sort
+                assert_equal full.deleted.to_a.sort, quick.deleted.to_a.sort
+                assert_equal full.changed.keys.sort, quick.changed.keys.sort
+                assert_equal full.created_dirs.to_a.sort, quick.created_dirs.to_a.sort
+                assert_equal full.deleted_dirs.to_a.sort, quick.deleted_dirs.to_a.sort
+                assert_equal ["./sub/two.txt"], quick.changed.keys
+            ensure
+                FileUtils.rm_rf [orig, work]
+            end
+        end
+        
+        
         def test_search
             FileUtils.rm_rf @repo_dir
             repo = Repository::Repository.create(@repo_dir)
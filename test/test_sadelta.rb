@@ -3,6 +3,7 @@ require 'sadelta'
 require 'fileutils'
 require 'zlib'
 require 'digest/md5'
+require 'stringio'
 
 include SuffixArrayDelta
 
@@ -18,8 +19,8 @@ module UnitTest
         end
 
         def teardown
-            FileUtils.rm @result_file
-            FileUtils.rm @apply_file
+            FileUtils.rm_f @result_file
+            FileUtils.rm_f @apply_file
         end
     
         def test_make_apply_delta        
@@ -46,5 +47,93 @@ module UnitTest
         
             assert_equal ap_md5, tgt_md5, "Applied delta digest #{ap_md5} != target digest #{tgt_md5}"
         end
+        
+        def test_patch_delta
+            source = File.read(@source_file)
+            target = source.dup
+            # flip a few scattered bytes like a changed timestamp would
+            [100, 101, 102, 300].each { |i| target[i, 1] = "#" }
+            
+            result = File.open(@result_file, "w")
+            sa = SuffixArray.new(source)
+            gen = DeltaGenerator.new(sa, source)
+            emit = FileEmitter.new(result)
+            gen.generate(target, emit)
+            
+            assert emit.patch_count > 0, "No PATCH records were made"
+            assert_equal 0, emit.insert_count, "Changed bytes should be patched, not inserted"
+            
+            out = File.open(@apply_file, "w")
+            File.open(@result_file) do |input|
+                DeltaReader.new.apply(input, ApplyEmitter.new(source, out))
+            end
+            
+            assert_equal target, File.read(@apply_file)
+        end
+        
+        def test_lazy_suffix_array
+            source = File.read(@source_file)
+            
+            # an unchanged target is all blocks, so the suffix array is never built
+            gen = DeltaGenerator.new(nil, source)
+            gen.generate(source.dup, FileEmitter.new(StringIO.new))
+            assert !gen.sary_built?
+            
+            # a change in the middle leaves a gap that does need it
+            middle = source.length / 2
+            target = source[0, middle] + "a new line that was never in the source\n" + source[middle .. -1]
+            delta = StringIO.new
+            gen = DeltaGenerator.new(nil, source)
+            gen.generate(target, FileEmitter.new(delta, false))
+            assert gen.sary_built?
+            
+            out = StringIO.new
+            delta.rewind
+            apply_delta(source, delta, out)
+            assert_equal target, out.string
+        end
+        
+        def test_token_delta
+            source = File.read(@source_file)
+            target = File.read(@target_file)
+            
+            File.open(@result_file, "w") { |out| make_token_delta(source, target, out) }
+            File.open(@result_file) do |input|
+                File.open(@apply_file, "w") { |out| apply_delta(source, input, out) }
+            end
+            
+            assert_equal target, File.read(@apply_file)
+            
+            # every record should line up with whole lines of the target
+            log = StringIO.new
+            File.open(@result_file) { |input| DeltaReader.new.apply(input, TextEmitter.new(log)) }
+            log.string.split("\n").each do |line|
+                assert(line =~ /^[+=~] /, "Bad line in text output: #{line}")
+            end
+        end
+        
+        
+        def test_three_way_merge
+            base = (1 .. 40).collect { |i| "line #{i}\n" }.join
+            ours = base.sub("line 3\n", "line three\n").sub("line 30\n", "")
+            theirs = base.sub("line 10\n", "line ten\nline ten and a half\n") + "line 41\n"
+            
+            merger = ThreeWayMerge.new(base)
+            merged = merger.merge(ours, theirs)
+            assert_equal [], merger.conflicts
+            assert_equal theirs.sub("line 3\n", "line three\n").sub("line 30\n", ""), merged
+            
+            # the same change on both sides is fine, different ones aren't
+            assert_equal ours, merger.merge(ours, ours)
+            assert_nil merger.merge(ours, base.sub("line 3\n", "line III\n"))
+            assert_equal [[2, 3]], merger.conflicts
+            
+            # changes right next to each other conflict like diff3
+            assert_nil merger.merge(base.sub("line 4\n", "4\n"), base.sub("line 5\n", "5\n"))
+            
+            # an empty base only merges when both sides added the same thing
+            assert_equal "a\n", ThreeWayMerge.new("").merge("a\n", "a\n")
+            assert_nil ThreeWayMerge.new("").merge("a\n", "b\n")
+        end
     end
 end
@@ -103,6 +103,97 @@ module UnitTest
         end
         
         
+        def test_bucket_bytes
+            assert_equal 2, @sarray.bucket_bytes
+            
+            # every suffix must be found in full no matter how many bucket bytes are used
+            my_source = File.read("test/test_suffix_array.rb")
+            [2, 3].each do |bytes|
+                sa = SuffixArray.new(my_source, nil, nil, bytes)
+                assert_equal bytes, sa.bucket_bytes
+                
+                0.step(my_source.length - 1, 97) do |i|
+                    start, length = sa.longest_match(my_source[i, 40], 0)
+                    assert_equal my_source[i, 40].length, length, "Match length is wrong at #{i}"
+                    assert_equal my_source[i, 40], my_source[start, length]
+                end
+            end
+            
+            assert_raises SAError do
+                SuffixArray.new(@source, nil, nil, 4)
+            end
+        end
+        
+        
+        def test_extend_match
+            source = "0123456789abcdefghijklmnopqrstuvwxyz"
+            target = "0123456789abcdeXghijklmnopqrstuvwxyz"
+            sa = SuffixArray.new(source)
+            
+            start, length = sa.longest_match(target, 0)
+            assert_equal 15, length
+            
+            length, patches = sa.extend_match(target, 0, start, length, 2)
+            assert_equal target.length, length, "Match wasn't extended past the mismatch"
+            assert_equal [[15, "X".unpack("C")[0]]], patches
+            
+            # no mismatches allowed means no extension
+            length, patches = sa.extend_match(target, 0, start, 15, 0)
+            assert_equal 15, length
+            assert patches.empty?
+            
+            # a mismatch not followed by a long enough run is rolled back
+            target = "0123456789abcdeXghiYYYYYYYYYY"
+            length, patches = sa.extend_match(target, 0, start, 15, 2)
+            assert_equal 15, length
+            assert patches.empty?
+        end
+        
+        
+        def test_token_array
+            # tokens 1 2 3 1 2 4 like lines "a b c a b d"
+            tsa = TokenSuffixArray.new([1, 2, 3, 1, 2, 4].pack("i*"))
+            assert_equal 6, tsa.length
+            
+            start, length = tsa.longest_match([1, 2, 4].pack("i*"), 0)
+            assert_equal [3, 3], [start, length]
+            
+            # token 9 isn't in the source so it's the non-matching part
+            non_len, start, length = tsa.longest_nonmatch([9, 9, 2, 3, 1].pack("i*"), 0, 0)
+            assert_equal [2, 1, 3], [non_len, start, length]
+            
+            assert_raises SAError do
+                TokenSuffixArray.new([1, 3].pack("i*"))
+            end
+        end
+        
+        
+        def test_next_block_match
+            source = "0123456789abcdefghijklmnopqrstuvwxyz" * 4
+            target = "XXXXX" + source[0, 70] + "YYYYY"
+            sa = SuffixArray.new(source)
+            
+            tgt_start, src_start, length = sa.next_block_match(target, 0, 16)
+            assert_equal 5, tgt_start
+            assert_equal 70, length
+            assert_equal target[tgt_start, length], source[src_start, length]
+            
+            # backward extension stops at from_index
+            tgt_start, src_start, length = sa.next_block_match(target, 10, 16)
+            assert_equal 10, tgt_start
+            assert_equal target[tgt_start, length], source[src_start, length]
+            
+            assert_nil sa.next_block_match("X" * 100, 0, 16)
+            assert_nil sa.next_block_match(target, 0, 200)
+            
+            # a BlockIndex gives the same answers without the suffix array
+            bi = BlockIndex.new(source)
+            assert_equal sa.next_block_match(target, 0, 16), bi.next_block_match(target, 0, 16)
+            assert_equal sa.extend_match(target, 5, 0, 10, 2), bi.extend_match(target, 5, 0, 10, 2)
+            assert_nil BlockIndex.new("").next_block_match(target, 0, 16)
+        end
+        
+        
         def test_match_all
             sa = SuffixArray.new("ab|abc|abcd|abcde|fffffab|abc|ab")
             res = sa.match("ab")